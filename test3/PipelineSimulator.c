@@ -3,8 +3,16 @@
 #include <string.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <limits.h>
 
-#define NUM_REGS 16
+#define MAX_REGS 32        // register storage; cfg.num_regs of them are architectural
 #define LINE_LEN 128
 #define MAX_INST 512
 #define REG_UNUSED (-1)
@@ -12,32 +20,83 @@
 #define WORD_SIZE_BYTES 4
 #define MEMORY_SIZE 4096
 #define REGISTER_MEMORY_BASE 1000   // starting address for registers in memory
+#define CACHE_MAX_LINES 1024        // upper bound on modelled data cache lines
+#define TLB_MAX_ENTRIES 256         // upper bound on modelled entries per TLB level
+#define MEM_BYTES (MEM_SIZE_WORDS * WORD_SIZE_BYTES)
+#define MAX_GUARDS 8                // guard regions per program image
+#define CACHE_LINE_BYTES 64         // host cache line, for the CPU layout
 
 
 
 
 /**
  * @brief Validate register index
- * @param r Register index (0..NUM_REGS-1, or -1 for unused)
+ * @param r Register index (0..MAX_REGS-1, or -1 for unused)
  * @return true if valid, false otherwise
  */
 static inline bool reg_valid(int r) {
-    return r == REG_UNUSED || (r >= 0 && r < NUM_REGS);
+    return r == REG_UNUSED || (r >= 0 && r < MAX_REGS);
 }
 
 // ---------- ISA ----------
-typedef enum { OP_NOOP, OP_MOV, OP_ADD, OP_SUB, OP_MUL, OP_LOAD, OP_STORE } OpCode;
+typedef enum { OP_NOOP, OP_MOV, OP_ADD, OP_SUB, OP_MUL, OP_LOAD, OP_STORE, OP_RFE, OP_COUNT } OpCode;
+
+// What the ALU computes for an opcode in EX
+typedef enum { ALU_NONE, ALU_IMM, ALU_ADD, ALU_SUB, ALU_MUL, ALU_ADDR } AluFunc;
+
+// Static properties of an opcode. The stages look these up instead of testing the
+// opcode, so a new opcode is a new row here rather than new branches in every stage.
+typedef struct {
+    const char* name;
+    bool live;          // does work in the pipeline (false for NOP)
+    bool reads_rs1, reads_rs2, writes_rd;
+    bool is_mem, is_load, is_store;
+    bool long_latency;  // takes mul_latency cycles in EX
+    bool redirect;      // fetch continues at epc once decoded (RFE)
+    AluFunc alu;
+    int base;           // operand slot holding a LOAD/STORE base (0 = rs1, 1 = rs2); the other is data
+} OpInfo;
+
+static const OpInfo OP_INFO[OP_COUNT] = {
+    //           name     live   rs1    rs2    rd     mem    load   store  long   redir  alu       base
+    [OP_NOOP]  = { "NOP",   false, false, false, false, false, false, false, false, false, ALU_NONE, 0 },
+    [OP_MOV]   = { "MOV",   true,  false, false, true,  false, false, false, false, false, ALU_IMM,  0 },
+    [OP_ADD]   = { "ADD",   true,  true,  true,  true,  false, false, false, false, false, ALU_ADD,  0 },
+    [OP_SUB]   = { "SUB",   true,  true,  true,  true,  false, false, false, false, false, ALU_SUB,  0 },
+    [OP_MUL]   = { "MUL",   true,  true,  true,  true,  false, false, false, true,  false, ALU_MUL,  0 },
+    [OP_LOAD]  = { "LOAD",  true,  true,  false, true,  true,  true,  false, false, false, ALU_ADDR, 0 },
+    [OP_STORE] = { "STORE", true,  true,  true,  false, true,  false, true,  false, false, ALU_ADDR, 1 },
+    [OP_RFE]   = { "RFE",   true,  false, false, false, false, false, false, false, true,  ALU_NONE, 0 },
+};
 
 typedef struct {
     OpCode op;
     int rd, rs1, rs2;   // -1 if not used
     int imm;            // used for MOV and offset for loads/stores
     int valid;          // 1 if this instruction slot contains a real inst
-    char text[LINE_LEN];
+    int idx;            // position in the program (-1 for bubbles)
 } Instruction;
 
+// Source text of an instruction. It is kept beside the program (CPU::source) rather than
+// in Instruction, so the pipeline latches carry only the decoded fields.
+typedef char SourceLine[LINE_LEN];
+
+/**
+ * @brief Properties of an instruction's opcode (a bubble is a NOP)
+ */
+static inline const OpInfo* op_info(const Instruction* in) {
+    return &OP_INFO[in->op];
+}
+
+/**
+ * @brief Does the slot hold an instruction that does work (not a bubble or NOP)?
+ */
+static inline bool inst_live(const Instruction* in) {
+    return in->valid && OP_INFO[in->op].live;
+}
+
 // For tracing where an operand came from
-typedef enum { SRC_NONE, SRC_REG, SRC_MEM, SRC_WB } FwdSrc;
+typedef enum { SRC_NONE, SRC_REG, SRC_MEM, SRC_WB, SRC_ID, SRC_PRED } FwdSrc;
 
 typedef struct {
     Instruction inst;
@@ -46,34 +105,216 @@ typedef struct {
     int val_rs2;        // resolved operand 2 (after forwarding)
     FwdSrc src_rs1;     // SRC_REG/SRC_MEM/SRC_WB/SRC_NONE
     FwdSrc src_rs2;     // SRC_REG/SRC_MEM/SRC_WB/SRC_NONE
+
+    // Fused pairs (see decode_stage). Program indices, -1 = none.
+    int pre;            // older op folded in at decode; its value is known there
+    int pre_value;
+    int post;           // younger op completed in MEM once this LOAD's data arrives
+    int post_rs1, post_rs2;  // its operands that do not come from the LOAD
+    int post_result;
+
+    bool predicted;     // LOAD whose value the load value predictor supplied at decode
+    int pred_value;
 } StageLatch;
 
-// ---------- CPU container (no globals) ----------
+// ---------- Pipeline parameters ----------
+// Which producer latches EX may take operands from.
+//  FWD_FULL: EX/MEM (after MEM, including load data) and MEM/WB
+//  FWD_ALU : ALU results only; loaded data must be read from MEM/WB (1-cycle load-use stall)
+//  FWD_NONE: no bypassing; consumers wait in ID until the producer has left EX/MEM
+typedef enum { FWD_NONE, FWD_ALU, FWD_FULL } ForwardPolicy;
+
 typedef struct {
-    int R[NUM_REGS];               // Register file
-    Instruction program[MAX_INST]; // Instruction memory
-    int inst_count;                // Number of instructions loaded
+    int forwarding;        // ForwardPolicy
+    int mul_latency;       // cycles a MUL occupies EX (1 = single cycle)
+    int mem_latency;       // extra MEM cycles per access that misses (every access when there is no cache)
+    int cache_bytes;       // data cache capacity in bytes (0 = no cache modelled)
+    int cache_line_bytes;  // data cache line size in bytes
+    int cache_assoc;       // data cache ways per set
+    int fusion;            // FusionRule bits enabled in decode
+    int move_elim;         // MOVs and zero idioms complete in decode (0/1)
+    int lvp;               // LoadPredictor mode for loads feeding a stalled consumer
+    int lvp_entries;       // predictor table size (power of two); entry = program index mod size
+    int vm;                // translate MEM addresses through the page table (0/1)
+    int page_bytes;        // base page size in bytes
+    int huge_pages;        // map page-table-free regions with directory leaves (0/1)
+    int tlb_entries;       // L1 data TLB entries
+    int tlb2_entries;      // L2 TLB entries (0 = no second level)
+    int tlb2_latency;      // extra MEM cycles for an L2 TLB hit
+    int walk_latency;      // extra MEM cycles per page-table level walked
+    int num_regs;          // architectural registers (R0..num_regs-1)
+    int rf_read_ports;     // register file read ports (0 = unlimited)
+    int rf_write_ports;    // register file write ports (0 = unlimited)
+} SimConfig;
+
+// Load value prediction (only where a load-use stall exists, i.e. forwarding != full)
+typedef enum { LVP_OFF, LVP_LAST, LVP_STRIDE } LoadPredictor;
+
+// Macro-op fusion rules: adjacent pairs decode may merge into one pipeline slot
+typedef enum {
+    FUSE_MOV_ALU  = 1,     // MOV Rx, imm + ADD/SUB/MUL reading Rx
+    FUSE_LOAD_ADD = 2,     // LOAD Rx + ADD reading Rx (the add runs in MEM)
+    FUSE_ALL      = 3
+} FusionRule;
+
+// Why the front of the pipeline did not advance in a cycle
+typedef enum {
+    STALL_NONE,
+    STALL_STORE_LOAD,   // STORE→LOAD to the same address
+    STALL_RAW,          // operand not reachable under the forwarding policy
+    STALL_EX_BUSY,      // multi-cycle operation still in EX
+    STALL_MEM_BUSY,     // MEM waiting on the memory system
+    STALL_REPLAY,       // front refetched after a load value mispredict
+    STALL_RF_READ,      // EX needs more register file reads than there are read ports
+    STALL_RF_WRITE,     // WB needs more register writes than there are write ports
+    STALL_EXCEPTION,    // younger instructions flushed for a faulting access
+    STALL_COUNT
+} StallCause;
+
+typedef struct {
+    long long cycles;
+    long long retired;             // instructions written back
+    long long stall[STALL_COUNT];  // cycles lost, by cause
+    long long cache_hits, cache_misses;
+    long long fused;               // instructions merged into an older or younger slot
+    long long eliminated;          // MOVs / zero idioms completed in decode (move_elim)
+    long long zero_idioms;         //   of which SUB Rx, Ry, Ry
+    long long operand_src[SRC_PRED + 1];  // EX operands by FwdSrc
+    long long loads;               // LOADs that reached MEM
+    long long lvp_predicted, lvp_correct, lvp_replays;
+    long long tlb_hits[2];         // L1 / L2 TLB hits
+    long long tlb_walks;           // page walks (misses in every TLB level)
+    long long tlb_cycles;          // MEM cycles spent on L2 hits and walks
+    long long exceptions;          // faulting accesses taken as precise exceptions
+    long long exc_cycles;          // cycles from each fault until the next instruction retires
+    long long exc_squashed;        // younger instructions flushed by exceptions
+    long long handler_retired;     // exception handler instructions written back
+} SimStats;
+
+// Last-value / stride predictor indexed by program index. Kernels here are straight-line
+// code, so a table smaller than the program lets unrolled iterations share entries.
+#define LVP_CONFIDENT 2         // 2-bit counter value from which predictions are used
+
+typedef struct {
+    int last;
+    int stride;
+    unsigned char conf;
+} LvpEntry;
+
+// Set-associative data cache with LRU replacement (tags only; data lives in memory[])
+typedef struct {
+    int sets, ways, line_bytes;
+    int tag[CACHE_MAX_LINES];
+    bool valid[CACHE_MAX_LINES];
+    long long last_use[CACHE_MAX_LINES];
+    long long tick;
+} DataCache;
+
+// One TLB level: fully associative with LRU replacement. It only models timing; the
+// translation itself always comes from the page table in memory (vm_walk).
+typedef struct {
+    int vpn;            // virtual page number, in huge pages for a huge entry
+    int asid;           // address space (SMT thread)
+    bool huge, valid;
+    long long last_use;
+} TlbEntry;
+
+typedef struct {
+    int entries;
+    TlbEntry e[TLB_MAX_ENTRIES];
+    long long tick;
+} Tlb;
+
+// Why an access faults. Faults are architectural: they do not depend on the timing
+// parameters (page size, TLBs), so a guard region is checked at byte granularity.
+typedef enum { FAULT_NONE, FAULT_RANGE, FAULT_UNMAPPED, FAULT_GUARD } FaultKind;
+static const char* const FAULT_NAMES[] = { "", "address out of range", "page not mapped", "guard page" };
+
+typedef struct {
+    int lo, hi;         // byte addresses [lo, hi)
+} GuardRegion;
+
+// Data memory access performed by MEM this cycle (shown as a "[MEM]" trace line)
+typedef enum { MEM_EV_NONE, MEM_EV_STORE, MEM_EV_LOAD, MEM_EV_FAULT } MemEventType;
+
+typedef struct {
+    int type;           // MemEventType
+    int reg;            // STORE source / LOAD destination register
+    int value;          // data stored or loaded (FaultKind for a fault)
+    int addr;           // byte address
+} MemEvent;
+
+struct CPU;
+struct TraceRecord;
+struct TraceText;
+// Per-cycle observer (comparators, binary trace writers); called after each cycle is computed
+typedef void (*CycleHook)(void* ctx, const struct CPU* cpu, const struct TraceRecord* rec);
+// Data access observer (address traces, cache studies); called for each MEM stage access
+// with its MemEventType, effective byte address, program index and cycle
+typedef void (*AccessHook)(void* ctx, int type, int addr, int idx, long long cycle);
+
+// ---------- CPU container (no globals) ----------
+// What every cycle reads or writes comes first, starting on a cache line, so a cycle
+// touches a short run of adjacent lines and the CPUs of different worker threads never
+// share one. The program, its source lines and the data memory are separate
+// allocations (cpu_new); a copy (cpu_copy) takes only the instructions in use. Latches
+// hold decoded instructions only; their text is looked up in source by index.
+typedef struct CPU {
+    // ---- hot ----
+    _Alignas(CACHE_LINE_BYTES) int R[MAX_REGS]; // Register file
     int PC;                        // Program Counter
+    int inst_count;                // Number of instructions loaded
+    Instruction *program;          // Instruction memory (MAX_INST entries)
 
     // Simple memory (word-addressable). Addresses are byte addresses; we index by word (address/4).
-    int memory[MEM_SIZE_WORDS];
+    int *memory;                   // MEM_SIZE_WORDS words
+
+    // Exceptions: program[handler, inst_count) is the handler (-1 = none); the main
+    // program ends where it starts. RFE resumes at epc.
+    int handler;
+    int epc;
+    long long exc_start;           // cycle the pending exception was taken (-1 = none)
+    int nguards;                   // entries of guard[] in use
 
     // Pipeline latches
     StageLatch pipeline_IF_ID, pipeline_ID_EX, pipeline_EX_MEM, pipeline_MEM_WB;
+
+    // Multi-cycle stage occupancy: *_started is cleared whenever a new latch enters the stage
+    bool ex_started, mem_started;
+    int ex_wait, mem_wait;         // remaining extra cycles in EX / MEM
+    int ex_read_wait;              // remaining EX cycles waiting for register file read ports
+    bool wb_started;
+    int wb_wait;                   // remaining extra WB cycles waiting for write ports
+
+    int fetch_high;                // program[0, fetch_high) has been fetched at some point
+    SimConfig cfg;
+    SimStats stats;
+    MemEvent mem_event;            // this cycle's data access, for the trace
+    FILE *trace;                   // cycle trace destination (NULL = no tracing)
+    struct TraceText *trace_text;  // buffered text trace, used instead of trace when set
+    CycleHook on_cycle;            // optional per-cycle observer
+    void *on_cycle_ctx;
+    AccessHook on_access;          // optional data access observer
+    void *on_access_ctx;
+
+    // ---- cold: read per access only when the feature is on ----
+    _Alignas(CACHE_LINE_BYTES) GuardRegion guard[MAX_GUARDS]; // accesses here fault
+    SourceLine *source;            // source line of each instruction (trace and messages only)
+    DataCache dcache;
+    Tlb tlb[2];                    // L1 and L2 data TLB (vm)
+    LvpEntry lvp[MAX_INST];        // load value predictor
 } CPU;
 
+// Layout check: growing the hot state past this many lines should be a deliberate choice.
+#define CPU_HOT_LINES 15
+_Static_assert(offsetof(CPU, guard) <= CPU_HOT_LINES * CACHE_LINE_BYTES,
+               "CPU hot state no longer fits in CPU_HOT_LINES cache lines");
+_Static_assert(offsetof(CPU, R) == 0 && _Alignof(CPU) == CACHE_LINE_BYTES,
+               "CPU hot state must start on a cache line");
+
 // ---------- Helpers ----------
 const char* opcode_name(OpCode op) {
-    switch(op) {
-        case OP_MOV: return "MOV";
-        case OP_ADD: return "ADD";
-        case OP_SUB: return "SUB";
-        case OP_MUL: return "MUL";
-        case OP_LOAD: return "LOAD";
-        case OP_STORE: return "STORE";
-        case OP_NOOP: return "NOP";
-        default: return "UNK";
-    }
+    return op >= 0 && op < OP_COUNT ? OP_INFO[op].name : "UNK";
 }
 
 /**
@@ -86,22 +327,190 @@ Instruction make_nop() {
     i.rd = i.rs1 = i.rs2 = REG_UNUSED;
     i.imm = 0;
     i.valid = 0;
-    strcpy(i.text, "NOP");
+    i.idx = -1;
     return i;
 }
-Instruction make_invalid_instruction(const char *reason) {
+Instruction make_invalid_instruction(char *text, const char *reason) {
     Instruction ins = make_nop(); // create a NOP as base
     ins.valid = 0;
-    snprintf(ins.text, LINE_LEN, "ERROR: %s", reason);
+    snprintf(text, LINE_LEN, "ERROR: %s", reason);
     return ins;
 }
 
+// ---------- Configuration ----------
+static const char* const FORWARD_NAMES[] = { "none", "alu", "full" };
+
+/**
+ * @brief Default parameters: the original ideal 5-stage machine
+ */
+SimConfig default_config() {
+    SimConfig c;
+    c.forwarding = FWD_FULL;
+    c.mul_latency = 1;
+    c.mem_latency = 0;
+    c.cache_bytes = 0;
+    c.cache_line_bytes = 16;
+    c.cache_assoc = 1;
+    c.fusion = 0;
+    c.move_elim = 0;
+    c.lvp = LVP_OFF;
+    c.lvp_entries = 64;
+    c.vm = 0;
+    c.page_bytes = 64;
+    c.huge_pages = 0;
+    c.tlb_entries = 8;
+    c.tlb2_entries = 0;
+    c.tlb2_latency = 2;
+    c.walk_latency = 2;
+    c.num_regs = 16;
+    c.rf_read_ports = 0;
+    c.rf_write_ports = 0;
+    return c;
+}
+
+// Name -> field table shared by --set and the design-space explorer
+typedef struct {
+    const char *name;
+    size_t offset;
+    int min;
+} ConfigParam;
+
+static const ConfigParam CONFIG_PARAMS[] = {
+    { "forwarding",  offsetof(SimConfig, forwarding),       0 },
+    { "mul_latency", offsetof(SimConfig, mul_latency),      1 },
+    { "mem_latency", offsetof(SimConfig, mem_latency),      0 },
+    { "cache_bytes", offsetof(SimConfig, cache_bytes),      0 },
+    { "cache_line",  offsetof(SimConfig, cache_line_bytes), WORD_SIZE_BYTES },
+    { "cache_assoc", offsetof(SimConfig, cache_assoc),      1 },
+    { "fusion",      offsetof(SimConfig, fusion),           0 },
+    { "move_elim",   offsetof(SimConfig, move_elim),        0 },
+    { "lvp",         offsetof(SimConfig, lvp),              0 },
+    { "lvp_entries", offsetof(SimConfig, lvp_entries),      1 },
+    { "vm",          offsetof(SimConfig, vm),               0 },
+    { "page_bytes",  offsetof(SimConfig, page_bytes),       16 },
+    { "huge_pages",  offsetof(SimConfig, huge_pages),       0 },
+    { "tlb_entries", offsetof(SimConfig, tlb_entries),      1 },
+    { "tlb2_entries", offsetof(SimConfig, tlb2_entries),    0 },
+    { "tlb2_latency", offsetof(SimConfig, tlb2_latency),    0 },
+    { "walk_latency", offsetof(SimConfig, walk_latency),    0 },
+    { "num_regs",    offsetof(SimConfig, num_regs),         2 },
+    { "rf_read_ports", offsetof(SimConfig, rf_read_ports),  0 },
+    { "rf_write_ports", offsetof(SimConfig, rf_write_ports), 0 },
+};
+#define NUM_CONFIG_PARAMS ((int)(sizeof(CONFIG_PARAMS) / sizeof(CONFIG_PARAMS[0])))
+
+const ConfigParam* config_param_find(const char *name) {
+    for (int i = 0; i < NUM_CONFIG_PARAMS; ++i)
+        if (strcmp(CONFIG_PARAMS[i].name, name) == 0) return &CONFIG_PARAMS[i];
+    return NULL;
+}
+
+static int* config_field(SimConfig *c, const ConfigParam *p) {
+    return (int*)((char*)c + p->offset);
+}
+
+static int config_get(const SimConfig *c, const ConfigParam *p) {
+    return *(const int*)((const char*)c + p->offset);
+}
+
+/**
+ * @brief Parse a parameter value (forwarding accepts none/alu/full)
+ * @return 0 on success, -1 if the value is malformed or below the minimum
+ */
+int config_parse_value(const ConfigParam *p, const char *str, int *out) {
+    if (p->offset == offsetof(SimConfig, forwarding)) {
+        for (int i = 0; i <= FWD_FULL; ++i)
+            if (strcasecmp(str, FORWARD_NAMES[i]) == 0) { *out = i; return 0; }
+        return -1;
+    }
+    char *end;
+    long v = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || v < p->min || v > 1 << 24) return -1;
+    *out = (int)v;
+    return 0;
+}
+
+/**
+ * @brief Apply "name=value" to a configuration
+ * @return 0 on success, -1 on unknown name or bad value
+ */
+int config_set(SimConfig *c, const char *assignment) {
+    char name[64];
+    const char *eq = strchr(assignment, '=');
+    if (!eq || (size_t)(eq - assignment) >= sizeof(name)) return -1;
+    memcpy(name, assignment, eq - assignment);
+    name[eq - assignment] = '\0';
+
+    const ConfigParam *p = config_param_find(name);
+    int v;
+    if (!p || config_parse_value(p, eq + 1, &v) != 0) return -1;
+    *config_field(c, p) = v;
+    return 0;
+}
+
+/**
+ * @brief Check the decode options and that the cache geometry is realisable
+ * @return NULL if valid, otherwise a description of the problem
+ */
+const char* config_validate(const SimConfig *c) {
+    if (c->fusion & ~FUSE_ALL)
+        return "fusion must be a mask of 1 (MOV+ALU) and 2 (LOAD+ADD)";
+    if (c->move_elim > 1)
+        return "move_elim must be 0 or 1";
+    if (c->lvp > LVP_STRIDE)
+        return "lvp must be 0 (off), 1 (last value) or 2 (stride)";
+    if (c->lvp_entries > MAX_INST || (c->lvp_entries & (c->lvp_entries - 1)) != 0)
+        return "lvp_entries must be a power of two no larger than the program limit";
+    if (c->vm > 1 || c->huge_pages > 1)
+        return "vm and huge_pages must be 0 or 1";
+    if (c->page_bytes > 128 || (c->page_bytes & (c->page_bytes - 1)) != 0)
+        return "page_bytes must be a power of two from 16 to 128";
+    if (c->tlb_entries > TLB_MAX_ENTRIES || c->tlb2_entries > TLB_MAX_ENTRIES)
+        return "TLB has too many entries";
+    if (c->num_regs > MAX_REGS)
+        return "num_regs is larger than the register storage (32)";
+    if (c->cache_bytes == 0) return NULL;
+    int line = c->cache_line_bytes;
+    if (line % WORD_SIZE_BYTES != 0 || (line & (line - 1)) != 0)
+        return "cache_line must be a power of two multiple of the word size";
+    if (c->cache_bytes % (line * c->cache_assoc) != 0)
+        return "cache_bytes must be a multiple of cache_line * cache_assoc";
+    if (c->cache_bytes / line > CACHE_MAX_LINES)
+        return "cache has too many lines";
+    return NULL;
+}
+
+/**
+ * @brief Render a configuration as space-separated name=value pairs
+ */
+void config_format(char *buf, size_t size, const SimConfig *c) {
+    size_t used = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < NUM_CONFIG_PARAMS && used < size; ++i) {
+        const ConfigParam *p = &CONFIG_PARAMS[i];
+        if (p->offset == offsetof(SimConfig, forwarding))
+            used += snprintf(buf + used, size - used, "%s%s=%s", i ? " " : "", p->name, FORWARD_NAMES[c->forwarding]);
+        else
+            used += snprintf(buf + used, size - used, "%s%s=%d", i ? " " : "", p->name, config_get(c, p));
+    }
+}
+
+void config_print(FILE *out, const SimConfig *c) {
+    char buf[512];
+    config_format(buf, sizeof(buf), c);
+    fputs(buf, out);
+}
+
 StageLatch make_nop_latch() {
     StageLatch s;
     s.inst = make_nop();
     s.alu_result = 0;
     s.val_rs1 = s.val_rs2 = 0;
     s.src_rs1 = s.src_rs2 = SRC_NONE;
+    s.pre = s.post = -1;
+    s.pre_value = s.post_rs1 = s.post_rs2 = s.post_result = 0;
+    s.predicted = false;
+    s.pred_value = 0;
     return s;
 }
 
@@ -115,21 +524,22 @@ void init_pipeline(CPU* cpu) {
 /**
  * @brief Parse a line of assembly into an Instruction
  * @param line Input string (one assembly instruction)
- * @return Parsed Instruction (valid=0 if error, with error text)
+ * @param text Receives the source line, or the error for an invalid one (LINE_LEN bytes)
+ * @return Parsed Instruction (valid=0 if error)
  */
 // ---------- Modular Parsing ----------
 
 /**
  * @brief Parse MOV instruction
  */
-Instruction parse_mov(char *rd_str, char *imm_str) {
+Instruction parse_mov(char *rd_str, char *imm_str, char *text) {
     Instruction ins = make_nop();
 
-    if (!rd_str || sscanf(rd_str, "R%d", &ins.rd) != 1 || ins.rd < 0 || ins.rd >= NUM_REGS)
-        return make_invalid_instruction("Invalid destination register in MOV");
+    if (!rd_str || sscanf(rd_str, "R%d", &ins.rd) != 1 || ins.rd < 0 || ins.rd >= MAX_REGS)
+        return make_invalid_instruction(text, "Invalid destination register in MOV");
 
     if (!imm_str || sscanf(imm_str, "%d", &ins.imm) != 1)
-        return make_invalid_instruction("Invalid immediate in MOV");
+        return make_invalid_instruction(text, "Invalid immediate in MOV");
 
     ins.op = OP_MOV;
     ins.rs1 = ins.rs2 = REG_UNUSED;
@@ -140,17 +550,17 @@ Instruction parse_mov(char *rd_str, char *imm_str) {
 /**
  * @brief Parse R-type instruction (ADD, SUB, MUL)
  */
-Instruction parse_rtype(OpCode op, char *rd_str, char *rs1_str, char *rs2_str) {
+Instruction parse_rtype(OpCode op, char *rd_str, char *rs1_str, char *rs2_str, char *text) {
     Instruction ins = make_nop();
 
-    if (!rd_str  || sscanf(rd_str, "R%d", &ins.rd)  != 1 || ins.rd  < 0 || ins.rd  >= NUM_REGS)
-        return make_invalid_instruction("Invalid destination register");
+    if (!rd_str  || sscanf(rd_str, "R%d", &ins.rd)  != 1 || ins.rd  < 0 || ins.rd  >= MAX_REGS)
+        return make_invalid_instruction(text, "Invalid destination register");
 
-    if (!rs1_str || sscanf(rs1_str, "R%d", &ins.rs1) != 1 || ins.rs1 < 0 || ins.rs1 >= NUM_REGS)
-        return make_invalid_instruction("Invalid source register 1");
+    if (!rs1_str || sscanf(rs1_str, "R%d", &ins.rs1) != 1 || ins.rs1 < 0 || ins.rs1 >= MAX_REGS)
+        return make_invalid_instruction(text, "Invalid source register 1");
 
-    if (!rs2_str || sscanf(rs2_str, "R%d", &ins.rs2) != 1 || ins.rs2 < 0 || ins.rs2 >= NUM_REGS)
-        return make_invalid_instruction("Invalid source register 2");
+    if (!rs2_str || sscanf(rs2_str, "R%d", &ins.rs2) != 1 || ins.rs2 < 0 || ins.rs2 >= MAX_REGS)
+        return make_invalid_instruction(text, "Invalid source register 2");
 
     ins.op = op;
     ins.imm = 0;
@@ -179,14 +589,14 @@ int parse_offset_reg(const char *s, int *out_offset, int *out_reg) {
 /**
  * @brief Parse LOAD instruction: load Rdst, OFFSET(Rbase)
  */
-Instruction parse_load(char *rd_str, char *addr_str) {
+Instruction parse_load(char *rd_str, char *addr_str, char *text) {
     Instruction ins = make_nop();
-    if (!rd_str || sscanf(rd_str, "R%d", &ins.rd) != 1 || ins.rd < 0 || ins.rd >= NUM_REGS)
-        return make_invalid_instruction("Invalid destination register in LOAD");
+    if (!rd_str || sscanf(rd_str, "R%d", &ins.rd) != 1 || ins.rd < 0 || ins.rd >= MAX_REGS)
+        return make_invalid_instruction(text, "Invalid destination register in LOAD");
 
     int base = -1, off = 0;
-    if (!addr_str || !parse_offset_reg(addr_str, &off, &base) || base < 0 || base >= NUM_REGS)
-        return make_invalid_instruction("Invalid address in LOAD");
+    if (!addr_str || !parse_offset_reg(addr_str, &off, &base) || base < 0 || base >= MAX_REGS)
+        return make_invalid_instruction(text, "Invalid address in LOAD");
 
     ins.op = OP_LOAD;
     ins.rs1 = base;    // base register
@@ -199,14 +609,14 @@ Instruction parse_load(char *rd_str, char *addr_str) {
 /**
  * @brief Parse STORE instruction: store Rsrc, OFFSET(Rbase)
  */
-Instruction parse_store(char *rs_str, char *addr_str) {
+Instruction parse_store(char *rs_str, char *addr_str, char *text) {
     Instruction ins = make_nop();
-    if (!rs_str || sscanf(rs_str, "R%d", &ins.rs1) != 1 || ins.rs1 < 0 || ins.rs1 >= NUM_REGS)
-        return make_invalid_instruction("Invalid source register in STORE");
+    if (!rs_str || sscanf(rs_str, "R%d", &ins.rs1) != 1 || ins.rs1 < 0 || ins.rs1 >= MAX_REGS)
+        return make_invalid_instruction(text, "Invalid source register in STORE");
 
     int base = -1, off = 0;
-    if (!addr_str || !parse_offset_reg(addr_str, &off, &base) || base < 0 || base >= NUM_REGS)
-        return make_invalid_instruction("Invalid address in STORE");
+    if (!addr_str || !parse_offset_reg(addr_str, &off, &base) || base < 0 || base >= MAX_REGS)
+        return make_invalid_instruction(text, "Invalid address in STORE");
 
     ins.op = OP_STORE;
     ins.rd = REG_UNUSED;
@@ -219,21 +629,23 @@ Instruction parse_store(char *rs_str, char *addr_str) {
 /**
  * @brief Dispatch parsing based on opcode
  */
-Instruction parse_line(char *line) {
+Instruction parse_line(char *line, char *text) {
     char temp_line[LINE_LEN];
     strcpy(temp_line, line);
 
-    char *opcode_str = strtok(temp_line, " ,\t\n");
+    // strtok_r: random programs are parsed by several fuzz workers at once
+    char *save = NULL;
+    char *opcode_str = strtok_r(temp_line, " ,\t\n", &save);
     if (!opcode_str)
-        return make_invalid_instruction("Missing opcode");
+        return make_invalid_instruction(text, "Missing opcode");
 
     Instruction ins = make_nop();
 
     if (strcasecmp(opcode_str, "mov") == 0) {
         // MOV R1, 10
-        char *rd_str = strtok(NULL, " ,\t\n");
-        char *imm_str = strtok(NULL, " ,\t\n");
-        ins = parse_mov(rd_str, imm_str);
+        char *rd_str = strtok_r(NULL, " ,\t\n", &save);
+        char *imm_str = strtok_r(NULL, " ,\t\n", &save);
+        ins = parse_mov(rd_str, imm_str, text);
     }
     else if (strcasecmp(opcode_str, "add") == 0 ||
              strcasecmp(opcode_str, "sub") == 0 ||
@@ -243,25 +655,32 @@ Instruction parse_line(char *line) {
                     (strcasecmp(opcode_str, "sub") == 0) ? OP_SUB : OP_MUL;
 
         // ADD R1, R2, R3
-        char *rd_str  = strtok(NULL, " ,\t\n");
-        char *rs1_str = strtok(NULL, " ,\t\n");
-        char *rs2_str = strtok(NULL, " ,\t\n");
-        ins = parse_rtype(op, rd_str, rs1_str, rs2_str);
+        char *rd_str  = strtok_r(NULL, " ,\t\n", &save);
+        char *rs1_str = strtok_r(NULL, " ,\t\n", &save);
+        char *rs2_str = strtok_r(NULL, " ,\t\n", &save);
+        ins = parse_rtype(op, rd_str, rs1_str, rs2_str, text);
     }
     else if (strcasecmp(opcode_str, "load") == 0) {
         // LOAD R5, 8(R0)
-        char *rd_str = strtok(NULL, " ,\t\n");
-        char *addr_str = strtok(NULL, " ,\t\n");
-        ins = parse_load(rd_str, addr_str);
+        char *rd_str = strtok_r(NULL, " ,\t\n", &save);
+        char *addr_str = strtok_r(NULL, " ,\t\n", &save);
+        ins = parse_load(rd_str, addr_str, text);
     }
     else if (strcasecmp(opcode_str, "store") == 0) {
         // STORE R3, 8(R0)
-        char *rs_str = strtok(NULL, " ,\t\n");
-        char *addr_str = strtok(NULL, " ,\t\n");
-        ins = parse_store(rs_str, addr_str);
+        char *rs_str = strtok_r(NULL, " ,\t\n", &save);
+        char *addr_str = strtok_r(NULL, " ,\t\n", &save);
+        ins = parse_store(rs_str, addr_str, text);
+    }
+    else if (strcasecmp(opcode_str, "rfe") == 0) {
+        // RFE (return from exception)
+        if (strtok_r(NULL, " ,\t\n", &save))
+            return make_invalid_instruction(text, "RFE takes no operands");
+        ins.op = OP_RFE;
+        ins.valid = 1;
     }
     else {
-        return make_invalid_instruction("Unknown opcode");
+        return make_invalid_instruction(text, "Unknown opcode");
     }
 
     // trim trailing newline from original line
@@ -270,8 +689,8 @@ Instruction parse_line(char *line) {
     // remove trailing newline
     size_t L = strlen(tline);
     while (L>0 && (tline[L-1]=='\n' || tline[L-1]=='\r')) { tline[L-1]=0; --L; }
-    strncpy(ins.text, tline, LINE_LEN-1);
-    ins.text[LINE_LEN-1]=0;
+    strncpy(text, tline, LINE_LEN-1);
+    text[LINE_LEN-1]=0;
 
     return ins;
 }
@@ -286,45 +705,203 @@ Instruction parse_line(char *line) {
  * @return Computed result
  */
 int alu_execute(OpCode op, int a, int b, int imm) {
-    switch (op) {
-        case OP_MOV: return imm;
-        case OP_ADD: return a + b;
-        case OP_SUB: return a - b;
-        case OP_MUL: return a * b;
-        case OP_LOAD:
-        case OP_STORE:
-            // For loads/stores, EX stage computes effective address (byte address).
-            return a + imm;
-        case OP_NOOP: return 0;
+    // Arithmetic wraps (two's complement) rather than overflowing into undefined behaviour.
+    switch (OP_INFO[op].alu) {
+        case ALU_IMM: return imm;
+        case ALU_ADD: return (int)((unsigned)a + (unsigned)b);
+        case ALU_SUB: return (int)((unsigned)a - (unsigned)b);
+        case ALU_MUL: return (int)((unsigned)a * (unsigned)b);
+        // For loads/stores, EX stage computes effective address (byte address).
+        case ALU_ADDR: return (int)((unsigned)a + (unsigned)imm);
         default: return 0;
     }
 }
 
+// ---------- Program images ----------
+// Besides instructions, a program file may carry its initial state and the
+// expected final state, so that a benchmark kernel is self-contained:
+//   # comment                (also allowed after an instruction)
+//   .reg R3, 100             initial register value
+//   .data 256, 1, 2, 3       initial memory words starting at byte address 256
+//   .expect R2, 17           expected final register value
+//   .expect_mem 512, 4, 5    expected final memory words starting at byte address 512
+//   .guard 640, 64           accesses to bytes [640, 704) raise an exception
+//   .handler                 the instructions that follow are the exception handler
+#define MAX_EXPECT 512
+
+typedef struct {
+    bool is_mem;
+    int where;      // register index, or byte address for memory
+    int value;
+} Expectation;
+
+typedef struct {
+    Expectation e[MAX_EXPECT];
+    int count;
+} Golden;
+
 /**
- * @brief Load program into CPU instruction memory
+ * @brief Apply one '.' directive line to the CPU image or golden state
+ * @return 0 on success, -1 on a malformed directive
+ */
+static int parse_directive(CPU* cpu, Golden* golden, char* line) {
+    char *name = strtok(line, " ,\t\n");
+    char *target = strtok(NULL, " ,\t\n");
+    char *end;
+    if (strcmp(name, ".handler") == 0) {
+        if (target || cpu->handler >= 0) return -1;
+        cpu->handler = cpu->inst_count;
+        return 0;
+    }
+    if (strcmp(name, ".guard") == 0) {
+        char *size = strtok(NULL, " ,\t\n");
+        if (!target || !size || strtok(NULL, " ,\t\n") || cpu->nguards == MAX_GUARDS) return -1;
+        GuardRegion g;
+        g.lo = (int)strtol(target, &end, 0);
+        if (*end != '\0' || g.lo < 0 || g.lo >= MEM_BYTES) return -1;
+        long bytes = strtol(size, &end, 0);
+        if (*end != '\0' || bytes <= 0 || bytes > MEM_BYTES - g.lo) return -1;
+        g.hi = g.lo + (int)bytes;
+        cpu->guard[cpu->nguards++] = g;
+        return 0;
+    }
+
+    bool is_reg = strcmp(name, ".reg") == 0 || strcmp(name, ".expect") == 0;
+    bool is_expect = strncmp(name, ".expect", 7) == 0;
+    if (!target || (!is_reg && strcmp(name, ".data") != 0 && strcmp(name, ".expect_mem") != 0))
+        return -1;
+
+    int where;
+    if (is_reg) {
+        if (sscanf(target, "R%d", &where) != 1 || where < 0 || where >= cpu->cfg.num_regs) return -1;
+    } else {
+        where = (int)strtol(target, &end, 0);
+        if (*end != '\0' || where < 0 || where % WORD_SIZE_BYTES != 0) return -1;
+    }
+
+    int n = 0;
+    for (char *tok = strtok(NULL, " ,\t\n"); tok; tok = strtok(NULL, " ,\t\n"), ++n) {
+        int value = (int)strtol(tok, &end, 0);
+        if (*end != '\0' || (is_reg && n > 0)) return -1;
+        int addr = where + n * WORD_SIZE_BYTES;
+        if (!is_reg && addr / WORD_SIZE_BYTES >= MEM_SIZE_WORDS) return -1;
+
+        if (is_expect) {
+            if (!golden) continue;
+            if (golden->count == MAX_EXPECT) return -1;
+            Expectation *e = &golden->e[golden->count++];
+            e->is_mem = !is_reg;
+            e->where = is_reg ? where : addr;
+            e->value = value;
+        } else if (is_reg) {
+            cpu->R[where] = value;
+        } else {
+            cpu->memory[addr / WORD_SIZE_BYTES] = value;
+        }
+    }
+    return n > 0 ? 0 : -1;
+}
+
+/**
+ * @brief Load program (and any initial / expected state) into the CPU
+ * Registers must lie below cpu->cfg.num_regs.
  * @param cpu CPU state pointer
  * @param filename File containing assembly instructions
+ * @param golden Receives .expect directives (may be NULL)
  * @return 0 on success, -1 if file could not be opened
  */
-int program_load(CPU* cpu, const char *filename) {
+int program_load_image(CPU* cpu, const char *filename, Golden* golden) {
     FILE *f = fopen(filename, "r");
     if (!f) return -1;
     char line[LINE_LEN];
     cpu->inst_count = 0;
+    cpu->handler = -1;
+    cpu->nguards = 0;
+    if (golden) golden->count = 0;
     int lineno = 0;
     while (fgets(line, sizeof(line), f) && cpu->inst_count < MAX_INST) {
         lineno++;
-        Instruction ins = parse_line(line);
-        if (ins.valid) {
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        char *start = line + strspn(line, " \t\r\n");
+        if (*start == '\0') continue;
+
+        if (*start == '.') {
+            char copy[LINE_LEN];
+            strcpy(copy, start);
+            if (parse_directive(cpu, golden, copy) != 0)
+                fprintf(stderr, "Parse error at line %d: bad directive -- '%s'\n", lineno, line);
+            continue;
+        }
+        char *text = cpu->source[cpu->inst_count];
+        Instruction ins = parse_line(line, text);
+        if (ins.valid && (ins.rd >= cpu->cfg.num_regs || ins.rs1 >= cpu->cfg.num_regs ||
+                          ins.rs2 >= cpu->cfg.num_regs)) {
+            fprintf(stderr, "Parse error at line %d: register beyond num_regs=%d -- '%s'\n",
+                    lineno, cpu->cfg.num_regs, line);
+        } else if (ins.valid && op_info(&ins)->redirect && cpu->handler < 0) {
+            fprintf(stderr, "Parse error at line %d: RFE outside the exception handler -- '%s'\n", lineno, line);
+        } else if (ins.valid) {
+            ins.idx = cpu->inst_count;
             cpu->program[cpu->inst_count++] = ins;
         } else {
-            fprintf(stderr, "Parse error at line %d: %s -- '%s'\n", lineno, ins.text, line);
+            fprintf(stderr, "Parse error at line %d: %s -- '%s'\n", lineno, text, line);
         }
     }
     fclose(f);
     return 0;
 }
 
+/**
+ * @brief Load program into CPU instruction memory
+ * @param cpu CPU state pointer
+ * @param filename File containing assembly instructions
+ * @return 0 on success, -1 if file could not be opened
+ */
+int program_load(CPU* cpu, const char *filename) {
+    return program_load_image(cpu, filename, NULL);
+}
+
+/**
+ * @brief Highest register a loaded image names, in an operand or a nonzero .reg value
+ * @return Register number, or -1 if it uses none
+ */
+int program_max_reg(const CPU* cpu) {
+    int top = -1;
+    for (int i = 0; i < cpu->inst_count; ++i) {
+        const Instruction* in = &cpu->program[i];
+        int r = in->rd > in->rs1 ? in->rd : in->rs1;
+        if (in->rs2 > r) r = in->rs2;
+        if (r > top) top = r;
+    }
+    for (int r = top + 1; r < MAX_REGS; ++r)
+        if (cpu->R[r]) top = r;
+    return top;
+}
+
+/**
+ * @brief Compare the final CPU state against the expected values
+ * @param report Where to describe mismatches (may be NULL)
+ * @return Number of mismatches
+ */
+int golden_check(const CPU* cpu, const Golden* golden, FILE* report) {
+    int bad = 0;
+    for (int i = 0; i < golden->count; ++i) {
+        const Expectation *e = &golden->e[i];
+        int got = e->is_mem ? cpu->memory[e->where / WORD_SIZE_BYTES] : cpu->R[e->where];
+        if (got == e->value) continue;
+        if (report && bad < 8) {
+            if (e->is_mem)
+                fprintf(report, "  Memory[%d] (byte addr=%d): expected %d, got %d\n",
+                        e->where / WORD_SIZE_BYTES, e->where, e->value, got);
+            else
+                fprintf(report, "  R%d: expected %d, got %d\n", e->where, e->value, got);
+        }
+        bad++;
+    }
+    return bad;
+}
+
 bool pipeline_is_empty(const CPU* cpu) {
     return !cpu->pipeline_IF_ID.inst.valid && !cpu->pipeline_ID_EX.inst.valid &&
            !cpu->pipeline_EX_MEM.inst.valid && !cpu->pipeline_MEM_WB.inst.valid;
@@ -351,6 +928,30 @@ typedef struct {
     FwdSrc src;
 } Resolved;
 
+/**
+ * @brief Value a latch will write to reg, taking the youngest writer in a fused slot
+ * @param alu_only Skip loaded data (a LOAD, or an op completed after one)
+ * @return false if no (eligible) instruction in the latch writes reg
+ */
+static bool latch_forward(const CPU* cpu, const StageLatch* s, int reg, bool alu_only, int* value) {
+    if (!s->inst.valid || reg == REG_UNUSED) return false;
+    if (s->post >= 0 && cpu->program[s->post].rd == reg) {
+        if (alu_only) return false;
+        *value = s->post_result;
+        return true;
+    }
+    if (s->inst.rd == reg) {
+        if (alu_only && op_info(&s->inst)->is_load) return false;
+        *value = s->alu_result;
+        return true;
+    }
+    if (s->pre >= 0 && cpu->program[s->pre].rd == reg) {
+        *value = s->pre_value;
+        return true;
+    }
+    return false;
+}
+
 /**
  * @brief Resolve an operand value using forwarding rules.
  * Note: LOAD values are only available after MEM stage (i.e. from MEM/WB),
@@ -360,17 +961,32 @@ Resolved resolve_operand(const CPU* cpu, int reg) {
     Resolved r; r.value = 0; r.src = SRC_NONE;
     if (reg == -1) return r;
 
+    // A predicted LOAD in EX/MEM hands out its predicted value, whatever the bypass
+    // policy: it comes from the predictor, not from the MEM output.
+    const StageLatch* m = &cpu->pipeline_EX_MEM;
+    if (m->predicted && m->inst.rd == reg && !(m->post >= 0 && cpu->program[m->post].rd == reg)) {
+        r.value = m->pred_value;
+        r.src = SRC_PRED;
+        return r;
+    }
+
+    // Without bypass paths the decode stage has already waited for the register file.
+    if (cpu->cfg.forwarding == FWD_NONE) {
+        r.value = cpu->R[reg];
+        r.src = SRC_REG;
+        return r;
+    }
+
     // If EX/MEM has an instruction that wrote this reg, forward its alu_result.
     // (We will ensure cpu->pipeline_EX_MEM contains the post-MEM value before EX runs.)
-    if (cpu->pipeline_EX_MEM.inst.valid && cpu->pipeline_EX_MEM.inst.rd == reg && cpu->pipeline_EX_MEM.inst.rd != REG_UNUSED) {
-        r.value = cpu->pipeline_EX_MEM.alu_result;
+    // Under FWD_ALU loaded data is not bypassed from here; decode stalls the consumer instead.
+    if (latch_forward(cpu, &cpu->pipeline_EX_MEM, reg, cpu->cfg.forwarding == FWD_ALU, &r.value)) {
         r.src = SRC_MEM;
         return r;
     }
 
     // Then check MEM/WB (final result available for writes and loads)
-    if (cpu->pipeline_MEM_WB.inst.valid && cpu->pipeline_MEM_WB.inst.rd == reg && cpu->pipeline_MEM_WB.inst.rd != REG_UNUSED) {
-        r.value = cpu->pipeline_MEM_WB.alu_result;
+    if (latch_forward(cpu, &cpu->pipeline_MEM_WB, reg, false, &r.value)) {
         r.src = SRC_WB;
         return r;
     }
@@ -385,44 +1001,194 @@ typedef struct {
     StageLatch next;
     bool stall;
     const char* stall_reason;
+    StallCause cause;
+    int fold;            // FoldKind: next also holds the instruction IF fetched this cycle
+    bool redirect;       // next is an RFE: IF's fetch this cycle is discarded
 } DecodeResult;
+
+typedef enum { FOLD_NONE, FOLD_FUSED, FOLD_ELIMINATED } FoldKind;
+
+/**
+ * @brief SUB Rx, Ry, Ry: the result is 0 whatever Ry holds
+ */
+static bool is_zero_idiom(const Instruction* in) {
+    return in->valid && op_info(in)->alu == ALU_SUB && in->rs1 == in->rs2 && in->rs1 != REG_UNUSED;
+}
+
+/**
+ * @brief Can move elimination complete this instruction in decode?
+ */
+static bool is_eliminable(const CPU* cpu, const Instruction* in) {
+    return cpu->cfg.move_elim && in->valid && (op_info(in)->alu == ALU_IMM || is_zero_idiom(in));
+}
+
+/**
+ * @brief Does the instruction read register reg in EX?
+ */
+static bool inst_reads_reg(const Instruction* in, int reg) {
+    const OpInfo* info = op_info(in);
+    return in->valid && reg != REG_UNUSED &&
+           ((info->reads_rs1 && in->rs1 == reg) || (info->reads_rs2 && in->rs2 == reg));
+}
+
+/**
+ * @brief Base register of a LOAD/STORE address
+ */
+static int inst_base_reg(const Instruction* in) {
+    return op_info(in)->base ? in->rs2 : in->rs1;
+}
+
+/**
+ * @brief LOAD in ID reading the address the STORE in ID/EX writes (same base and offset)
+ */
+static bool store_load_hazard(const Instruction* store, const Instruction* load) {
+    if (!store->valid || !op_info(store)->is_store || !load->valid || !op_info(load)->is_load) return false;
+    return inst_base_reg(store) == inst_base_reg(load) && store->imm == load->imm;
+}
+
+/**
+ * @brief RAW hazard between a consumer in ID and the slot in ID/EX
+ *
+ * The producer in ID/EX will be in EX/MEM while the consumer executes; anything older
+ * is already readable. skip_reg is an operand supplied from within the consumer's own
+ * fused slot.
+ * @return Stall reason, or NULL if the bypass network covers every operand
+ */
+static const char* raw_hazard(const CPU* cpu, const Instruction* consumer, int skip_reg,
+                              const StageLatch* producer) {
+    if (cpu->cfg.forwarding == FWD_FULL || !producer->inst.valid) return NULL;
+    if (cpu->cfg.move_elim && is_zero_idiom(consumer)) return NULL;   // reads nothing
+    bool no_fwd = cpu->cfg.forwarding == FWD_NONE;
+    int writers[3] = { producer->inst.rd, REG_UNUSED, REG_UNUSED };
+    bool loaded[3] = { op_info(&producer->inst)->is_load, false, true };
+    if (producer->pre >= 0) writers[1] = cpu->program[producer->pre].rd;
+    if (producer->post >= 0) writers[2] = cpu->program[producer->post].rd;
+    for (int i = 0; i < 3; ++i) {
+        if (writers[i] == REG_UNUSED || writers[i] == skip_reg || !inst_reads_reg(consumer, writers[i]))
+            continue;
+        if (i == 0 && producer->predicted) continue;   // value comes from the predictor
+        if (no_fwd || loaded[i])
+            return loaded[i] ? "load-use hazard" : "RAW hazard (no forwarding)";
+    }
+    return NULL;
+}
+
+/**
+ * @brief Look up a confident value prediction for a LOAD entering EX
+ * @return true if the predictor supplies *value
+ */
+static bool lvp_predict(const CPU* cpu, const Instruction* in, int* value) {
+    if (cpu->cfg.lvp == LVP_OFF || cpu->cfg.forwarding == FWD_FULL || !in->valid || !op_info(in)->is_load)
+        return false;
+    const LvpEntry* e = &cpu->lvp[in->idx & (cpu->cfg.lvp_entries - 1)];
+    if (e->conf < LVP_CONFIDENT) return false;
+    *value = cpu->cfg.lvp == LVP_STRIDE ? (int)((unsigned)e->last + (unsigned)e->stride) : e->last;
+    return true;
+}
+
+/**
+ * @brief Can first and second (adjacent in program order) share a slot?
+ * @return FusionRule that applies, or 0
+ */
+static int fusion_rule(const CPU* cpu, const Instruction* first, const Instruction* second) {
+    if (!first->valid || !second->valid || !inst_reads_reg(second, first->rd)) return 0;
+    const OpInfo* a = op_info(first);
+    const OpInfo* b = op_info(second);
+    bool reg_alu = b->reads_rs2 && !b->is_mem;   // register-register ALU op
+    if ((cpu->cfg.fusion & FUSE_MOV_ALU) && a->alu == ALU_IMM && reg_alu)
+        return FUSE_MOV_ALU;
+    if ((cpu->cfg.fusion & FUSE_LOAD_ADD) && a->is_load && reg_alu && b->alu == ALU_ADD)
+        return FUSE_LOAD_ADD;
+    return 0;
+}
+
 /**
  * @brief Instruction Decode (ID) stage
  * @param cpu CPU state
  * @param pipeline_IF_ID Current IF/ID latch
  * @param pipeline_ID_EX Current ID/EX latch
  * @return DecodeResult (next ID/EX latch + stall info)
+ *
+ * With fusion enabled, decode also looks at the instruction IF is fetching this cycle
+ * (program[PC]) and merges an eligible pair into one ID/EX slot:
+ *  - MOV Rx, imm + ALU op reading Rx: the MOV's value is known here, so it rides along as
+ *    the slot's "pre" op and the ALU op reads imm instead of Rx.
+ *  - LOAD Rx + ADD reading Rx: the ADD rides along as the slot's "post" op and is
+ *    computed in MEM as soon as the data arrives.
+ * Both writes happen in program order in WB.
+ *
+ * With move_elim, a MOV or zero idiom in ID is completed here whatever follows it: its
+ * value is bound to the next instruction's slot (the slot acts as the rename of the
+ * destination), so it never occupies the ALU. Zero idioms also never wait for operands.
  */
 DecodeResult decode_stage(const CPU* cpu, StageLatch pipeline_IF_ID, StageLatch pipeline_ID_EX) {
     DecodeResult res;
     res.next = pipeline_IF_ID; // pass-through for this simple ISA
     res.stall = false;
     res.stall_reason = NULL;
+    res.cause = STALL_NONE;
+    res.fold = FOLD_NONE;
+    res.redirect = false;
 
-    // Load-use hazard detection:
-  // STORE → LOAD hazard detection
-if (pipeline_ID_EX.inst.valid && pipeline_ID_EX.inst.op == OP_STORE &&
-    pipeline_IF_ID.inst.valid && pipeline_IF_ID.inst.op == OP_LOAD) {
-    
-    int store_base = pipeline_ID_EX.inst.rs2;   // STORE base register
-    int load_base = pipeline_IF_ID.inst.rs1;    // LOAD base register
-
-    if (store_base == load_base && pipeline_ID_EX.inst.imm == pipeline_IF_ID.inst.imm) {
+    // STORE → LOAD hazard detection
+    if (store_load_hazard(&pipeline_ID_EX.inst, &pipeline_IF_ID.inst)) {
         res.stall = true;
         res.stall_reason = "STORE→LOAD hazard (same address)";
+        res.cause = STALL_STORE_LOAD;
+        return res;
+    }
+
+    // RAW hazards the bypass network cannot cover.
+    res.stall_reason = raw_hazard(cpu, &pipeline_IF_ID.inst, REG_UNUSED, &pipeline_ID_EX);
+    if (res.stall_reason) {
+        res.stall = true;
+        res.cause = STALL_RAW;
+        return res;
     }
-}
 
+    if ((cpu->cfg.fusion || cpu->cfg.move_elim) && cpu->PC < cpu->inst_count) {
+        const Instruction* first = &pipeline_IF_ID.inst;
+        const Instruction* second = &cpu->program[cpu->PC];
+        int rule = fusion_rule(cpu, first, second);
+        bool elim = !rule && is_eliminable(cpu, first);
+        // The second op must not need a stall of its own.
+        if ((rule || elim) && !raw_hazard(cpu, second, first->rd, &pipeline_ID_EX) &&
+            !store_load_hazard(&pipeline_ID_EX.inst, second)) {
+            res.fold = rule ? FOLD_FUSED : FOLD_ELIMINATED;
+            if (rule == FUSE_MOV_ALU || elim) {
+                res.next.inst = *second;
+                res.next.pre = first->idx;
+                res.next.pre_value = alu_execute(first->op, 0, 0, first->imm);
+            } else {
+                res.next.post = second->idx;
+            }
+        }
+    }
 
+    res.next.predicted = lvp_predict(cpu, &res.next.inst, &res.next.pred_value);
+    res.redirect = res.next.inst.valid && op_info(&res.next.inst)->redirect;
     return res;
 }
 
 // ---------- EX (pure) ----------
+/**
+ * @brief Resolve an operand, preferring a value folded into the slot at decode
+ */
+static Resolved resolve_in_slot(const CPU* cpu, const StageLatch* s, int reg) {
+    if (s->pre >= 0 && reg != REG_UNUSED && cpu->program[s->pre].rd == reg) {
+        Resolved r = { s->pre_value, SRC_ID };
+        return r;
+    }
+    return resolve_operand(cpu, reg);
+}
+
 typedef struct {
     StageLatch next;     // the latch for EX/MEM
     bool branch_taken;   // true if branch was taken (unused here)
     int target_pc;       // new PC if branch
     bool valid;          // whether this result is valid
+    bool used_prediction;  // an operand came from a predicted LOAD value
+    int rf_reads;        // operands read from the register file (not bypassed)
 } ExecResult;
 
 /**
@@ -438,8 +1204,10 @@ ExecResult execute_stage(const CPU* cpu, StageLatch pipeline_ID_EX) {
     r.branch_taken = false;
     r.target_pc = -1;
     r.valid = pipeline_ID_EX.inst.valid;
+    r.used_prediction = false;
+    r.rf_reads = 0;
 
-    if (!pipeline_ID_EX.inst.valid || pipeline_ID_EX.inst.op == OP_NOOP) {
+    if (!inst_live(&pipeline_ID_EX.inst)) {
         r.next.val_rs1 = r.next.val_rs2 = 0;
         r.next.src_rs1 = r.next.src_rs2 = SRC_NONE;
         r.next.alu_result = 0;
@@ -452,120 +1220,585 @@ ExecResult execute_stage(const CPU* cpu, StageLatch pipeline_ID_EX) {
     assert(reg_valid(pipeline_ID_EX.inst.rs2));
 
     // Resolve operands with forwarding
-    Resolved rs1 = resolve_operand(cpu, pipeline_ID_EX.inst.rs1);
-    Resolved rs2 = resolve_operand(cpu, pipeline_ID_EX.inst.rs2);
+    Resolved rs1 = resolve_in_slot(cpu, &pipeline_ID_EX, pipeline_ID_EX.inst.rs1);
+    Resolved rs2 = resolve_in_slot(cpu, &pipeline_ID_EX, pipeline_ID_EX.inst.rs2);
 
     r.next.val_rs1 = rs1.value;
     r.next.val_rs2 = rs2.value;
     r.next.src_rs1 = rs1.src;
     r.next.src_rs2 = rs2.src;
+    r.used_prediction = rs1.src == SRC_PRED || rs2.src == SRC_PRED;
+    r.rf_reads = (rs1.src == SRC_REG) + (rs2.src == SRC_REG);
 
-    // --- FIX: ensure address computation uses the base register ---
-    // For LOAD: parse_load set rs1 = base
-    // For STORE: parse_store set rs2 = base and rs1 = data
-    int base_val = 0;
-    int other_val = 0;
-    if (pipeline_ID_EX.inst.op == OP_STORE) {
-        // For STORE: base is rs2, data is rs1
-        base_val = rs2.value;        // base register for address
-        other_val = rs1.value;       // data to store
-        // Keep val_rs1 as store-data (already set above from rs1)
-    } else if (pipeline_ID_EX.inst.op == OP_LOAD) {
-        // For LOAD: base is rs1
-        base_val = rs1.value;
-        other_val = 0;
-    } else {
-        // For ALU ops: use rs1 and rs2 in normal order
-        base_val = rs1.value;
-        other_val = rs2.value;
-    }
+    // The ALU's first input is the base register for an address (rs2 for STORE, whose
+    // rs1 is the data; val_rs1 keeps it for MEM), otherwise rs1.
+    int vals[2] = { rs1.value, rs2.value };
+    int base = op_info(&pipeline_ID_EX.inst)->base;
+    r.next.alu_result = alu_execute(pipeline_ID_EX.inst.op, vals[base], vals[!base], pipeline_ID_EX.inst.imm);
 
-    r.next.alu_result = alu_execute(pipeline_ID_EX.inst.op, base_val, other_val, pipeline_ID_EX.inst.imm);
+    // A fused post op reads its non-LOAD operands now; MEM supplies the loaded one.
+    if (pipeline_ID_EX.post >= 0) {
+        const Instruction* post = &cpu->program[pipeline_ID_EX.post];
+        Resolved p1 = resolve_operand(cpu, post->rs1);
+        Resolved p2 = resolve_operand(cpu, post->rs2);
+        r.next.post_rs1 = p1.value;
+        r.next.post_rs2 = p2.value;
+        r.used_prediction |= p1.src == SRC_PRED || p2.src == SRC_PRED;
+        r.rf_reads += (post->rs1 != pipeline_ID_EX.inst.rd && p1.src == SRC_REG) +
+                      (post->rs2 != pipeline_ID_EX.inst.rd && p2.src == SRC_REG);
+    }
 
     return r;
 }
 
-// ---------- MEM ----------
-typedef struct {
-    StageLatch next;
-} MemResult;
+// ---------- Data cache / stage occupancy ----------
+void cache_init(DataCache* c, const SimConfig* cfg) {
+    memset(c, 0, sizeof(*c));
+    if (cfg->cache_bytes == 0) return;
+    c->line_bytes = cfg->cache_line_bytes;
+    c->ways = cfg->cache_assoc;
+    c->sets = cfg->cache_bytes / (c->line_bytes * c->ways);
+}
 
 /**
- * @brief Memory stage (pass-through for this ISA)
- * @param pipeline_EX_MEM Current EX/MEM latch
- * @return MemResult (MEM/WB latch)
- *
- * Key fixes:
- *  - For LOAD: do NOT write to register file here. Instead set next.alu_result = loaded_data
- *    so the WB stage writes the register (and forwarding from MEM/WB will expose loaded data).
- *  - For STORE: perform the memory write here (MEM stage) using val_rs1, and check bounds.
- *  - Add bounds checks for memory accesses.
+ * @brief Look up (and fill on miss) the line holding a byte address
+ * @return true on hit
  */
-MemResult memory_stage(CPU* cpu, StageLatch pipeline_EX_MEM) {
-    MemResult r;
-    r.next = pipeline_EX_MEM;  // default pass-through
+bool cache_access(DataCache* c, int address) {
+    int line = address / c->line_bytes;
+    int set = line % c->sets;
+    int tag = line / c->sets;
+    int base = set * c->ways;
+    int victim = base;
 
-    if (!pipeline_EX_MEM.inst.valid || pipeline_EX_MEM.inst.op == OP_NOOP) {
-        return r;
+    c->tick++;
+    for (int w = base; w < base + c->ways; ++w) {
+        if (c->valid[w] && c->tag[w] == tag) {
+            c->last_use[w] = c->tick;
+            return true;
+        }
+        if (!c->valid[w] || (c->valid[victim] && c->last_use[w] < c->last_use[victim]))
+            victim = w;
     }
+    c->valid[victim] = true;
+    c->tag[victim] = tag;
+    c->last_use[victim] = c->tick;
+    return false;
+}
 
-    // Compute effective byte address (already computed in EX as alu_result)
-    int effective_address = pipeline_EX_MEM.alu_result;
-    // Convert to word index safely
-    if (effective_address < 0 || (effective_address / WORD_SIZE_BYTES) >= MEM_SIZE_WORDS) {
-        fprintf(stderr, "[MEM] Address out of range: %d (inst: %s)\n",
-                effective_address, pipeline_EX_MEM.inst.text);
-        // keep pipeline state but do not perform memory access
-        return r;
-    }
-    int word_index = effective_address / WORD_SIZE_BYTES;
+// ---------- Virtual memory ----------
+// With vm=1, MEM translates addresses through a two-level page table kept at the top
+// of simulated memory. Every table is one page of 4-byte entries, so a directory entry
+// covers page_bytes * page_bytes / 4 bytes. With huge_pages=1, a directory entry whose
+// region holds no part of the table is itself the leaf (a huge page): walks stop a
+// level early, and one TLB entry covers the whole region. An entry is a physical byte
+// address | VM_PRESENT [| VM_HUGE].
+// sim_start maps every virtual address onto the same physical one, so results are those
+// of the untranslated machine; only the timing changes. A store into the table region
+// does change translations, as on hardware without protection.
+#define VM_PRESENT 1
+#define VM_HUGE    2
 
-    if (pipeline_EX_MEM.inst.op == OP_STORE) {
-        // STORE: write the data to memory now (MEM stage)
-        int data_to_store = pipeline_EX_MEM.val_rs1;
-        cpu->memory[word_index] = data_to_store;
-        // Keep alu_result as is or set it to data for consistency (not used for store destination)
-        r.next.alu_result = pipeline_EX_MEM.alu_result;
-        printf("[MEM] STORE: R%d(%d) -> Memory[%d] (byte addr=%d)\n",
-               pipeline_EX_MEM.inst.rs1,
-               data_to_store,
-               word_index,
-               effective_address);
-    }
-    else if (pipeline_EX_MEM.inst.op == OP_LOAD) {
-        // LOAD: read from memory, but DO NOT write to register file here.
-        // Instead, place the loaded data into alu_result so WB writes it and MEM/WB forwarding works.
-        int loaded = cpu->memory[word_index];
-        r.next.alu_result = loaded; // this value will be written to R[rd] by WB stage.
-        printf("[MEM] LOAD: Memory[%d] (byte addr=%d) -> value=%d (dest R%d)\n",
-               word_index,
-               effective_address,
-               loaded,
-               pipeline_EX_MEM.inst.rd);
-    }
-    else {
-        // ALU or MOV: pass through the ALU result for WB stage
-        r.next.alu_result = pipeline_EX_MEM.alu_result;
+static int vm_huge_bytes(const SimConfig* c) {
+    return c->page_bytes / WORD_SIZE_BYTES * c->page_bytes;
+}
+
+static int vm_dir_entries(const SimConfig* c) {
+    int n = MEM_BYTES / vm_huge_bytes(c);
+    return n > 0 ? n : 1;
+}
+
+// Second-level tables fill the last pages of memory; the directory sits just below them.
+static int vm_table_base(const SimConfig* c) {
+    return MEM_BYTES - vm_dir_entries(c) * c->page_bytes;
+}
+
+static int vm_dir_base(const SimConfig* c) {
+    return vm_table_base(c) - vm_dir_entries(c) * WORD_SIZE_BYTES;
+}
+
+/**
+ * @brief Write the identity-mapped page table into a memory image (no-op unless vm=1)
+ */
+void vm_write_page_table(const SimConfig* c, int* memory) {
+    if (!c->vm) return;
+    int page = c->page_bytes, huge = vm_huge_bytes(c);
+    int dir = vm_dir_base(c), tables = vm_table_base(c);
+    for (int d = 0; d < vm_dir_entries(c); ++d) {
+        int start = d * huge;
+        int table = tables + d * page;
+        if (c->huge_pages && start + huge <= dir) {
+            memory[dir / WORD_SIZE_BYTES + d] = start | VM_PRESENT | VM_HUGE;
+            continue;
+        }
+        memory[dir / WORD_SIZE_BYTES + d] = table | VM_PRESENT;
+        for (int i = 0; i < page / WORD_SIZE_BYTES; ++i)
+            memory[table / WORD_SIZE_BYTES + i] = (start + i * page) | VM_PRESENT;
     }
+}
 
-    return r;
+static bool vm_in_range(int addr) {
+    return addr >= 0 && addr < MEM_BYTES;
 }
 
 /**
- * @brief Write-back (WB) stage
- * @param cpu CPU state pointer
+ * @brief Walk the page table for a virtual byte address
+ * @param refs Receives the byte addresses of the entries read (-1 = level not reached)
+ * @param huge Set if a huge page maps the address
+ * @return Physical byte address, or -1 if the address is not mapped
  */
-void wb_stage(CPU* cpu) {
-    const Instruction* w = &cpu->pipeline_MEM_WB.inst;
-    if (w->valid && w->op != OP_NOOP && w->rd != REG_UNUSED) {
-        assert(reg_valid(w->rd));
-        cpu->R[w->rd] = cpu->pipeline_MEM_WB.alu_result;
+int vm_walk(const SimConfig* c, const int* memory, int vaddr, int refs[2], bool* huge) {
+    int hb = vm_huge_bytes(c);
+    refs[0] = refs[1] = -1;
+    *huge = false;
+    if (!vm_in_range(vaddr)) return -1;
+    refs[0] = vm_dir_base(c) + vaddr / hb * WORD_SIZE_BYTES;
+    int pde = memory[refs[0] / WORD_SIZE_BYTES];
+    int base = pde & ~(VM_PRESENT | VM_HUGE);
+    if (!(pde & VM_PRESENT)) return -1;
+    if (pde & VM_HUGE) {
+        *huge = true;
+        return vm_in_range(base + vaddr % hb) ? base + vaddr % hb : -1;
     }
+    refs[1] = base + vaddr % hb / c->page_bytes * WORD_SIZE_BYTES;
+    if (!vm_in_range(refs[1])) return -1;
+    int pte = memory[refs[1] / WORD_SIZE_BYTES];
+    int phys = (pte & ~(VM_PRESENT | VM_HUGE)) + vaddr % c->page_bytes;
+    return (pte & VM_PRESENT) && vm_in_range(phys) ? phys : -1;
 }
 
-// ---------- Pipeline advancement ----------
 /**
- * @brief Advance all pipeline latches by one cycle
+ * @brief Physical byte address of a data access (the address itself when vm=0)
+ * @return -1 if the address is out of range or not mapped
+ */
+int vm_translate(const SimConfig* c, const int* memory, int vaddr) {
+    if (!c->vm) return vm_in_range(vaddr) ? vaddr : -1;
+    int refs[2];
+    bool huge;
+    return vm_walk(c, memory, vaddr, refs, &huge);
+}
+
+/**
+ * @brief Architectural fault check for a data access: range and guard regions
+ * Translation is checked separately; with the identity page table it never fails
+ * for an address in range.
+ * @param image CPU whose program image defines the guard regions
+ */
+FaultKind access_fault(const CPU* image, int vaddr) {
+    if (!vm_in_range(vaddr)) return FAULT_RANGE;
+    for (int i = 0; i < image->nguards; ++i)
+        if (vaddr >= image->guard[i].lo && vaddr < image->guard[i].hi) return FAULT_GUARD;
+    return FAULT_NONE;
+}
+
+void tlb_init(Tlb* t, int entries) {
+    memset(t, 0, sizeof(*t));
+    t->entries = entries;
+}
+
+/**
+ * @brief Look up a virtual address
+ * @return The matching entry (now most recently used), or NULL on a miss
+ */
+static TlbEntry* tlb_lookup(Tlb* t, const SimConfig* c, int vaddr, int asid) {
+    t->tick++;
+    for (int i = 0; i < t->entries; ++i) {
+        TlbEntry* e = &t->e[i];
+        if (e->valid && e->asid == asid && e->vpn == vaddr / (e->huge ? vm_huge_bytes(c) : c->page_bytes)) {
+            e->last_use = t->tick;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void tlb_fill(Tlb* t, const SimConfig* c, int vaddr, int asid, bool huge) {
+    if (t->entries == 0) return;
+    TlbEntry* victim = &t->e[0];
+    for (int i = 0; i < t->entries && victim->valid; ++i)
+        if (!t->e[i].valid || t->e[i].last_use < victim->last_use) victim = &t->e[i];
+    victim->vpn = vaddr / (huge ? vm_huge_bytes(c) : c->page_bytes);
+    victim->asid = asid;
+    victim->huge = huge;
+    victim->valid = true;
+    victim->last_use = t->tick;
+}
+
+/**
+ * @brief Extra MEM cycles to translate a data address
+ *
+ * An L1 TLB hit is free and an L2 hit costs tlb2_latency. A miss in both walks the
+ * table: walk_latency per level, plus mem_latency for each entry that misses in the
+ * data cache (page-table entries are cached like data).
+ * @param memory Memory holding the page table of address space asid
+ */
+static int vm_translation_penalty(CPU* cpu, const int* memory, int vaddr, int asid) {
+    const SimConfig* c = &cpu->cfg;
+    if (tlb_lookup(&cpu->tlb[0], c, vaddr, asid)) {
+        cpu->stats.tlb_hits[0]++;
+        return 0;
+    }
+    const TlbEntry* l2 = tlb_lookup(&cpu->tlb[1], c, vaddr, asid);
+    if (l2) {
+        cpu->stats.tlb_hits[1]++;
+        cpu->stats.tlb_cycles += c->tlb2_latency;
+        tlb_fill(&cpu->tlb[0], c, vaddr, asid, l2->huge);
+        return c->tlb2_latency;
+    }
+
+    int refs[2];
+    bool huge;
+    bool mapped = vm_walk(c, memory, vaddr, refs, &huge) >= 0;
+    int penalty = 0;
+    for (int level = 0; level < 2 && refs[level] >= 0; ++level) {
+        penalty += c->walk_latency;
+        if (c->cache_bytes == 0 || !cache_access(&cpu->dcache, refs[level] + asid * MEM_BYTES))
+            penalty += c->mem_latency;
+    }
+    cpu->stats.tlb_walks++;
+    cpu->stats.tlb_cycles += penalty;
+    if (mapped) {
+        tlb_fill(&cpu->tlb[1], c, vaddr, asid, huge);
+        tlb_fill(&cpu->tlb[0], c, vaddr, asid, huge);
+    }
+    return penalty;
+}
+
+/**
+ * @brief Extra MEM cycles for the access in EX/MEM (0 for ALU ops and bad addresses)
+ * A guard page access is translated but never reaches the cache.
+ * @param owner CPU the instruction belongs to (its page table is walked)
+ * @param space Address space of the access (SMT thread); spaces never share cache lines
+ */
+static int mem_access_penalty(CPU* cpu, const StageLatch* s, const CPU* owner, int space) {
+    if (!s->inst.valid || !op_info(&s->inst)->is_mem) return 0;
+    int addr = s->alu_result;
+    if (!vm_in_range(addr)) return 0;
+    int penalty = 0;
+    if (cpu->cfg.vm) {
+        penalty = vm_translation_penalty(cpu, owner->memory, addr, space);
+        addr = vm_translate(&cpu->cfg, owner->memory, addr);
+        if (addr < 0) return penalty;
+    }
+    if (access_fault(owner, s->alu_result) != FAULT_NONE) return penalty;
+    if (cpu->cfg.cache_bytes == 0) return penalty + cpu->cfg.mem_latency;
+    if (cache_access(&cpu->dcache, addr + space * MEM_BYTES)) {
+        cpu->stats.cache_hits++;
+        return penalty;
+    }
+    cpu->stats.cache_misses++;
+    return penalty + cpu->cfg.mem_latency;
+}
+
+/**
+ * @brief Is MEM still busy with the instruction in EX/MEM this cycle?
+ * The penalty is charged once, when the instruction first reaches MEM.
+ * @param owner, space CPU and address space of that instruction (cpu and 0 unless
+ *        threads share the pipeline)
+ */
+bool mem_stage_busy(CPU* cpu, const CPU* owner, int space) {
+    if (!cpu->mem_started) {
+        cpu->mem_started = true;
+        cpu->mem_wait = mem_access_penalty(cpu, &cpu->pipeline_EX_MEM, owner, space);
+    }
+    if (cpu->mem_wait > 0) {
+        cpu->mem_wait--;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Extra cycles to move uses values through ports ports (0 = unlimited)
+ */
+static int port_cycles(int uses, int ports) {
+    return ports > 0 && uses > ports ? (uses - 1) / ports : 0;
+}
+
+/**
+ * @brief Is EX still busy this cycle, reading operands or in a multi-cycle operation?
+ * @param ex This cycle's EX result for the slot in ID/EX (for its register file reads)
+ * @return STALL_RF_READ or STALL_EX_BUSY while busy, otherwise STALL_NONE
+ */
+StallCause ex_stage_busy(CPU* cpu, const ExecResult* ex) {
+    if (!cpu->ex_started) {
+        const Instruction* in = &cpu->pipeline_ID_EX.inst;
+        cpu->ex_started = true;
+        cpu->ex_wait = (in->valid && op_info(in)->long_latency) ? cpu->cfg.mul_latency - 1 : 0;
+        cpu->ex_read_wait = port_cycles(ex->rf_reads, cpu->cfg.rf_read_ports);
+    }
+    // Operands are read before the operation starts.
+    if (cpu->ex_read_wait > 0) {
+        cpu->ex_read_wait--;
+        return STALL_RF_READ;
+    }
+    if (cpu->ex_wait > 0) {
+        cpu->ex_wait--;
+        return STALL_EX_BUSY;
+    }
+    return STALL_NONE;
+}
+
+// ---------- MEM ----------
+typedef struct {
+    StageLatch next;
+    bool mispredict;     // a predicted LOAD loaded something else
+    int fault;           // FaultKind: the access faulted and the slot's own op did not complete
+    int fault_idx;       // the faulting instruction
+    int fault_squashed;  // younger ops fused into its slot
+} MemResult;
+
+/**
+ * @brief Train the value predictor with a LOAD's data and check its prediction
+ * @return true if the LOAD was predicted and the prediction was wrong
+ */
+static bool lvp_train(CPU* cpu, const StageLatch* s, int actual) {
+    if (cpu->cfg.lvp == LVP_OFF) return false;
+    LvpEntry* e = &cpu->lvp[s->inst.idx & (cpu->cfg.lvp_entries - 1)];
+    int guess = cpu->cfg.lvp == LVP_STRIDE ? (int)((unsigned)e->last + (unsigned)e->stride) : e->last;
+    if (guess == actual) {
+        if (e->conf < 3) e->conf++;
+    } else {
+        e->conf = 0;
+    }
+    e->stride = (int)((unsigned)actual - (unsigned)e->last);
+    e->last = actual;
+    cpu->stats.loads++;
+    if (!s->predicted) return false;
+    cpu->stats.lvp_predicted++;
+    if (s->pred_value == actual) {
+        cpu->stats.lvp_correct++;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Compute a fused post op from the data its LOAD produced
+ */
+static void complete_post(const CPU* cpu, StageLatch* s) {
+    if (s->post < 0) return;
+    const Instruction* post = &cpu->program[s->post];
+    int a = post->rs1 == s->inst.rd ? s->alu_result : s->post_rs1;
+    int b = post->rs2 == s->inst.rd ? s->alu_result : s->post_rs2;
+    s->post_result = alu_execute(post->op, a, b, post->imm);
+}
+
+/**
+ * @brief What a faulting slot still writes back: an older op folded into it at decode
+ */
+static StageLatch fault_latch(const CPU* cpu, const StageLatch* s) {
+    StageLatch w = make_nop_latch();
+    if (s->pre >= 0) {
+        w.inst = cpu->program[s->pre];
+        w.alu_result = s->pre_value;
+    }
+    return w;
+}
+
+/**
+ * @brief Memory stage (pass-through for this ISA)
+ * @param pipeline_EX_MEM Current EX/MEM latch
+ * @return MemResult (MEM/WB latch)
+ *
+ * Key fixes:
+ *  - For LOAD: do NOT write to register file here. Instead set next.alu_result = loaded_data
+ *    so the WB stage writes the register (and forwarding from MEM/WB will expose loaded data).
+ *  - For STORE: perform the memory write here (MEM stage) using val_rs1, and check bounds.
+ *  - Add bounds checks for memory accesses.
+ */
+MemResult memory_stage(CPU* cpu, StageLatch pipeline_EX_MEM) {
+    MemResult r;
+    r.next = pipeline_EX_MEM;  // default pass-through
+    r.mispredict = false;
+    r.fault = FAULT_NONE;
+
+    // ALU or MOV: pass through the ALU result for WB stage (it is not an address)
+    const OpInfo* info = op_info(&pipeline_EX_MEM.inst);
+    if (!pipeline_EX_MEM.inst.valid || !info->is_mem) {
+        return r;
+    }
+
+    // Compute effective byte address (already computed in EX as alu_result)
+    int effective_address = pipeline_EX_MEM.alu_result;
+    int physical_address = -1;
+    r.fault = access_fault(cpu, effective_address);
+    if (r.fault == FAULT_NONE) {
+        physical_address = vm_translate(&cpu->cfg, cpu->memory, effective_address);
+        if (physical_address < 0) r.fault = FAULT_UNMAPPED;
+    }
+    if (r.fault != FAULT_NONE) {
+        // Precise exception: no access, and nothing from this op or later is written.
+        r.next = fault_latch(cpu, &pipeline_EX_MEM);
+        r.fault_idx = pipeline_EX_MEM.inst.idx;
+        r.fault_squashed = pipeline_EX_MEM.post >= 0;
+        cpu->mem_event.type = MEM_EV_FAULT;
+        cpu->mem_event.reg = REG_UNUSED;
+        cpu->mem_event.value = r.fault;
+        cpu->mem_event.addr = effective_address;
+        return r;
+    }
+    int word_index = physical_address / WORD_SIZE_BYTES;
+
+    if (info->is_store) {
+        // STORE: write the data to memory now (MEM stage)
+        int data_to_store = pipeline_EX_MEM.val_rs1;
+        cpu->memory[word_index] = data_to_store;
+        // Keep alu_result as is or set it to data for consistency (not used for store destination)
+        r.next.alu_result = pipeline_EX_MEM.alu_result;
+        cpu->mem_event.type = MEM_EV_STORE;
+        cpu->mem_event.reg = pipeline_EX_MEM.inst.rs1;
+        cpu->mem_event.value = data_to_store;
+        cpu->mem_event.addr = effective_address;
+    }
+    else {
+        // LOAD: read from memory, but DO NOT write to register file here.
+        // Instead, place the loaded data into alu_result so WB writes it and MEM/WB forwarding works.
+        int loaded = cpu->memory[word_index];
+        r.next.alu_result = loaded; // this value will be written to R[rd] by WB stage.
+        cpu->mem_event.type = MEM_EV_LOAD;
+        cpu->mem_event.reg = pipeline_EX_MEM.inst.rd;
+        cpu->mem_event.value = loaded;
+        cpu->mem_event.addr = effective_address;
+        r.mispredict = lvp_train(cpu, &pipeline_EX_MEM, loaded);
+        complete_post(cpu, &r.next);
+    }
+
+    return r;
+}
+
+/**
+ * @brief Register writes of a slot, including ops fused into it
+ */
+static int slot_writes(const StageLatch* s) {
+    if (!inst_live(&s->inst)) return 0;
+    return (s->pre >= 0) + op_info(&s->inst)->writes_rd + (s->post >= 0);
+}
+
+/**
+ * @brief Does the slot in MEM/WB need another cycle for write ports?
+ * The writes all happen in the slot's last WB cycle.
+ */
+bool wb_stage_busy(CPU* cpu) {
+    if (!cpu->wb_started) {
+        cpu->wb_started = true;
+        cpu->wb_wait = port_cycles(slot_writes(&cpu->pipeline_MEM_WB), cpu->cfg.rf_write_ports);
+    }
+    if (cpu->wb_wait > 0) {
+        cpu->wb_wait--;
+        return true;
+    }
+    return false;
+}
+
+// ---------- Exceptions ----------
+// A LOAD/STORE that faults (out of range, guard region) raises a precise exception in
+// MEM. Everything older has written back by then, except an op folded into the
+// faulting slot at decode, which still does. The faulting op and everything younger
+// are flushed, and fetch restarts at the handler. RFE in the handler resumes at the
+// instruction after the faulting one, so the handler stands in for the access. A fault
+// with no handler, or inside the handler, ends the program.
+
+/**
+ * @brief Account the cycles since the pending exception was taken
+ * @param end Cycle count at which it is over
+ */
+static void exception_close(CPU* cpu, long long end) {
+    if (cpu->exc_start < 0) return;
+    cpu->stats.exc_cycles += end - cpu->exc_start;
+    cpu->exc_start = -1;
+}
+
+/**
+ * @brief Take the exception MEM raised this cycle; the caller flushes the younger slots
+ * @param squashed Younger instructions those slots hold
+ */
+static void exception_take(CPU* cpu, const MemResult* m, int squashed) {
+    cpu->stats.exceptions++;
+    cpu->stats.exc_squashed += m->fault_squashed + squashed;
+    if (cpu->exc_start < 0) cpu->exc_start = cpu->stats.cycles;
+    if (cpu->handler >= 0 && m->fault_idx < cpu->handler) {
+        cpu->epc = m->fault_idx + 1;
+        cpu->PC = cpu->handler;
+    } else {
+        fprintf(stderr, "[MEM] Unhandled exception: %s at byte addr %d (inst: %s)\n",
+                FAULT_NAMES[m->fault], cpu->mem_event.addr, cpu->source[m->fault_idx]);
+        cpu->epc = cpu->inst_count;
+        cpu->PC = cpu->inst_count;
+    }
+}
+
+/**
+ * @brief RFE left decode: drop the instruction fetched behind it and resume at epc
+ */
+static void exception_return(CPU* cpu) {
+    cpu->pipeline_IF_ID = make_nop_latch();
+    cpu->PC = cpu->epc == cpu->handler ? cpu->inst_count : cpu->epc;
+}
+
+/**
+ * @brief Instructions a slot holds, including ops fused into it
+ */
+static int slot_insts(const StageLatch* s) {
+    if (!inst_live(&s->inst)) return 0;
+    return 1 + (s->pre >= 0) + (s->post >= 0);
+}
+
+/**
+ * @brief Move fetch past program[PC]; the main program ends where the handler starts
+ */
+static void pc_advance(CPU* cpu) {
+    if (cpu->PC < cpu->inst_count) cpu->PC++;
+    if (cpu->PC > cpu->fetch_high) cpu->fetch_high = cpu->PC;
+    if (cpu->PC == cpu->handler) cpu->PC = cpu->inst_count;
+}
+
+/**
+ * @brief Write-back (WB) stage
+ * @param cpu CPU state pointer
+ */
+void wb_stage(CPU* cpu) {
+    const StageLatch* s = &cpu->pipeline_MEM_WB;
+    const Instruction* w = &s->inst;
+    if (!inst_live(w)) return;
+    long long retired = cpu->stats.retired;
+    // Fused slots write in program order: pre, the slot's own op, post.
+    if (s->pre >= 0) {
+        cpu->R[cpu->program[s->pre].rd] = s->pre_value;
+        cpu->stats.retired++;
+    }
+    if (op_info(w)->writes_rd) {
+        assert(reg_valid(w->rd));
+        cpu->R[w->rd] = s->alu_result;
+    }
+    cpu->stats.retired++;
+    if (s->post >= 0) {
+        cpu->R[cpu->program[s->post].rd] = s->post_result;
+        cpu->stats.retired++;
+    }
+
+    bool in_handler = cpu->handler >= 0 && w->idx >= cpu->handler;
+    if (in_handler)
+        cpu->stats.handler_retired += cpu->stats.retired - retired;
+    else if (cpu->exc_start >= 0 && w->idx >= cpu->epc)
+        exception_close(cpu, cpu->stats.cycles + 1);   // the program has resumed
+}
+
+// ---------- Pipeline advancement ----------
+/**
+ * @brief Count an instruction decode folded into a neighbouring slot
+ */
+static void count_fold(CPU* cpu, const DecodeResult* dec_res) {
+    if (dec_res->fold == FOLD_FUSED) {
+        cpu->stats.fused++;
+    } else {
+        cpu->stats.eliminated++;
+        if (is_zero_idiom(&cpu->program[dec_res->next.pre])) cpu->stats.zero_idioms++;
+    }
+}
+
+/**
+ * @brief Advance all pipeline latches by one cycle
  * @param cpu CPU state
  * @param ex_res Result of EX stage
  * @param mem_res Result of MEM stage
@@ -591,29 +1824,127 @@ void advance_pipeline(CPU* cpu,
     // Commit WB (already done inside wb_stage)
     // MEM → WB
     cpu->pipeline_MEM_WB = mem_res.next;
+    cpu->wb_started = false;
 
     // EX → MEM
     cpu->pipeline_EX_MEM = ex_res.next;
+    cpu->mem_started = false;
+    if (ex_res.next.inst.valid) {
+        cpu->stats.operand_src[ex_res.next.src_rs1]++;
+        cpu->stats.operand_src[ex_res.next.src_rs2]++;
+    }
 
     // ID → EX
     if (dec_res.stall)
         cpu->pipeline_ID_EX = make_nop_latch();
     else
-        cpu->pipeline_ID_EX = cpu->pipeline_IF_ID;
+        cpu->pipeline_ID_EX = dec_res.next;
+    cpu->ex_started = false;
 
     // IF → ID
     if (!dec_res.stall) {
+        if (dec_res.fold != FOLD_NONE) {
+            // Decode took the instruction IF just fetched; the fetch buffer supplies the next.
+            count_fold(cpu, &dec_res);
+            pc_advance(cpu);
+            fetch_stage(cpu, &fetched_inst);
+        }
         cpu->pipeline_IF_ID.inst = fetched_inst;
 
         // Centralized PC increment
-        if (cpu->PC < cpu->inst_count) {
-            cpu->PC++;
-        }
+        pc_advance(cpu);
+        if (dec_res.redirect) exception_return(cpu);
     } else {
         // stalled: keep the same IF/ID (we do not advance PC; fetched_inst should be discarded)
     }
 }
 
+// ---------- Cycle records ----------
+// Everything the per-cycle trace shows, captured in one fixed-size record. The text
+// trace is rendered from it and the binary trace stores it as is, so a record plus
+// the program's instruction table is enough to reproduce that cycle's text.
+static const char* const STALL_REASONS[] = {
+    "",
+    "STORE→LOAD hazard (same address)",
+    "load-use hazard",
+    "RAW hazard (no forwarding)",
+    "EX busy",
+    "MEM busy",
+    "load value mispredict (replay)",
+    "RF read ports",
+    "RF write ports",
+    "exception flush",
+};
+#define NUM_STALL_REASONS ((int)(sizeof(STALL_REASONS) / sizeof(STALL_REASONS[0])))
+
+typedef struct TraceRecord {
+    int32_t cycle;
+    int32_t pc;
+    int16_t idx[4];            // program index in IF/ID, ID/EX, EX/MEM, MEM/WB (-1 = bubble)
+    int16_t pre[4], post[4];   // ops fused into those slots (-1 = none)
+    uint8_t stalled;           // front of the pipeline held this cycle
+    uint8_t reason;            // index into STALL_REASONS (0 = none)
+    uint8_t src_rs1, src_rs2;  // FwdSrc of the EX operands
+    int32_t ex_rs1, ex_rs2;    // EX operand values (after forwarding)
+    int32_t ex_result;         // EX result (address for loads/stores)
+    int32_t wb_value;          // value in MEM/WB
+    int32_t wb_pre_value, wb_post_value;
+    int32_t mem_type;          // MemEventType of this cycle's data access
+    int32_t mem_reg, mem_value, mem_addr;
+    int32_t regs[MAX_REGS];    // register file after write-back
+} TraceRecord;
+
+enum { TR_IF_ID, TR_ID_EX, TR_EX_MEM, TR_MEM_WB };
+
+static int stall_reason_index(const char* reason) {
+    if (!reason) return 0;
+    for (int i = 1; i < NUM_STALL_REASONS; ++i)
+        if (strcmp(reason, STALL_REASONS[i]) == 0) return i;
+    assert(!"stall reason missing from STALL_REASONS");
+    return 0;
+}
+
+static int latch_index(const StageLatch* s) {
+    return inst_live(&s->inst) ? s->inst.idx : -1;
+}
+
+/**
+ * @brief Capture the state shown for one cycle
+ * @param ex_view The ID/EX latch as computed by EX this cycle (operands and result filled in)
+ */
+void trace_capture(const CPU* cpu, const StageLatch* ex_view, int cycle, bool stalled,
+                   const char* stall_reason, TraceRecord* rec) {
+    memset(rec, 0, sizeof(*rec));
+    rec->cycle = cycle;
+    rec->pc = cpu->PC;
+    rec->idx[TR_IF_ID] = (int16_t)latch_index(&cpu->pipeline_IF_ID);
+    rec->idx[TR_ID_EX] = (int16_t)latch_index(ex_view);
+    rec->idx[TR_EX_MEM] = (int16_t)latch_index(&cpu->pipeline_EX_MEM);
+    rec->idx[TR_MEM_WB] = (int16_t)latch_index(&cpu->pipeline_MEM_WB);
+    const StageLatch* slots[4] = { &cpu->pipeline_IF_ID, ex_view, &cpu->pipeline_EX_MEM, &cpu->pipeline_MEM_WB };
+    for (int i = 0; i < 4; ++i) {
+        bool live = rec->idx[i] >= 0;
+        rec->pre[i] = (int16_t)(live ? slots[i]->pre : -1);
+        rec->post[i] = (int16_t)(live ? slots[i]->post : -1);
+    }
+    rec->stalled = stalled;
+    rec->reason = (uint8_t)stall_reason_index(stall_reason);
+    rec->src_rs1 = (uint8_t)ex_view->src_rs1;
+    rec->src_rs2 = (uint8_t)ex_view->src_rs2;
+    rec->ex_rs1 = ex_view->val_rs1;
+    rec->ex_rs2 = ex_view->val_rs2;
+    rec->ex_result = ex_view->alu_result;
+    rec->wb_value = cpu->pipeline_MEM_WB.alu_result;
+    // Only fused slots carry these; elsewhere they stay 0 so --compare can check them
+    if (rec->pre[TR_MEM_WB] >= 0) rec->wb_pre_value = cpu->pipeline_MEM_WB.pre_value;
+    if (rec->post[TR_MEM_WB] >= 0) rec->wb_post_value = cpu->pipeline_MEM_WB.post_result;
+    rec->mem_type = cpu->mem_event.type;
+    rec->mem_reg = cpu->mem_event.reg;
+    rec->mem_value = cpu->mem_event.value;
+    rec->mem_addr = cpu->mem_event.addr;
+    memcpy(rec->regs, cpu->R, sizeof(rec->regs));
+}
+
 // ---------- Pretty printing ----------
 static const char* src_name(FwdSrc s) {
     switch (s) {
@@ -621,166 +1952,5227 @@ static const char* src_name(FwdSrc s) {
         case SRC_REG:  return "RF";
         case SRC_MEM:  return "MEM";
         case SRC_WB:   return "WB";
+        case SRC_ID:   return "ID";
+        case SRC_PRED: return "PRED";
         default:       return "?";
     }
 }
 
-void print_stage_inst(const char *name, const StageLatch *s) {
-    if (!s->inst.valid || s->inst.op == OP_NOOP) {
-        printf("%-6s: %-20s ", name, "NOP");
+void print_stage_inst(FILE *out, const char *name, const char *text) {
+    if (!text) {
+        fprintf(out, "%-6s: %-20s ", name, "NOP");
         return;
     }
-    printf("%-6s: %-20s", name, s->inst.text);
+    fprintf(out, "%-6s: %-20s", name, text);
+}
+
+static const Instruction* record_inst(const Instruction* prog, int idx) {
+    return idx >= 0 ? &prog[idx] : NULL;
 }
+
 /**
- * @brief Print pipeline and register state for the given cycle
- * @param cpu CPU state
- * @param cycle Current cycle number
- * @param stalled Whether the decode stage stalled
- * @param stall_reason String explaining stall reason (optional)
+ * @brief Text of a pipeline slot: the instruction, joined with any op fused into it
+ * @return NULL for a bubble
+ */
+static const char* slot_text(char* buf, size_t size, const SourceLine* source, const TraceRecord* rec, int stage) {
+    int idx = rec->idx[stage];
+    if (idx < 0) return NULL;
+    if (rec->pre[stage] >= 0)
+        snprintf(buf, size, "%s + %s", source[rec->pre[stage]], source[idx]);
+    else if (rec->post[stage] >= 0)
+        snprintf(buf, size, "%s + %s", source[idx], source[rec->post[stage]]);
+    else
+        return source[idx];
+    return buf;
+}
+
+/**
+ * @brief Print the data access and the pipeline/register state of one cycle
+ * @param out Destination stream
+ * @param prog, source, inst_count Instruction table and source lines the record's indices refer to
+ * @param num_regs Architectural registers to show
+ * @param rec Captured cycle
  */
-void print_cycle_state(const CPU* cpu, int cycle, bool stalled, const char* stall_reason) {
-    printf("\n================ Cycle %d ================ Pc : %d\n", cycle, cpu->PC);
+void print_cycle_state(FILE *out, const Instruction* prog, const SourceLine* source, int inst_count, int num_regs,
+                       const TraceRecord* rec) {
+    if (rec->mem_type == MEM_EV_STORE)
+        fprintf(out, "[MEM] STORE: R%d(%d) -> Memory[%d] (byte addr=%d)\n",
+                rec->mem_reg, rec->mem_value, rec->mem_addr / WORD_SIZE_BYTES, rec->mem_addr);
+    else if (rec->mem_type == MEM_EV_LOAD)
+        fprintf(out, "[MEM] LOAD: Memory[%d] (byte addr=%d) -> value=%d (dest R%d)\n",
+                rec->mem_addr / WORD_SIZE_BYTES, rec->mem_addr, rec->mem_value, rec->mem_reg);
+    else if (rec->mem_type == MEM_EV_FAULT)
+        fprintf(out, "[MEM] EXCEPTION: %s (byte addr=%d), younger instructions flushed\n",
+                FAULT_NAMES[rec->mem_value], rec->mem_addr);
+
+    fprintf(out, "\n================ Cycle %d ================ Pc : %d\n", rec->cycle, rec->pc);
 
-    if (cpu->PC < cpu->inst_count)
-        printf("IF    : Fetching '%s'%s\n", cpu->program[cpu->PC].text, stalled ? " (stall->refetch)" : "");
+    if (rec->pc < inst_count)
+        fprintf(out, "IF    : Fetching '%s'%s\n", source[rec->pc], rec->stalled ? " (stall->refetch)" : "");
     else
-        printf("IF    : Done\n");
+        fprintf(out, "IF    : Done\n");
 
-    if (stalled) {
-        printf("ID    : %-20s (Stalled%s%s)\n",
-               cpu->pipeline_IF_ID.inst.valid ? cpu->pipeline_IF_ID.inst.text : "NOP",
-               stall_reason ? " — " : "",
-               stall_reason ? stall_reason : "");
+    char text[4][2 * LINE_LEN + 4];
+    const char* id = slot_text(text[TR_IF_ID], sizeof(text[0]), source, rec, TR_IF_ID);
+    if (rec->stalled) {
+        fprintf(out, "ID    : %-20s (Stalled%s%s)\n",
+                id ? id : "NOP",
+                rec->reason ? " — " : "",
+                STALL_REASONS[rec->reason]);
     } else {
-        print_stage_inst("ID", &cpu->pipeline_IF_ID); printf("\n");
+        print_stage_inst(out, "ID", id); fprintf(out, "\n");
     }
 
-    if (!cpu->pipeline_ID_EX.inst.valid || cpu->pipeline_ID_EX.inst.op == OP_NOOP) {
-        printf("EX    : NOP\n");
-    } else if (cpu->pipeline_ID_EX.inst.op == OP_MOV) {
-        printf("EX    : %-20s (imm=%d and result=%d)\n",
-               cpu->pipeline_ID_EX.inst.text, cpu->pipeline_ID_EX.inst.imm, cpu->pipeline_ID_EX.alu_result);
-    } else if (cpu->pipeline_ID_EX.inst.op == OP_LOAD || cpu->pipeline_ID_EX.inst.op == OP_STORE) {
+    const Instruction* ex = record_inst(prog, rec->idx[TR_ID_EX]);
+    const char* ex_text = slot_text(text[TR_ID_EX], sizeof(text[0]), source, rec, TR_ID_EX);
+    const OpInfo* info = ex ? op_info(ex) : &OP_INFO[OP_NOOP];
+    if (!ex) {
+        fprintf(out, "EX    : NOP\n");
+    } else if (info->is_load) {
         // show address computation and forwarded operand info
-        if (cpu->pipeline_ID_EX.inst.op == OP_LOAD) {
-            printf("EX    : %-20s (base R%d=%d[%s], offset=%d; addr=%d)\n",
-                   cpu->pipeline_ID_EX.inst.text,
-                   cpu->pipeline_ID_EX.inst.rs1, cpu->pipeline_ID_EX.val_rs1, src_name(cpu->pipeline_ID_EX.src_rs1),
-                   cpu->pipeline_ID_EX.inst.imm,
-                   cpu->pipeline_ID_EX.alu_result);
-        } else {
-            // STORE: val_rs1 is data, rs2 is base
-            printf("EX    : %-20s (data R%d=%d[%s], base R%d=%d[%s], offset=%d; addr=%d)\n",
-                   cpu->pipeline_ID_EX.inst.text,
-                   cpu->pipeline_ID_EX.inst.rs1, cpu->pipeline_ID_EX.val_rs1, src_name(cpu->pipeline_ID_EX.src_rs1),
-                   cpu->pipeline_ID_EX.inst.rs2, cpu->pipeline_ID_EX.val_rs2, src_name(cpu->pipeline_ID_EX.src_rs2),
-                   cpu->pipeline_ID_EX.inst.imm,
-                   cpu->pipeline_ID_EX.alu_result);
-        }
+        fprintf(out, "EX    : %-20s (base R%d=%d[%s], offset=%d; addr=%d)\n",
+                ex_text, ex->rs1, rec->ex_rs1, src_name(rec->src_rs1), ex->imm, rec->ex_result);
+    } else if (info->is_store) {
+        // STORE: val_rs1 is data, rs2 is base
+        fprintf(out, "EX    : %-20s (data R%d=%d[%s], base R%d=%d[%s], offset=%d; addr=%d)\n",
+                ex_text,
+                ex->rs1, rec->ex_rs1, src_name(rec->src_rs1),
+                ex->rs2, rec->ex_rs2, src_name(rec->src_rs2),
+                ex->imm, rec->ex_result);
+    } else if (info->alu == ALU_IMM) {
+        fprintf(out, "EX    : %-20s (imm=%d and result=%d)\n", ex_text, ex->imm, rec->ex_result);
+    } else if (!info->reads_rs1) {
+        print_stage_inst(out, "EX", ex_text); fprintf(out, "\n");
     } else {
-        printf("EX    : %-20s (R%d=%d[%s], R%d=%d[%s]; result=%d)\n",
-               cpu->pipeline_ID_EX.inst.text,
-               cpu->pipeline_ID_EX.inst.rs1, cpu->pipeline_ID_EX.val_rs1, src_name(cpu->pipeline_ID_EX.src_rs1),
-               cpu->pipeline_ID_EX.inst.rs2, cpu->pipeline_ID_EX.val_rs2, src_name(cpu->pipeline_ID_EX.src_rs2),
-               cpu->pipeline_ID_EX.alu_result);
+        fprintf(out, "EX    : %-20s (R%d=%d[%s], R%d=%d[%s]; result=%d)\n",
+                ex_text,
+                ex->rs1, rec->ex_rs1, src_name(rec->src_rs1),
+                ex->rs2, rec->ex_rs2, src_name(rec->src_rs2),
+                rec->ex_result);
     }
 
-    print_stage_inst("MEM", &cpu->pipeline_EX_MEM); printf("\n");
+    print_stage_inst(out, "MEM", slot_text(text[TR_EX_MEM], sizeof(text[0]), source, rec, TR_EX_MEM)); fprintf(out, "\n");
 
-    if (cpu->pipeline_MEM_WB.inst.valid && cpu->pipeline_MEM_WB.inst.rd != REG_UNUSED && cpu->pipeline_MEM_WB.inst.op != OP_NOOP) {
-        printf("WB    : %-20s (write R%d=%d)\n",
-               cpu->pipeline_MEM_WB.inst.text,
-               cpu->pipeline_MEM_WB.inst.rd,
-               cpu->pipeline_MEM_WB.alu_result);
+    const Instruction* wb = record_inst(prog, rec->idx[TR_MEM_WB]);
+    const char* wb_text = slot_text(text[TR_MEM_WB], sizeof(text[0]), source, rec, TR_MEM_WB);
+    if (wb && (rec->pre[TR_MEM_WB] >= 0 || rec->post[TR_MEM_WB] >= 0)) {
+        const Instruction* pre = record_inst(prog, rec->pre[TR_MEM_WB]);
+        const Instruction* post = record_inst(prog, rec->post[TR_MEM_WB]);
+        fprintf(out, "WB    : %-20s (write", wb_text);
+        if (pre) fprintf(out, " R%d=%d,", pre->rd, rec->wb_pre_value);
+        if (wb->rd != REG_UNUSED) fprintf(out, " R%d=%d%s", wb->rd, rec->wb_value, post ? "," : "");
+        if (post) fprintf(out, " R%d=%d", post->rd, rec->wb_post_value);
+        fprintf(out, ")\n");
+    } else if (wb && wb->rd != REG_UNUSED) {
+        fprintf(out, "WB    : %-20s (write R%d=%d)\n", wb_text, wb->rd, rec->wb_value);
     } else {
-        print_stage_inst("WB", &cpu->pipeline_MEM_WB); printf("\n");
+        print_stage_inst(out, "WB", wb_text); fprintf(out, "\n");
     }
 
     // Registers
-    printf("\nRegisters: ");
-    for (int i = 0; i < NUM_REGS; ++i) {
-        printf("R%-2d=%-5d ", i, cpu->R[i]);
-        if ((i + 1) % 8 == 0) printf("\n           ");
+    fprintf(out, "\nRegisters: ");
+    for (int i = 0; i < num_regs; ++i) {
+        fprintf(out, "R%-2d=%-5d ", i, rec->regs[i]);
+        if ((i + 1) % 8 == 0) fprintf(out, "\n           ");
     }
-    printf("\n");
+    fprintf(out, "\n");
 }
 
-// ---------- main ----------
 /**
- * @brief Main entry point: load program, run pipeline simulation
- * @return 0 on success, 1 if program load failed
+ * @brief Print an end-of-run register summary and cycle count
  */
-int main() {
-    CPU cpu;
-    memset(&cpu, 0, sizeof(CPU));
-    for (int i = 0; i < NUM_REGS; ++i) cpu.R[i] = 0;
-    // Initialize memory to zero
-    for (int i = 0; i < MEM_SIZE_WORDS; ++i) cpu.memory[i] = 0;
+void print_final_regs(FILE* out, const int* R, int num_regs, long long cycles) {
+    fprintf(out, "\n=============== FINAL REGISTER STATE ===============\n");
+    for (int i = 0; i < num_regs; ++i) {
+        fprintf(out, "R%-2d=%-5d ", i, R[i]);
+        if ((i + 1) % 8 == 0) fprintf(out, "\n");
+    }
 
-    cpu.PC = 0;
 
-    if (program_load(&cpu, "inst.txt") != 0) {
-        fprintf(stderr, "Could not open inst.txt. Please create it.\n");
-        return 1;
+    fprintf(out, "\nTotal cycles: %lld\n", cycles);
+}
+
+/**
+ * @brief Print the end-of-run register summary and cycle count
+ */
+void print_final_state(FILE* out, const CPU* cpu) {
+    print_final_regs(out, cpu->R, cpu->cfg.num_regs, cpu->stats.cycles);
+}
+
+// ---------- Fast text trace ----------
+// The same bytes as print_cycle_state, built without stdio: each instruction's text is
+// padded to the trace column once per program, integers are converted by hand, and a
+// cycle is appended to a private buffer that goes out with one write() per megabyte.
+// A TraceText belongs to one thread; parallel formatters each own one.
+#define TRACE_TEXT_BYTES (1 << 20)
+#define TRACE_COL 20                  // the %-20s instruction column
+// Upper bound on one cycle's text: three fused slots, the fixed parts, the registers
+#define TRACE_CYCLE_MAX (8 * LINE_LEN + 1024 + MAX_REGS * 24)
+
+// Which cycles a text trace shows. All given conditions must hold. A cycle passes the
+// instruction conditions when any pipeline slot (or an op fused into one) holds a
+// selected instruction, and the address condition when its [MEM] event falls in range.
+typedef struct {
+    int cycle_from, cycle_to;        // inclusive
+    int pc_from, pc_to;              // program indices
+    uint32_t ops;                    // bit per OpCode
+    bool by_addr;                    // only cycles with a [MEM] event in [addr_from, addr_to]
+    int addr_from, addr_to;          // byte addresses
+} TraceFilter;
+
+static TraceFilter trace_filter_all(void) {
+    TraceFilter f = { 1, INT_MAX, 0, INT_MAX, (1u << OP_COUNT) - 1, false, INT_MIN, INT_MAX };
+    return f;
+}
+
+/**
+ * @brief Parse "A:B", "A:", ":B" or "A" into an inclusive range, keeping omitted ends
+ * @return 0 on success, -1 if malformed
+ */
+static int parse_range(const char* s, int* lo, int* hi) {
+    char* end;
+    const char* colon = strchr(s, ':');
+    if (colon != s) {
+        long v = strtol(s, &end, 0);
+        if (end != (colon ? colon : s + strlen(s)) || v < INT_MIN || v > INT_MAX) return -1;
+        *lo = (int)v;
+        if (!colon) *hi = (int)v;
+    }
+    if (colon && colon[1]) {
+        long v = strtol(colon + 1, &end, 0);
+        if (*end || v < INT_MIN || v > INT_MAX) return -1;
+        *hi = (int)v;
+    }
+    return *lo <= *hi ? 0 : -1;
+}
+
+/**
+ * @brief Parse a comma-separated opcode selection into f->ops
+ * Items are opcode names or the classes alu (MOV, ADD, SUB, MUL) and mem (LOAD, STORE).
+ * @return 0 on success, -1 on an unknown name
+ */
+static int parse_op_classes(TraceFilter* f, const char* list) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s", list);
+    f->ops = 0;
+    char* save = NULL;
+    for (char* tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        uint32_t mask = 0;
+        for (int op = 0; op < OP_COUNT; ++op) {
+            const OpInfo* info = &OP_INFO[op];
+            bool alu = info->alu != ALU_NONE && info->alu != ALU_ADDR;
+            if (strcasecmp(tok, info->name) == 0 || (strcmp(tok, "alu") == 0 && alu) ||
+                (strcmp(tok, "mem") == 0 && info->is_mem))
+                mask |= 1u << op;
+        }
+        if (!mask) return -1;
+        f->ops |= mask;
     }
+    return f->ops ? 0 : -1;
+}
 
-    init_pipeline(&cpu);
-    int cycle = 1;
+typedef struct TraceText {
+    FILE* out;                       // stream whose descriptor receives the text
+    char* buf;
+    size_t len;
+    bool error;                      // a write failed; later text is dropped
+    const Instruction* prog;
+    const SourceLine* source;
+    int inst_count;
+    char (*padded)[LINE_LEN];        // instruction text padded to TRACE_COL
+    uint8_t* text_len;               // unpadded length of each instruction's text
+    TraceFilter filter;
+    bool by_inst;                    // the filter selects instructions
+    uint8_t* selected;               // per instruction, when by_inst
+} TraceText;
 
-    // Prime pipeline_IF_ID with first fetch so the first cycle shows ID properly
-    Instruction first;
-    fetch_stage(&cpu, &first);        // Fetch first instruction
-    cpu.pipeline_IF_ID.inst = first;  // Load into IF/ID latch
-    cpu.PC++;                         // ✅ Increment PC once here
+static const char DIGIT_PAIRS[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/** @brief Append the decimal form of v (as %d) */
+static char* fmt_int(char* p, int v) {
+    char tmp[12];
+    char* q = tmp + sizeof(tmp);
+    unsigned u = v < 0 ? 0u - (unsigned)v : (unsigned)v;
+    while (u >= 100) {
+        unsigned r = u % 100;
+        u /= 100;
+        q -= 2;
+        memcpy(q, &DIGIT_PAIRS[2 * r], 2);
+    }
+    if (u >= 10) {
+        q -= 2;
+        memcpy(q, &DIGIT_PAIRS[2 * u], 2);
+    } else {
+        *--q = (char)('0' + u);
+    }
+    if (v < 0) *--q = '-';
+    size_t n = (size_t)(tmp + sizeof(tmp) - q);
+    memcpy(p, q, n);
+    return p + n;
+}
 
-    while (cpu.PC < cpu.inst_count || !pipeline_is_empty(&cpu)) {
-        // ---- Phase 1: compute ----
-           // ---- Phase 1: compute ----
-    wb_stage(&cpu);
+/** @brief Append v left-justified in width columns (as %-<width>d) */
+static char* fmt_int_left(char* p, int v, int width) {
+    char* start = p;
+    p = fmt_int(p, v);
+    while (p - start < width) *p++ = ' ';
+    return p;
+}
 
-    // Run MEM stage for the instruction currently in EX/MEM and capture its outputs.
-    MemResult mem_res = memory_stage(&cpu, cpu.pipeline_EX_MEM);
+static char* fmt_str(char* p, const char* s) {
+    size_t n = strlen(s);
+    memcpy(p, s, n);
+    return p + n;
+}
 
-    // Make the MEM stage's output immediately visible for forwarding by
-    // updating the CPU's pipeline_EX_MEM to the post-MEM latch.
-    // This allows resolve_operand(...) to forward load-values from EX/MEM.
-    cpu.pipeline_EX_MEM = mem_res.next;
+#define FMT_LIT(p, lit) (memcpy((p), (lit), sizeof(lit) - 1), (p) + sizeof(lit) - 1)
 
-    // Now run EX stage for the instruction currently in ID/EX. It may now
-    // forward values produced by the MEM stage (including load data).
-    ExecResult ex_res = execute_stage(&cpu, cpu.pipeline_ID_EX);
+/** @brief Append a pipeline slot padded to the instruction column (the slot_text text) */
+static char* fmt_slot(char* p, const TraceText* t, const TraceRecord* rec, int stage) {
+    int idx = rec->idx[stage];
+    int pre = rec->pre[stage], post = rec->post[stage];
+    if (pre < 0 && post < 0) {
+        size_t n = t->text_len[idx] < TRACE_COL ? TRACE_COL : t->text_len[idx];
+        memcpy(p, t->padded[idx], n);
+        return p + n;
+    }
+    int first = pre >= 0 ? pre : idx, second = pre >= 0 ? idx : post;
+    char* start = p;
+    p = fmt_str(p, t->source[first]);
+    p = FMT_LIT(p, " + ");
+    p = fmt_str(p, t->source[second]);
+    while (p - start < TRACE_COL) *p++ = ' ';
+    return p;
+}
 
-    DecodeResult dec_res = decode_stage(&cpu, cpu.pipeline_IF_ID, cpu.pipeline_ID_EX);
-    Instruction fetched_inst;
-    fetch_stage(&cpu, &fetched_inst);
+/** @brief Append a print_stage_inst line body: the slot, or a padded NOP and a space */
+static char* fmt_stage(char* p, const char* label, const TraceText* t, const TraceRecord* rec, int stage) {
+    p = fmt_str(p, label);
+    if (rec->idx[stage] < 0) return FMT_LIT(p, "NOP                  ");
+    return fmt_slot(p, t, rec, stage);
+}
 
+/** @brief Append an EX operand as R<reg>=<value>[<source>] */
+static char* fmt_operand(char* p, int reg, int value, FwdSrc src) {
+    *p++ = 'R';
+    p = fmt_int(p, reg);
+    *p++ = '=';
+    p = fmt_int(p, value);
+    *p++ = '[';
+    p = fmt_str(p, src_name(src));
+    *p++ = ']';
+    return p;
+}
 
-        // ---- Phase 2: print ----
-        // Use the execute result just for printing the EX line
-        StageLatch saved_pipeline_ID_EX = cpu.pipeline_ID_EX;
-        cpu.pipeline_ID_EX = ex_res.next;
+/**
+ * @brief Render one cycle exactly as print_cycle_state does
+ * @param p Destination with at least TRACE_CYCLE_MAX bytes free
+ * @return End of the rendered text
+ */
+static char* format_cycle_state(char* p, const TraceText* t, int num_regs, const TraceRecord* rec) {
+    if (rec->mem_type == MEM_EV_STORE) {
+        p = FMT_LIT(p, "[MEM] STORE: R");
+        p = fmt_int(p, rec->mem_reg);
+        *p++ = '(';
+        p = fmt_int(p, rec->mem_value);
+        p = FMT_LIT(p, ") -> Memory[");
+        p = fmt_int(p, rec->mem_addr / WORD_SIZE_BYTES);
+        p = FMT_LIT(p, "] (byte addr=");
+        p = fmt_int(p, rec->mem_addr);
+        p = FMT_LIT(p, ")\n");
+    } else if (rec->mem_type == MEM_EV_LOAD) {
+        p = FMT_LIT(p, "[MEM] LOAD: Memory[");
+        p = fmt_int(p, rec->mem_addr / WORD_SIZE_BYTES);
+        p = FMT_LIT(p, "] (byte addr=");
+        p = fmt_int(p, rec->mem_addr);
+        p = FMT_LIT(p, ") -> value=");
+        p = fmt_int(p, rec->mem_value);
+        p = FMT_LIT(p, " (dest R");
+        p = fmt_int(p, rec->mem_reg);
+        p = FMT_LIT(p, ")\n");
+    } else if (rec->mem_type == MEM_EV_FAULT) {
+        p = FMT_LIT(p, "[MEM] EXCEPTION: ");
+        p = fmt_str(p, FAULT_NAMES[rec->mem_value]);
+        p = FMT_LIT(p, " (byte addr=");
+        p = fmt_int(p, rec->mem_addr);
+        p = FMT_LIT(p, "), younger instructions flushed\n");
+    }
 
-        print_cycle_state(&cpu, cycle, dec_res.stall, dec_res.stall_reason);
+    p = FMT_LIT(p, "\n================ Cycle ");
+    p = fmt_int(p, rec->cycle);
+    p = FMT_LIT(p, " ================ Pc : ");
+    p = fmt_int(p, rec->pc);
+    *p++ = '\n';
 
-        // Restore the original latched view before we advance
-        cpu.pipeline_ID_EX = saved_pipeline_ID_EX;
+    if (rec->pc < t->inst_count) {
+        p = FMT_LIT(p, "IF    : Fetching '");
+        memcpy(p, t->source[rec->pc], t->text_len[rec->pc]);
+        p += t->text_len[rec->pc];
+        *p++ = '\'';
+        if (rec->stalled) p = FMT_LIT(p, " (stall->refetch)");
+        *p++ = '\n';
+    } else {
+        p = FMT_LIT(p, "IF    : Done\n");
+    }
 
-        // ---- Phase 3: latch update ----
-        advance_pipeline(&cpu, ex_res, mem_res, fetched_inst, dec_res);
+    if (rec->stalled) {
+        p = FMT_LIT(p, "ID    : ");
+        p = rec->idx[TR_IF_ID] < 0 ? FMT_LIT(p, "NOP                 ") : fmt_slot(p, t, rec, TR_IF_ID);
+        p = FMT_LIT(p, " (Stalled");
+        if (rec->reason) p = FMT_LIT(p, " — ");
+        p = fmt_str(p, STALL_REASONS[rec->reason]);
+        p = FMT_LIT(p, ")\n");
+    } else {
+        p = fmt_stage(p, "ID    : ", t, rec, TR_IF_ID);
+        *p++ = '\n';
+    }
 
-        cycle++;
+    const Instruction* ex = record_inst(t->prog, rec->idx[TR_ID_EX]);
+    const OpInfo* info = ex ? op_info(ex) : &OP_INFO[OP_NOOP];
+    if (!ex) {
+        p = FMT_LIT(p, "EX    : NOP\n");
+    } else if (!info->is_mem && info->alu != ALU_IMM && !info->reads_rs1) {
+        p = fmt_stage(p, "EX    : ", t, rec, TR_ID_EX);
+        *p++ = '\n';
+    } else {
+        p = FMT_LIT(p, "EX    : ");
+        p = fmt_slot(p, t, rec, TR_ID_EX);
+        if (info->is_load) {
+            p = FMT_LIT(p, " (base ");
+            p = fmt_operand(p, ex->rs1, rec->ex_rs1, (FwdSrc)rec->src_rs1);
+            p = FMT_LIT(p, ", offset=");
+            p = fmt_int(p, ex->imm);
+            p = FMT_LIT(p, "; addr=");
+        } else if (info->is_store) {
+            p = FMT_LIT(p, " (data ");
+            p = fmt_operand(p, ex->rs1, rec->ex_rs1, (FwdSrc)rec->src_rs1);
+            p = FMT_LIT(p, ", base ");
+            p = fmt_operand(p, ex->rs2, rec->ex_rs2, (FwdSrc)rec->src_rs2);
+            p = FMT_LIT(p, ", offset=");
+            p = fmt_int(p, ex->imm);
+            p = FMT_LIT(p, "; addr=");
+        } else if (info->alu == ALU_IMM) {
+            p = FMT_LIT(p, " (imm=");
+            p = fmt_int(p, ex->imm);
+            p = FMT_LIT(p, " and result=");
+        } else {
+            p = FMT_LIT(p, " (");
+            p = fmt_operand(p, ex->rs1, rec->ex_rs1, (FwdSrc)rec->src_rs1);
+            p = FMT_LIT(p, ", ");
+            p = fmt_operand(p, ex->rs2, rec->ex_rs2, (FwdSrc)rec->src_rs2);
+            p = FMT_LIT(p, "; result=");
+        }
+        p = fmt_int(p, rec->ex_result);
+        p = FMT_LIT(p, ")\n");
     }
 
-    // Final summary
-    printf("\n=============== FINAL REGISTER STATE ===============\n");
-    for (int i = 0; i < NUM_REGS; ++i) {
-        printf("R%-2d=%-5d ", i, cpu.R[i]);
-        if ((i + 1) % 8 == 0) printf("\n");
+    p = fmt_stage(p, "MEM   : ", t, rec, TR_EX_MEM);
+    *p++ = '\n';
+
+    const Instruction* wb = record_inst(t->prog, rec->idx[TR_MEM_WB]);
+    if (wb && (rec->pre[TR_MEM_WB] >= 0 || rec->post[TR_MEM_WB] >= 0)) {
+        const Instruction* pre = record_inst(t->prog, rec->pre[TR_MEM_WB]);
+        const Instruction* post = record_inst(t->prog, rec->post[TR_MEM_WB]);
+        p = FMT_LIT(p, "WB    : ");
+        p = fmt_slot(p, t, rec, TR_MEM_WB);
+        p = FMT_LIT(p, " (write");
+        if (pre) {
+            p = FMT_LIT(p, " R");
+            p = fmt_int(p, pre->rd);
+            *p++ = '=';
+            p = fmt_int(p, rec->wb_pre_value);
+            *p++ = ',';
+        }
+        if (wb->rd != REG_UNUSED) {
+            p = FMT_LIT(p, " R");
+            p = fmt_int(p, wb->rd);
+            *p++ = '=';
+            p = fmt_int(p, rec->wb_value);
+            if (post) *p++ = ',';
+        }
+        if (post) {
+            p = FMT_LIT(p, " R");
+            p = fmt_int(p, post->rd);
+            *p++ = '=';
+            p = fmt_int(p, rec->wb_post_value);
+        }
+        p = FMT_LIT(p, ")\n");
+    } else if (wb && wb->rd != REG_UNUSED) {
+        p = FMT_LIT(p, "WB    : ");
+        p = fmt_slot(p, t, rec, TR_MEM_WB);
+        p = FMT_LIT(p, " (write R");
+        p = fmt_int(p, wb->rd);
+        *p++ = '=';
+        p = fmt_int(p, rec->wb_value);
+        p = FMT_LIT(p, ")\n");
+    } else {
+        p = fmt_stage(p, "WB    : ", t, rec, TR_MEM_WB);
+        *p++ = '\n';
     }
 
+    p = FMT_LIT(p, "\nRegisters: ");
+    for (int i = 0; i < num_regs; ++i) {
+        *p++ = 'R';
+        p = fmt_int_left(p, i, 2);
+        *p++ = '=';
+        p = fmt_int_left(p, rec->regs[i], 5);
+        *p++ = ' ';
+        if ((i + 1) % 8 == 0) p = FMT_LIT(p, "\n           ");
+    }
+    *p++ = '\n';
+    return p;
+}
 
-    printf("\nTotal cycles: %d\n", cycle - 1);
+/**
+ * @brief Prepare a formatter for a program's trace
+ * @param out Stream the text goes to (NULL: only format_cycle_state uses the tables)
+ * @return 0 on success, -1 if out of memory
+ */
+int trace_text_open(TraceText* t, FILE* out, const Instruction* prog, const SourceLine* source, int inst_count) {
+    memset(t, 0, sizeof(*t));
+    t->out = out;
+    t->prog = prog;
+    t->source = source;
+    t->inst_count = inst_count;
+    t->filter = trace_filter_all();
+    t->buf = malloc(TRACE_TEXT_BYTES);
+    t->padded = malloc(sizeof(*t->padded) * (size_t)(inst_count > 0 ? inst_count : 1));
+    t->text_len = malloc((size_t)(inst_count > 0 ? inst_count : 1));
+    t->selected = calloc((size_t)(inst_count > 0 ? inst_count : 1), 1);
+    if (!t->buf || !t->padded || !t->text_len || !t->selected) {
+        free(t->buf);
+        free(t->padded);
+        free(t->text_len);
+        free(t->selected);
+        memset(t, 0, sizeof(*t));
+        return -1;
+    }
+    for (int i = 0; i < inst_count; ++i) {
+        size_t n = strnlen(source[i], LINE_LEN - 1);
+        t->text_len[i] = (uint8_t)n;
+        memset(t->padded[i], ' ', sizeof(t->padded[i]));
+        memcpy(t->padded[i], source[i], n);
+    }
+    return 0;
+}
+
+/**
+ * @brief write() all of buf, resuming after short writes
+ * @return false on a write error
+ */
+static bool write_all(int fd, const char* buf, size_t len) {
+    for (size_t done = 0; done < len;) {
+        ssize_t n = write(fd, buf + done, len - done);
+        if (n < 0) return false;
+        done += (size_t)n;
+    }
+    return true;
+}
+
+/** @brief Restrict the trace to the cycles f selects */
+void trace_text_filter(TraceText* t, const TraceFilter* f) {
+    t->filter = *f;
+    t->by_inst = f->pc_from > 0 || f->pc_to < t->inst_count - 1 || f->ops != (1u << OP_COUNT) - 1;
+    for (int i = 0; i < t->inst_count; ++i)
+        t->selected[i] = i >= f->pc_from && i <= f->pc_to && (f->ops >> t->prog[i].op & 1);
+}
+
+/** @brief Whether a cycle inside the filter's window passes its other conditions */
+static bool trace_text_match(const TraceText* t, const TraceRecord* rec) {
+    const TraceFilter* f = &t->filter;
+    if (f->by_addr && (rec->mem_type == MEM_EV_NONE || rec->mem_addr < f->addr_from || rec->mem_addr > f->addr_to))
+        return false;
+    if (!t->by_inst) return true;
+    for (int s = 0; s < 4; ++s)
+        if ((rec->idx[s] >= 0 && t->selected[rec->idx[s]]) || (rec->pre[s] >= 0 && t->selected[rec->pre[s]]) ||
+            (rec->post[s] >= 0 && t->selected[rec->post[s]]))
+            return true;
+    return false;
+}
+
+/** @brief Write out the buffered text (stdio output to the same stream goes first) */
+void trace_text_flush(TraceText* t) {
+    if (!t->out || t->len == 0) return;
+    fflush(t->out);
+    if (!t->error && !write_all(fileno(t->out), t->buf, t->len)) t->error = true;
+    t->len = 0;
+}
+
+/** @brief Append one cycle, flushing first if it might not fit */
+void trace_text_cycle(TraceText* t, int num_regs, const TraceRecord* rec) {
+    if (t->len > TRACE_TEXT_BYTES - TRACE_CYCLE_MAX) trace_text_flush(t);
+    t->len = (size_t)(format_cycle_state(t->buf + t->len, t, num_regs, rec) - t->buf);
+}
+
+/** @brief Flush and release the formatter */
+void trace_text_close(TraceText* t) {
+    trace_text_flush(t);
+    free(t->buf);
+    free(t->padded);
+    free(t->text_len);
+    free(t->selected);
+    t->buf = NULL;
+}
+
+// ---------- Simulation driver ----------
+static const char* const STALL_NAMES[STALL_COUNT] = {
+    "none", "store->load", "raw", "ex_busy", "mem_busy", "replay", "rf_read", "rf_write", "exception"
+};
+
+/**
+ * @brief Clear all CPU state and install the default configuration
+ * Instructions past inst_count are left as they are; nothing reads them.
+ */
+void cpu_reset(CPU* cpu) {
+    Instruction* program = cpu->program;
+    SourceLine* source = cpu->source;
+    int* memory = cpu->memory;
+    memset(cpu, 0, sizeof(CPU));
+    memset(memory, 0, sizeof(int) * MEM_SIZE_WORDS);
+    cpu->program = program;
+    cpu->source = source;
+    cpu->memory = memory;
+    cpu->cfg = default_config();
+    cpu->handler = -1;
+    cpu->trace = NULL;
+}
+
+/**
+ * @brief Allocate a CPU with its program and memory, in the reset state
+ */
+CPU* cpu_new(void) {
+    CPU* cpu = aligned_alloc(CACHE_LINE_BYTES, sizeof(CPU));
+    cpu->program = aligned_alloc(CACHE_LINE_BYTES, sizeof(Instruction) * MAX_INST);
+    cpu->source = malloc(sizeof(SourceLine) * MAX_INST);
+    cpu->memory = aligned_alloc(CACHE_LINE_BYTES, sizeof(int) * MEM_SIZE_WORDS);
+    cpu_reset(cpu);
+    return cpu;
+}
+
+void cpu_free(CPU* cpu) {
+    if (!cpu) return;
+    free(cpu->program);
+    free(cpu->source);
+    free(cpu->memory);
+    free(cpu);
+}
+
+/**
+ * @brief Make dst a copy of src; dst keeps its own program and memory buffers
+ */
+void cpu_copy(CPU* dst, const CPU* src) {
+    Instruction* program = dst->program;
+    SourceLine* source = dst->source;
+    int* memory = dst->memory;
+    memcpy(dst, src, sizeof(CPU));
+    dst->program = program;
+    dst->source = source;
+    dst->memory = memory;
+    memcpy(program, src->program, sizeof(Instruction) * (size_t)src->inst_count);
+    memcpy(source, src->source, sizeof(SourceLine) * (size_t)src->inst_count);
+    memcpy(memory, src->memory, sizeof(int) * MEM_SIZE_WORDS);
+}
+
+/**
+ * @brief Prepare a loaded CPU for simulation under cpu->cfg
+ * Registers and memory keep whatever the loader put there, except that vm=1 writes
+ * the page table over the top of memory.
+ */
+void sim_start(CPU* cpu) {
+    cpu->PC = 0;
+    memset(&cpu->stats, 0, sizeof(cpu->stats));
+    cache_init(&cpu->dcache, &cpu->cfg);
+    tlb_init(&cpu->tlb[0], cpu->cfg.vm ? cpu->cfg.tlb_entries : 0);
+    tlb_init(&cpu->tlb[1], cpu->cfg.vm ? cpu->cfg.tlb2_entries : 0);
+    vm_write_page_table(&cpu->cfg, cpu->memory);
+    init_pipeline(cpu);
+    cpu->ex_started = cpu->mem_started = false;
+    cpu->ex_wait = cpu->mem_wait = 0;
+    cpu->ex_read_wait = 0;
+    cpu->wb_started = false;
+    cpu->wb_wait = 0;
+    memset(cpu->lvp, 0, sizeof(cpu->lvp));
+    cpu->epc = 0;
+    cpu->exc_start = -1;
+    if (cpu->handler == 0) cpu->PC = cpu->inst_count;   // no main program
+
+    // Prime pipeline_IF_ID with first fetch so the first cycle shows ID properly
+    Instruction first;
+    fetch_stage(cpu, &first);         // Fetch first instruction
+    cpu->pipeline_IF_ID.inst = first; // Load into IF/ID latch
+    cpu->fetch_high = 0;
+    pc_advance(cpu);                  // ✅ Increment PC once here
+}
+
+/**
+ * @brief Simulate one clock cycle
+ * @return false if the program had already drained (no cycle simulated)
+ */
+bool sim_step(CPU* cpu) {
+    if (!(cpu->PC < cpu->inst_count || !pipeline_is_empty(cpu))) {
+        exception_close(cpu, cpu->stats.cycles);   // a fault with nothing after it to resume
+        return false;
+    }
+
+    // ---- Phase 1: compute ----
+    cpu->mem_event.type = MEM_EV_NONE;
+    // A slot short of write ports holds WB, and so everything behind it.
+    bool wb_hold = wb_stage_busy(cpu);
+    if (!wb_hold) wb_stage(cpu);
+
+    // A long-latency access holds MEM and everything behind it.
+    bool mem_hold = mem_stage_busy(cpu, cpu, 0) || wb_hold;
+    MemResult mem_res;
+    mem_res.next = make_nop_latch();
+    if (!mem_hold) {
+        // Run MEM stage for the instruction currently in EX/MEM and capture its outputs.
+        int mem_idx = cpu->pipeline_EX_MEM.inst.idx;
+        mem_res = memory_stage(cpu, cpu->pipeline_EX_MEM);
+        if (cpu->on_access && cpu->mem_event.type != MEM_EV_NONE)
+            cpu->on_access(cpu->on_access_ctx, cpu->mem_event.type, cpu->mem_event.addr, mem_idx,
+                           cpu->stats.cycles + 1);
+
+        // Make the MEM stage's output immediately visible for forwarding by
+        // updating the CPU's pipeline_EX_MEM to the post-MEM latch.
+        // This allows resolve_operand(...) to forward load-values from EX/MEM.
+        // A faulting slot stays as it is for the trace; this cycle's EX is flushed anyway.
+        if (mem_res.fault == FAULT_NONE) cpu->pipeline_EX_MEM = mem_res.next;
+    }
+
+    // Now run EX stage for the instruction currently in ID/EX. It may now
+    // forward values produced by the MEM stage (including load data).
+    ExecResult ex_res = execute_stage(cpu, cpu->pipeline_ID_EX);
+    StallCause ex_busy = ex_stage_busy(cpu, &ex_res);
+    bool ex_hold = ex_busy != STALL_NONE;
+
+    DecodeResult dec_res = decode_stage(cpu, cpu->pipeline_IF_ID, cpu->pipeline_ID_EX);
+    Instruction fetched_inst;
+    fetch_stage(cpu, &fetched_inst);
+
+    // A consumer that executed with a wrong predicted value is squashed with everything
+    // younger. A held EX re-reads its operands next cycle, by then from MEM/WB.
+    bool replay = !mem_hold && !ex_hold && mem_res.mispredict && ex_res.used_prediction;
+    // A faulting access flushes everything younger, whatever EX is doing.
+    bool fault = !mem_hold && mem_res.fault != FAULT_NONE;
+
+    StallCause cause = dec_res.cause;
+    const char* reason = dec_res.stall_reason;
+    if (wb_hold) {
+        cause = STALL_RF_WRITE;
+        reason = "RF write ports";
+    } else if (mem_hold) {
+        cause = STALL_MEM_BUSY;
+        reason = "MEM busy";
+    } else if (fault) {
+        cause = STALL_EXCEPTION;
+        reason = "exception flush";
+    } else if (replay) {
+        cause = STALL_REPLAY;
+        reason = "load value mispredict (replay)";
+    } else if (ex_hold) {
+        cause = ex_busy;
+        reason = ex_busy == STALL_RF_READ ? "RF read ports" : "EX busy";
+    }
+
+    // ---- Phase 2: print ----
+    // A filtered text trace outside its cycle window costs only this comparison
+    int cycle = (int)cpu->stats.cycles + 1;
+    const TraceText* tt = cpu->trace_text;
+    bool text = tt && cycle >= tt->filter.cycle_from && cycle <= tt->filter.cycle_to;
+    if (cpu->trace || text || cpu->on_cycle) {
+        // The EX line shows the execute result, not the latched view
+        TraceRecord rec;
+        trace_capture(cpu, &ex_res.next, cycle, cause != STALL_NONE, reason, &rec);
+        if (tt) {
+            if (text && trace_text_match(tt, &rec)) trace_text_cycle(cpu->trace_text, cpu->cfg.num_regs, &rec);
+        } else if (cpu->trace) {
+            print_cycle_state(cpu->trace, cpu->program, cpu->source, cpu->inst_count, cpu->cfg.num_regs, &rec);
+        }
+        if (cpu->on_cycle) cpu->on_cycle(cpu->on_cycle_ctx, cpu, &rec);
+    }
+
+    // ---- Phase 3: latch update ----
+    if (wb_hold) {
+        // Nothing moves; MEM/WB finishes its writes in a later cycle.
+    } else if (mem_hold) {
+        cpu->pipeline_MEM_WB = make_nop_latch();
+        cpu->wb_started = false;
+    } else if (fault) {
+        exception_take(cpu, &mem_res, slot_insts(&cpu->pipeline_ID_EX) + slot_insts(&cpu->pipeline_IF_ID));
+        cpu->pipeline_MEM_WB = mem_res.next;
+        cpu->wb_started = false;
+        cpu->pipeline_EX_MEM = make_nop_latch();
+        cpu->pipeline_ID_EX = make_nop_latch();
+        cpu->pipeline_IF_ID = make_nop_latch();
+        cpu->mem_started = cpu->ex_started = false;
+    } else if (replay) {
+        const StageLatch* victim = &cpu->pipeline_ID_EX;
+        cpu->PC = victim->pre >= 0 ? victim->pre : victim->inst.idx;
+        cpu->pipeline_MEM_WB = mem_res.next;
+        cpu->wb_started = false;
+        cpu->pipeline_EX_MEM = make_nop_latch();
+        cpu->pipeline_ID_EX = make_nop_latch();
+        cpu->pipeline_IF_ID = make_nop_latch();
+        cpu->mem_started = cpu->ex_started = false;
+        cpu->stats.lvp_replays++;
+    } else if (ex_hold) {
+        cpu->pipeline_MEM_WB = mem_res.next;
+        cpu->wb_started = false;
+        cpu->pipeline_EX_MEM = make_nop_latch();
+        cpu->mem_started = false;
+    } else {
+        advance_pipeline(cpu, ex_res, mem_res, fetched_inst, dec_res);
+    }
+
+    if (cause != STALL_NONE)
+        cpu->stats.stall[cause]++;
+    cpu->stats.cycles++;
+    return true;
+}
+
+/**
+ * @brief Run until the program has drained
+ * @return Total cycles simulated
+ */
+long long sim_run(CPU* cpu) {
+    while (sim_step(cpu)) {
+    }
+    return cpu->stats.cycles;
+}
+
+void print_stats(FILE* out, const CPU* cpu) {
+    const SimStats* st = &cpu->stats;
+    fprintf(out, "\n=============== STATISTICS ===============\n");
+    fprintf(out, "Config      : ");
+    config_print(out, &cpu->cfg);
+    fprintf(out, "\nInstructions: %lld\n", st->retired);
+    fprintf(out, "Cycles      : %lld\n", st->cycles);
+    fprintf(out, "CPI         : %.3f\n", st->retired ? (double)st->cycles / st->retired : 0.0);
+    fprintf(out, "Stalls      :");
+    for (int c = STALL_NONE + 1; c < STALL_COUNT; ++c)
+        fprintf(out, " %s=%lld", STALL_NAMES[c], st->stall[c]);
+    fprintf(out, "\n");
+    if (cpu->cfg.cache_bytes) {
+        long long n = st->cache_hits + st->cache_misses;
+        fprintf(out, "D-cache     : hits=%lld misses=%lld miss_rate=%.3f\n",
+                st->cache_hits, st->cache_misses, n ? (double)st->cache_misses / n : 0.0);
+    }
+    if (cpu->cfg.vm) {
+        long long n = st->tlb_hits[0] + st->tlb_hits[1] + st->tlb_walks;
+        fprintf(out, "TLB         : L1 hits=%lld L2 hits=%lld walks=%lld miss_rate=%.3f translation_cycles=%lld\n",
+                st->tlb_hits[0], st->tlb_hits[1], st->tlb_walks,
+                n ? (double)st->tlb_walks / n : 0.0, st->tlb_cycles);
+    }
+    if (cpu->cfg.fusion)
+        fprintf(out, "Fused       : %lld instruction(s) shared a slot\n", st->fused);
+    if (cpu->cfg.move_elim)
+        fprintf(out, "Eliminated  : %lld MOV / zero idiom(s) completed in decode (%lld zero idioms)\n",
+                st->eliminated, st->zero_idioms);
+    if (cpu->cfg.lvp)
+        fprintf(out, "Value pred  : %lld of %lld loads predicted (coverage %.1f%%), %lld correct (accuracy %.1f%%), %lld replay(s)\n",
+                st->lvp_predicted, st->loads, st->loads ? 100.0 * st->lvp_predicted / st->loads : 0.0,
+                st->lvp_correct, st->lvp_predicted ? 100.0 * st->lvp_correct / st->lvp_predicted : 0.0,
+                st->lvp_replays);
+    if (st->exceptions)
+        fprintf(out, "Exceptions  : %lld taken, %lld cycle(s) until resumed (%lld handler instruction(s), %lld drain/refill), %lld instruction(s) squashed\n",
+                st->exceptions, st->exc_cycles, st->handler_retired, st->exc_cycles - st->handler_retired,
+                st->exc_squashed);
+    if (cpu->cfg.fusion || cpu->cfg.move_elim || cpu->cfg.lvp)
+        fprintf(out, "Operands    : RF=%lld EX/MEM=%lld MEM/WB=%lld decode=%lld predicted=%lld\n",
+                st->operand_src[SRC_REG], st->operand_src[SRC_MEM], st->operand_src[SRC_WB],
+                st->operand_src[SRC_ID], st->operand_src[SRC_PRED]);
+}
+
+/**
+ * @brief The configuration with the study features (fusion, move_elim, lvp) turned off
+ */
+SimConfig config_without_studies(const SimConfig* c) {
+    SimConfig b = *c;
+    b.fusion = 0;
+    b.move_elim = 0;
+    b.lvp = LVP_OFF;
+    return b;
+}
+
+/**
+ * @brief Compare a run against the same program without the study features
+ * @param base Finished run with config_without_studies() of cpu's configuration
+ */
+void print_study_savings(FILE* out, const CPU* cpu, const CPU* base) {
+    const SimStats* a = &base->stats;
+    const SimStats* b = &cpu->stats;
+    fprintf(out, "Saved       : %lld cycle(s) vs. fusion=0 move_elim=0 lvp=0 (%lld -> %lld, CPI %.3f -> %.3f)\n",
+            a->cycles - b->cycles, a->cycles, b->cycles,
+            a->retired ? (double)a->cycles / a->retired : 0.0,
+            b->retired ? (double)b->cycles / b->retired : 0.0);
+    fprintf(out, "Forwarding  : EX/MEM %lld -> %lld, MEM/WB %lld -> %lld, decode %lld -> %lld, predicted %lld -> %lld, RF %lld -> %lld\n",
+            a->operand_src[SRC_MEM], b->operand_src[SRC_MEM], a->operand_src[SRC_WB], b->operand_src[SRC_WB],
+            a->operand_src[SRC_ID], b->operand_src[SRC_ID], a->operand_src[SRC_PRED], b->operand_src[SRC_PRED],
+            a->operand_src[SRC_REG], b->operand_src[SRC_REG]);
+}
+
+// ---------- Functional reference model ----------
+/**
+ * @brief Execute one instruction architecturally: no pipeline, no timing
+ * @param image CPU whose program image defines the guard regions
+ * @return false if the access faulted (nothing is written)
+ */
+bool interp_step(int* R, int* mem, const Instruction* in, const CPU* image) {
+    unsigned a = in->rs1 != REG_UNUSED ? (unsigned)R[in->rs1] : 0;
+    unsigned b = in->rs2 != REG_UNUSED ? (unsigned)R[in->rs2] : 0;
+    switch (in->op) {
+        case OP_MOV: R[in->rd] = in->imm; break;
+        case OP_ADD: R[in->rd] = (int)(a + b); break;
+        case OP_SUB: R[in->rd] = (int)(a - b); break;
+        case OP_MUL: R[in->rd] = (int)(a * b); break;
+        case OP_LOAD: {
+            int addr = (int)(a + (unsigned)in->imm);
+            if (access_fault(image, addr) != FAULT_NONE) return false;
+            R[in->rd] = mem[addr / WORD_SIZE_BYTES];
+            break;
+        }
+        case OP_STORE: {
+            int addr = (int)(b + (unsigned)in->imm);
+            if (access_fault(image, addr) != FAULT_NONE) return false;
+            mem[addr / WORD_SIZE_BYTES] = (int)a;
+            break;
+        }
+        default: break;
+    }
+    return true;
+}
+
+/**
+ * @brief Run a program image architecturally, including its exception handler
+ * @return Instructions completed (a faulting access does not complete)
+ */
+long long interp_run(int* R, int* mem, const CPU* image) {
+    int handler = image->handler;
+    int end = handler >= 0 ? handler : image->inst_count;
+    int epc = 0;
+    long long completed = 0;
+    for (int pc = 0; pc < end;) {
+        const Instruction* in = &image->program[pc];
+        if (in->op == OP_RFE) {
+            pc = epc;
+            end = handler;
+            completed++;
+        } else if (interp_step(R, mem, in, image)) {
+            pc++;
+            completed++;
+        } else if (handler >= 0 && pc < handler) {
+            epc = pc + 1;
+            pc = handler;
+            end = image->inst_count;
+        } else {
+            break;   // unhandled: the program ends
+        }
+    }
+    return completed;
+}
+
+// ---------- Packed timing model ----------
+// When no timing parameter depends on data (no cache, no translation, no value
+// prediction, no fusion or move elimination, and no read-port limit one slot can
+// exceed), the cycles and stalls follow from the instruction stream alone. The functional
+// model computes the final state, and a timing-only pipeline counts the cycles. Each
+// latch is a 16-bit lane of one 64-bit word that holds the instruction index + 1 (0 is
+// a bubble). Advancing the pipeline is a shift, a stall is a mask, the pipeline is
+// empty when the word is zero, and a RAW hazard is an AND of register masks.
+#define PK_LANE_BITS 16
+#define PK_LANE(s) (0xFFFFull << (PK_LANE_BITS * (s)))   // 0 = IF/ID, 1 = ID/EX, 2 = EX/MEM, 3 = MEM/WB
+
+typedef struct {
+    uint32_t reads, writes;  // register bit masks
+    bool load, store, mem, long_latency;
+    int base, imm;           // address of a LOAD/STORE, for the STORE→LOAD check
+} PackedOp;
+
+/**
+ * @brief Does the packed timing model produce the pipeline's cycles and stalls for
+ *        this configuration and program?
+ * Any access that faults is found when the model runs.
+ */
+bool timing_supported(const CPU* cpu) {
+    const SimConfig* c = &cpu->cfg;
+    return c->cache_bytes == 0 && !c->vm && !c->fusion && !c->move_elim && c->lvp == LVP_OFF &&
+           c->rf_read_ports != 1 && cpu->handler < 0;
+}
+
+/**
+ * @brief Run a loaded program with the packed timing model instead of the pipeline
+ * Sets cycles, retired and the stall counts; the other statistics stay zero. The
+ * registers and memory hold the final state.
+ * @return false (cpu unchanged) if the model does not cover the run; use sim_start/sim_run
+ */
+bool timing_run(CPU* cpu) {
+    if (!timing_supported(cpu)) return false;
+    int n = cpu->inst_count;
+    int R[MAX_REGS];
+    int mem[MEM_SIZE_WORDS];
+    memcpy(R, cpu->R, sizeof(R));
+    memcpy(mem, cpu->memory, sizeof(mem));
+    if (interp_run(R, mem, cpu) != n) return false;   // a fault ends the program early
+
+    PackedOp ops[MAX_INST + 1];
+    memset(&ops[0], 0, sizeof(ops[0]));               // lane value 0: a bubble
+    for (int i = 0; i < n; ++i) {
+        const Instruction* in = &cpu->program[i];
+        const OpInfo* info = op_info(in);
+        PackedOp* p = &ops[i + 1];
+        p->reads = (info->reads_rs1 ? 1u << in->rs1 : 0) | (info->reads_rs2 ? 1u << in->rs2 : 0);
+        p->writes = info->writes_rd ? 1u << in->rd : 0;
+        p->load = info->is_load;
+        p->store = info->is_store;
+        p->mem = info->is_mem;
+        p->long_latency = info->long_latency;
+        p->base = inst_base_reg(in);
+        p->imm = in->imm;
+    }
+
+    SimStats* st = &cpu->stats;
+    memset(st, 0, sizeof(*st));
+    ForwardPolicy fwd = cpu->cfg.forwarding;
+    int mem_latency = cpu->cfg.mem_latency, ex_latency = cpu->cfg.mul_latency - 1;
+    uint64_t pipe = n > 0;                             // sim_start's first fetch
+    int pc = n > 0;
+    int mem_wait = 0, ex_wait = 0;
+    bool mem_started = false, ex_started = false;
+    while (pc < n || pipe) {
+        const PackedOp* id_op = &ops[pipe & 0xFFFF];
+        const PackedOp* ex_op = &ops[pipe >> PK_LANE_BITS & 0xFFFF];
+        const PackedOp* mem_op = &ops[pipe >> 2 * PK_LANE_BITS & 0xFFFF];
+        st->retired += (pipe & PK_LANE(3)) != 0;
+
+        // The same counters as mem_stage_busy / ex_stage_busy, charged on entry.
+        if (!mem_started) {
+            mem_started = true;
+            mem_wait = mem_op->mem ? mem_latency : 0;
+        }
+        bool mem_hold = mem_wait > 0;
+        mem_wait -= mem_hold;
+        if (!ex_started) {
+            ex_started = true;
+            ex_wait = ex_op->long_latency ? ex_latency : 0;
+        }
+        bool ex_hold = ex_wait > 0;
+        ex_wait -= ex_hold;
+
+        StallCause cause = STALL_NONE;
+        if (ex_op->store && id_op->load && ex_op->base == id_op->base && ex_op->imm == id_op->imm)
+            cause = STALL_STORE_LOAD;
+        else if (fwd != FWD_FULL && (id_op->reads & ex_op->writes) && (fwd == FWD_NONE || ex_op->load))
+            cause = STALL_RAW;
+
+        if (mem_hold) {
+            cause = STALL_MEM_BUSY;
+            pipe &= ~PK_LANE(3);
+        } else if (ex_hold) {
+            cause = STALL_EX_BUSY;
+            pipe = (pipe << PK_LANE_BITS & PK_LANE(3)) | (pipe & (PK_LANE(0) | PK_LANE(1)));
+            mem_started = false;
+        } else {
+            mem_started = ex_started = false;
+            if (cause != STALL_NONE) {
+                pipe = (pipe << PK_LANE_BITS & (PK_LANE(2) | PK_LANE(3))) | (pipe & PK_LANE(0));
+            } else {
+                pipe = pipe << PK_LANE_BITS | (uint64_t)(pc < n ? pc + 1 : 0);
+                pc += pc < n;
+            }
+        }
+        if (cause != STALL_NONE) st->stall[cause]++;
+        st->cycles++;
+    }
+
+    memcpy(cpu->R, R, sizeof(R));
+    memcpy(cpu->memory, mem, sizeof(mem));
+    init_pipeline(cpu);
+    cpu->PC = n;
+    return true;
+}
+
+// ---------- Run logs (record) ----------
+// A run log lists every simulation a run performed, in the order the host finished
+// them. Each entry has the inputs needed to repeat that simulation alone and a digest
+// of its result. Completion order, which worker found a fuzz failure first and how far
+// a stopped batch got all depend on host scheduling. They are recorded, not
+// recomputed. One tab-separated line per event:
+//   sim   <job> <config> <program> <image hash> <cycles> <digest>
+//   fuzz  <index> <seed> <length> <hazard> <mem_words> <fault_pct> <config> <cycles> <digest>
+//   note  <free text>
+typedef struct {
+    FILE* f;
+    pthread_mutex_t lock;
+} RunLog;
+
+static uint64_t fnv1a(uint64_t h, const void* data, size_t n) {
+    const unsigned char* p = data;
+    for (size_t i = 0; i < n; ++i) {
+        h ^= p[i];
+        h *= 0x100000001B3ull;
+    }
+    return h;
+}
+#define FNV_OFFSET 0xCBF29CE484222325ull
+
+/**
+ * @brief Hash of a loaded program image (instructions, initial registers and memory)
+ */
+uint64_t cpu_image_hash(const CPU* cpu) {
+    uint64_t h = FNV_OFFSET;
+    for (int i = 0; i < cpu->inst_count; ++i) {
+        const Instruction* in = &cpu->program[i];
+        int f[5] = { in->op, in->rd, in->rs1, in->rs2, in->imm };
+        h = fnv1a(h, f, sizeof(f));
+    }
+    h = fnv1a(h, cpu->R, sizeof(cpu->R));
+    if (cpu->handler >= 0 || cpu->nguards) {
+        h = fnv1a(h, &cpu->handler, sizeof(cpu->handler));
+        h = fnv1a(h, cpu->guard, sizeof(cpu->guard[0]) * (size_t)cpu->nguards);
+    }
+    return fnv1a(h, cpu->memory, sizeof(int) * MEM_SIZE_WORDS);
+}
+
+/**
+ * @brief Digest of everything a finished simulation produced
+ */
+uint64_t cpu_state_digest(const CPU* cpu) {
+    uint64_t h = FNV_OFFSET;
+    h = fnv1a(h, cpu->R, sizeof(cpu->R));
+    h = fnv1a(h, cpu->memory, sizeof(int) * MEM_SIZE_WORDS);
+    return fnv1a(h, &cpu->stats, sizeof(cpu->stats));
+}
+
+RunLog* runlog_open(const char* path, int argc, char** argv) {
+    FILE* f = fopen(path, "w");
+    if (!f) return NULL;
+    RunLog* log = malloc(sizeof(RunLog));
+    log->f = f;
+    pthread_mutex_init(&log->lock, NULL);
+    fprintf(f, "# pipeline simulator run log v1\n# command:");
+    for (int i = 0; i < argc; ++i) fprintf(f, " %s", argv[i]);
+    fprintf(f, "\n");
+    return log;
+}
+
+void runlog_close(RunLog* log) {
+    if (!log) return;
+    fclose(log->f);
+    pthread_mutex_destroy(&log->lock);
+    free(log);
+}
+
+/**
+ * @brief Log one finished simulation of a program file (thread-safe; log may be NULL)
+ * @param image_hash cpu_image_hash of the program as loaded
+ */
+void runlog_sim(RunLog* log, long long job, const char* path, uint64_t image_hash, const CPU* done) {
+    if (!log) return;
+    char config[512];
+    config_format(config, sizeof(config), &done->cfg);
+    pthread_mutex_lock(&log->lock);
+    fprintf(log->f, "sim\t%lld\t%s\t%s\t%016llx\t%lld\t%016llx\n", job, config, path,
+            (unsigned long long)image_hash, done->stats.cycles,
+            (unsigned long long)cpu_state_digest(done));
+    pthread_mutex_unlock(&log->lock);
+}
+
+void runlog_note(RunLog* log, const char* text) {
+    if (!log) return;
+    pthread_mutex_lock(&log->lock);
+    fprintf(log->f, "note\t%s\n", text);
+    pthread_mutex_unlock(&log->lock);
+}
+
+// ---------- Design-space exploration ----------
+#define DSE_MAX_VALUES 32
+#define DSE_MAX_BENCH 64
+#define DSE_PATH_LEN 256
+
+typedef enum { SAMPLE_GRID, SAMPLE_RANDOM, SAMPLE_LHS } SampleMode;
+
+typedef struct {
+    const ConfigParam* param;
+    int values[DSE_MAX_VALUES];
+    int nvalues;
+} DseAxis;
+
+typedef struct {
+    DseAxis axes[NUM_CONFIG_PARAMS];
+    int naxes;
+    SampleMode sample;
+    int samples;                       // configurations drawn for random / lhs
+    uint64_t seed;
+    int threads;                       // 0 = all online cores
+    char output[DSE_PATH_LEN];         // full result table (CSV)
+    char pareto[DSE_PATH_LEN];         // Pareto frontier (CSV)
+    char bench[DSE_MAX_BENCH][DSE_PATH_LEN];
+    int nbench;
+} DseSpec;
+
+typedef struct {
+    long long cycles;
+    long long retired;
+    bool skipped;            // the benchmark names a register beyond the config's num_regs
+} DseResult;
+
+/**
+ * @brief splitmix64 step: small, seedable and identical on every host
+ */
+uint64_t rng_next(uint64_t* state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static char* trim(char* s) {
+    while (*s == ' ' || *s == '\t') s++;
+    size_t n = strlen(s);
+    while (n > 0 && (s[n-1] == ' ' || s[n-1] == '\t' || s[n-1] == '\n' || s[n-1] == '\r')) s[--n] = '\0';
+    return s;
+}
+
+/**
+ * @brief Parse a sweep specification
+ *
+ * One "key = values" per line, '#' starts a comment. Any pipeline parameter
+ * name takes a comma-separated list of values to sweep; the other keys are
+ * sample (grid | random N | lhs N), seed, threads, output, pareto and
+ * benchmarks (whitespace-separated program files).
+ * @return 0 on success, -1 on error (reported on stderr)
+ */
+int dse_parse_spec(const char* path, DseSpec* spec) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Could not open %s.\n", path);
+        return -1;
+    }
+    memset(spec, 0, sizeof(*spec));
+    spec->sample = SAMPLE_GRID;
+    spec->seed = 1;
+    strcpy(spec->output, "dse_results.csv");
+    strcpy(spec->pareto, "dse_pareto.csv");
+
+    char line[1024];
+    int lineno = 0, err = 0;
+    while (!err && fgets(line, sizeof(line), f)) {
+        lineno++;
+        char* hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        char* eq = strchr(line, '=');
+        if (!eq) {
+            if (*trim(line)) err = 1;
+            continue;
+        }
+        *eq = '\0';
+        char* key = trim(line);
+        char* val = trim(eq + 1);
+        const ConfigParam* p = config_param_find(key);
+
+        if (p) {
+            DseAxis* ax = &spec->axes[spec->naxes++];
+            ax->param = p;
+            for (char* tok = strtok(val, ", \t"); tok && !err; tok = strtok(NULL, ", \t")) {
+                if (ax->nvalues == DSE_MAX_VALUES || config_parse_value(p, tok, &ax->values[ax->nvalues++]) != 0)
+                    err = 1;
+            }
+            if (ax->nvalues == 0) err = 1;
+        } else if (strcmp(key, "sample") == 0) {
+            char mode[16];
+            int n = 0;
+            if (sscanf(val, "%15s %d", mode, &n) < 1) err = 1;
+            else if (strcmp(mode, "grid") == 0) spec->sample = SAMPLE_GRID;
+            else if (strcmp(mode, "random") == 0 && n > 0) { spec->sample = SAMPLE_RANDOM; spec->samples = n; }
+            else if (strcmp(mode, "lhs") == 0 && n > 0) { spec->sample = SAMPLE_LHS; spec->samples = n; }
+            else err = 1;
+        } else if (strcmp(key, "seed") == 0) {
+            spec->seed = strtoull(val, NULL, 10);
+        } else if (strcmp(key, "threads") == 0) {
+            spec->threads = atoi(val);
+        } else if (strcmp(key, "output") == 0) {
+            snprintf(spec->output, DSE_PATH_LEN, "%s", val);
+        } else if (strcmp(key, "pareto") == 0) {
+            snprintf(spec->pareto, DSE_PATH_LEN, "%s", val);
+        } else if (strcmp(key, "benchmarks") == 0) {
+            for (char* tok = strtok(val, " \t"); tok; tok = strtok(NULL, " \t")) {
+                if (spec->nbench == DSE_MAX_BENCH) { err = 1; break; }
+                snprintf(spec->bench[spec->nbench++], DSE_PATH_LEN, "%s", tok);
+            }
+        } else {
+            err = 1;
+        }
+    }
+    fclose(f);
+    if (err) {
+        fprintf(stderr, "%s:%d: bad sweep specification line\n", path, lineno);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Expand the spec into concrete configurations on top of base
+ * @param out Receives a malloc'd array (caller frees)
+ * @return Number of valid configurations
+ */
+int dse_generate(const DseSpec* spec, const SimConfig* base, SimConfig** out) {
+    int n = 1;
+    if (spec->sample == SAMPLE_GRID) {
+        for (int a = 0; a < spec->naxes; ++a) {
+            if (n > (1 << 20) / spec->axes[a].nvalues) {
+                fprintf(stderr, "Sweep grid is too large; use random or lhs sampling.\n");
+                *out = NULL;
+                return 0;
+            }
+            n *= spec->axes[a].nvalues;
+        }
+    } else {
+        n = spec->samples;
+    }
+
+    SimConfig* cfgs = malloc(sizeof(SimConfig) * (size_t)n);
+    int* lhs = malloc(sizeof(int) * (size_t)n * (size_t)(spec->naxes + 1));
+    uint64_t rng = spec->seed;
+
+    // Latin hypercube: each axis gets every stratum exactly once, in shuffled order.
+    if (spec->sample == SAMPLE_LHS) {
+        for (int a = 0; a < spec->naxes; ++a) {
+            int* perm = &lhs[a * n];
+            for (int i = 0; i < n; ++i) perm[i] = i;
+            for (int i = n - 1; i > 0; --i) {
+                int j = (int)(rng_next(&rng) % (uint64_t)(i + 1));
+                int t = perm[i]; perm[i] = perm[j]; perm[j] = t;
+            }
+        }
+    }
+
+    int count = 0, invalid = 0;
+    const char* first_bad = NULL;
+    for (int i = 0; i < n; ++i) {
+        SimConfig c = *base;
+        int rem = i;
+        for (int a = 0; a < spec->naxes; ++a) {
+            const DseAxis* ax = &spec->axes[a];
+            int k;
+            if (spec->sample == SAMPLE_GRID) {
+                k = rem % ax->nvalues;
+                rem /= ax->nvalues;
+            } else if (spec->sample == SAMPLE_RANDOM) {
+                k = (int)(rng_next(&rng) % (uint64_t)ax->nvalues);
+            } else {
+                k = (int)((long long)lhs[a * n + i] * ax->nvalues / n);
+            }
+            *config_field(&c, ax->param) = ax->values[k];
+        }
+        const char* bad = config_validate(&c);
+        if (!bad) cfgs[count++] = c;
+        else if (invalid++ == 0) first_bad = bad;
+    }
+    free(lhs);
+    if (invalid)
+        fprintf(stderr, "Skipped %d invalid configuration(s) (first: %s).\n", invalid, first_bad);
+    *out = cfgs;
+    return count;
+}
+
+/**
+ * @brief Rough hardware cost of a configuration: the second Pareto objective.
+ * Arbitrary units: one per cache byte plus tag comparators, bypass paths and multiplier speed.
+ */
+double config_cost(const SimConfig* c) {
+    double cost = c->cache_bytes;
+    if (c->cache_bytes) cost += 32.0 * c->cache_assoc;
+    cost += c->forwarding == FWD_FULL ? 256 : c->forwarding == FWD_ALU ? 128 : 0;
+    cost += 512.0 / c->mul_latency;
+    cost += 64.0 * ((c->fusion & FUSE_MOV_ALU) != 0) + 64.0 * ((c->fusion & FUSE_LOAD_ADD) != 0);
+    cost += 96.0 * c->move_elim;
+    cost += c->lvp ? 128.0 : 0.0;
+    if (c->vm) cost += 8.0 * (c->tlb_entries + c->tlb2_entries);
+    return cost;
+}
+
+typedef struct {
+    CPU* const* templates;   // one loaded (decoded) program per benchmark
+    const SimConfig* configs;
+    int nconfigs, nbench;
+    DseResult* results;      // [config * nbench + bench]
+    atomic_int next_job;
+    const DseSpec* spec;
+    const uint64_t* image_hash;  // per benchmark, for the run log
+    const int* max_reg;          // per benchmark, highest register it names
+    RunLog* log;
+    bool fast;               // packed timing model where it applies (not with a run log)
+} DseWork;
+
+static void* dse_worker(void* arg) {
+    DseWork* w = arg;
+    CPU* cpu = cpu_new();
+    int njobs = w->nconfigs * w->nbench;
+    for (;;) {
+        int job = atomic_fetch_add(&w->next_job, 1);
+        if (job >= njobs) break;
+        int b = job % w->nbench;
+        const SimConfig* cfg = &w->configs[job / w->nbench];
+        if (w->max_reg[b] >= cfg->num_regs) {
+            w->results[job].skipped = true;
+            continue;
+        }
+        cpu_copy(cpu, w->templates[b]);
+        cpu->cfg = *cfg;
+        if (!w->fast || !timing_run(cpu)) {
+            sim_start(cpu);
+            sim_run(cpu);
+        }
+        w->results[job].cycles = cpu->stats.cycles;
+        w->results[job].retired = cpu->stats.retired;
+        runlog_sim(w->log, job, w->spec->bench[b], w->image_hash[b], cpu);
+    }
+    cpu_free(cpu);
+    return NULL;
+}
+
+static double dse_mean_cpi(const DseResult* r, int nbench) {
+    double sum = 0;
+    for (int b = 0; b < nbench; ++b)
+        sum += r[b].retired ? (double)r[b].cycles / r[b].retired : 0.0;
+    return sum / nbench;
+}
+
+static bool dse_complete(const DseResult* r, int nbench) {
+    for (int b = 0; b < nbench; ++b)
+        if (r[b].skipped) return false;
+    return true;
+}
+
+/** @brief One table row; a config with skipped benchmarks leaves those cells and its totals empty */
+static void dse_write_row(FILE* f, int id, const SimConfig* c, const DseResult* r, int nbench) {
+    long long total = 0;
+    for (int b = 0; b < nbench; ++b) total += r[b].cycles;
+    fprintf(f, "%d", id);
+    for (int p = 0; p < NUM_CONFIG_PARAMS; ++p) {
+        if (CONFIG_PARAMS[p].offset == offsetof(SimConfig, forwarding))
+            fprintf(f, ",%s", FORWARD_NAMES[c->forwarding]);
+        else
+            fprintf(f, ",%d", config_get(c, &CONFIG_PARAMS[p]));
+    }
+    if (dse_complete(r, nbench))
+        fprintf(f, ",%.1f,%lld,%.4f", config_cost(c), total, dse_mean_cpi(r, nbench));
+    else
+        fprintf(f, ",%.1f,,", config_cost(c));
+    for (int b = 0; b < nbench; ++b) {
+        if (r[b].skipped) fprintf(f, ",");
+        else fprintf(f, ",%lld", r[b].cycles);
+    }
+    fprintf(f, "\n");
+}
+
+static void dse_write_header(FILE* f, const DseSpec* spec) {
+    fprintf(f, "config");
+    for (int p = 0; p < NUM_CONFIG_PARAMS; ++p) fprintf(f, ",%s", CONFIG_PARAMS[p].name);
+    fprintf(f, ",cost,total_cycles,mean_cpi");
+    for (int b = 0; b < spec->nbench; ++b) {
+        const char* slash = strrchr(spec->bench[b], '/');
+        fprintf(f, ",%s", slash ? slash + 1 : spec->bench[b]);
+    }
+    fprintf(f, "\n");
+}
+
+typedef struct {
+    int id;
+    double cost, cpi;
+} DsePoint;
+
+static int dse_point_cmp(const void* a, const void* b) {
+    const DsePoint* x = a;
+    const DsePoint* y = b;
+    if (x->cost != y->cost) return x->cost < y->cost ? -1 : 1;
+    if (x->cpi != y->cpi) return x->cpi < y->cpi ? -1 : 1;
+    return x->id - y->id;
+}
+
+/**
+ * @brief Run every configuration of a sweep over its benchmarks on all host cores
+ * @return 0 on success, 1 on error
+ */
+int run_dse(const char* spec_path, const SimConfig* base, char** extra_bench, int nextra, RunLog* log,
+            bool fast) {
+    DseSpec spec;
+    if (dse_parse_spec(spec_path, &spec) != 0) return 1;
+    if (nextra > 0) {
+        spec.nbench = 0;
+        for (int i = 0; i < nextra && i < DSE_MAX_BENCH; ++i)
+            snprintf(spec.bench[spec.nbench++], DSE_PATH_LEN, "%s", extra_bench[i]);
+    }
+    if (spec.nbench == 0) {
+        fprintf(stderr, "No benchmarks given for the sweep.\n");
+        return 1;
+    }
+
+    // Decode every benchmark once; workers copy the template for each run.
+    CPU** templates = calloc(spec.nbench, sizeof(CPU*));
+    uint64_t image_hash[DSE_MAX_BENCH];
+    int max_reg[DSE_MAX_BENCH];
+    int rc = 0;
+    for (int b = 0; b < spec.nbench && rc == 0; ++b) {
+        templates[b] = cpu_new();
+        cpu_reset(templates[b]);
+        templates[b]->cfg.num_regs = MAX_REGS;   // the sweep may vary num_regs
+        if (program_load(templates[b], spec.bench[b]) != 0) {
+            fprintf(stderr, "Could not open %s.\n", spec.bench[b]);
+            rc = 1;
+        }
+        image_hash[b] = cpu_image_hash(templates[b]);
+        max_reg[b] = program_max_reg(templates[b]);
+    }
+
+    SimConfig* configs = NULL;
+    int nconfigs = rc ? 0 : dse_generate(&spec, base, &configs);
+    if (rc == 0 && nconfigs == 0) rc = 1;
+
+    DseWork work;
+    DseResult* results = NULL;
+    if (rc == 0) {
+        int threads = spec.threads > 0 ? spec.threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads < 1) threads = 1;
+        results = calloc((size_t)nconfigs * spec.nbench, sizeof(DseResult));
+        work.templates = templates;
+        work.configs = configs;
+        work.nconfigs = nconfigs;
+        work.nbench = spec.nbench;
+        work.results = results;
+        work.spec = &spec;
+        work.image_hash = image_hash;
+        work.max_reg = max_reg;
+        work.log = log;
+        work.fast = fast && !log;   // replay checks the logged runs against the full pipeline
+        atomic_init(&work.next_job, 0);
+
+        fprintf(stderr, "Sweeping %d configuration(s) x %d benchmark(s) on %d thread(s)\n",
+                nconfigs, spec.nbench, threads);
+        pthread_t* tids = malloc(sizeof(pthread_t) * threads);
+        for (int t = 0; t < threads; ++t) pthread_create(&tids[t], NULL, dse_worker, &work);
+        for (int t = 0; t < threads; ++t) pthread_join(tids[t], NULL);
+        free(tids);
+
+        int skipped = 0;
+        size_t first = 0;
+        for (size_t j = 0; j < (size_t)nconfigs * spec.nbench; ++j)
+            if (results[j].skipped && skipped++ == 0) first = j;
+        if (skipped) {
+            int b = (int)(first % spec.nbench);
+            fprintf(stderr, "Skipped %d run(s) naming registers beyond num_regs (first: %s uses R%d, num_regs=%d).\n",
+                    skipped, spec.bench[b], max_reg[b], configs[first / spec.nbench].num_regs);
+        }
+    }
+
+    FILE* table = rc ? NULL : fopen(spec.output, "w");
+    FILE* front = rc ? NULL : fopen(spec.pareto, "w");
+    if (rc == 0 && (!table || !front)) {
+        fprintf(stderr, "Could not write %s / %s.\n", spec.output, spec.pareto);
+        rc = 1;
+    }
+    if (rc == 0) {
+        dse_write_header(table, &spec);
+        dse_write_header(front, &spec);
+        DsePoint* pts = malloc(sizeof(DsePoint) * nconfigs);
+        int npts = 0;
+        for (int c = 0; c < nconfigs; ++c) {
+            const DseResult* r = &results[(size_t)c * spec.nbench];
+            dse_write_row(table, c, &configs[c], r, spec.nbench);
+            if (!dse_complete(r, spec.nbench)) continue;   // a partial mean is not comparable
+            pts[npts].id = c;
+            pts[npts].cost = config_cost(&configs[c]);
+            pts[npts].cpi = dse_mean_cpi(r, spec.nbench);
+            npts++;
+        }
+
+        // Sorted by cost, a point is on the frontier iff it beats every cheaper point's CPI.
+        qsort(pts, npts, sizeof(DsePoint), dse_point_cmp);
+        double best = 0;
+        int nfront = 0;
+        printf("Pareto frontier (cost vs mean CPI):\n");
+        for (int i = 0; i < npts; ++i) {
+            if (nfront > 0 && pts[i].cpi >= best) continue;
+            best = pts[i].cpi;
+            nfront++;
+            int c = pts[i].id;
+            dse_write_row(front, c, &configs[c], &results[(size_t)c * spec.nbench], spec.nbench);
+            printf("  #%-5d cost=%-8.1f cpi=%.4f  ", c, pts[i].cost, pts[i].cpi);
+            config_print(stdout, &configs[c]);
+            printf("\n");
+        }
+        printf("%d of %d configurations on the frontier; table in %s, frontier in %s\n",
+               nfront, nconfigs, spec.output, spec.pareto);
+        free(pts);
+    }
+    if (table) fclose(table);
+    if (front) fclose(front);
+
+    for (int b = 0; b < spec.nbench; ++b) cpu_free(templates[b]);
+    free(templates);
+    free(configs);
+    free(results);
+    return rc;
+}
+
+// ---------- Benchmark suite ----------
+double host_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static const char* path_basename(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+/**
+ * @brief Simulate a loaded image repeat times
+ * @param cpu Scratch CPU; holds the state of the last run on return
+ * @param fast Use the packed timing model if it covers the run
+ * @return Host seconds spent
+ */
+double bench_time(CPU* cpu, const CPU* image, int repeat, bool fast) {
+    double t0 = host_seconds();
+    for (int r = 0; r < repeat; ++r) {
+        cpu_copy(cpu, image);
+        if (fast && timing_run(cpu)) continue;
+        sim_start(cpu);
+        sim_run(cpu);
+    }
+    return host_seconds() - t0;
+}
+
+/**
+ * @brief Run each kernel, check its golden final state and report timing
+ * @param repeat Simulations per kernel, to make host timing measurable
+ * @return 0 if every kernel matched its golden state, 1 otherwise
+ */
+int run_bench(const SimConfig* cfg, char** files, int nfiles, int repeat, bool fast) {
+    CPU* image = cpu_new();
+    CPU* cpu = cpu_new();
+    Golden* golden = malloc(sizeof(Golden));
+    int failed = 0;
+
+    printf("Config: ");
+    config_print(stdout, cfg);
+    if (fast) printf(" (packed timing model where it applies)");
+    printf("\n%-18s %6s %7s %6s", "kernel", "insts", "cycles", "CPI");
+    for (int c = STALL_NONE + 1; c < STALL_COUNT; ++c) printf(" %11s", STALL_NAMES[c]);
+    printf(" %10s  %s\n", "Mcycles/s", "golden");
+
+    for (int k = 0; k < nfiles; ++k) {
+        cpu_reset(image);
+        image->cfg = *cfg;
+        if (program_load_image(image, files[k], golden) != 0) {
+            printf("%-18s could not open\n", path_basename(files[k]));
+            failed++;
+            continue;
+        }
+
+        double elapsed = bench_time(cpu, image, repeat, fast);
+
+        const SimStats* st = &cpu->stats;
+        int bad = golden_check(cpu, golden, NULL);
+        printf("%-18s %6lld %7lld %6.3f", path_basename(files[k]), st->retired, st->cycles,
+               st->retired ? (double)st->cycles / st->retired : 0.0);
+        for (int c = STALL_NONE + 1; c < STALL_COUNT; ++c) printf(" %11lld", st->stall[c]);
+        printf(" %10.2f  %s\n", elapsed > 0 ? st->cycles * (double)repeat / elapsed / 1e6 : 0.0,
+               golden->count == 0 ? "none" : bad ? "FAIL" : "ok");
+        if (bad) {
+            golden_check(cpu, golden, stdout);
+            failed++;
+        }
+    }
+
+    free(golden);
+    cpu_free(cpu);
+    cpu_free(image);
+    return failed ? 1 : 0;
+}
+
+// ---------- Simultaneous multithreading ----------
+// Up to SMT_MAX_THREADS programs share one pipeline. Each hardware thread has its own
+// registers, PC, program and memory (a separate address space), plus a one-entry fetch
+// buffer in front of decode. Everything from ID/EX on, and the data cache, is shared.
+// Each cycle the fetch policy puts the threads in order. Decode issues the first
+// buffered instruction without a hazard, so a thread held by a load-use or STORE→LOAD
+// hazard lets another thread through. The single fetch port then refills the first
+// empty buffer in the same order.
+//
+// The stage functions are reused unchanged. Each thread is a CPU whose latch fields
+// hold its view of the shared latches, with the other threads' slots as bubbles, so
+// forwarding and hazard checks only ever see that thread's own instructions.
+#define SMT_MAX_THREADS 4
+
+typedef enum { SMT_ROUND_ROBIN, SMT_ICOUNT } SmtFetchPolicy;
+static const char* const SMT_POLICY_NAMES[] = { "rr", "icount" };
+
+typedef struct {
+    long long issued;      // cycles this thread had the issue slot
+    long long hazard;      // cycles its buffered instruction was held by its own hazard
+    long long waited;      // cycles it was ready but another thread issued
+    long long fetched;
+} SmtThreadStats;
+
+typedef struct {
+    int nthreads;
+    int policy;                     // SmtFetchPolicy
+    CPU* core;                      // shared latches, EX/MEM occupancy, data cache, cycle stats
+    int owner[4];                   // thread in ID/EX, EX/MEM, MEM/WB (TR_* index; -1 = bubble)
+    CPU* thread[SMT_MAX_THREADS];
+    SmtThreadStats ts[SMT_MAX_THREADS];
+    int last;                       // thread that issued most recently
+    long long covered;              // cycles a thread was held by a hazard while another issued
+} SmtCore;
+
+/**
+ * @brief Give every thread its view of the shared latches
+ */
+static void smt_sync_views(SmtCore* c) {
+    const StageLatch nop = make_nop_latch();
+    for (int t = 0; t < c->nthreads; ++t) {
+        CPU* th = c->thread[t];
+        th->pipeline_ID_EX = c->owner[TR_ID_EX] == t ? c->core->pipeline_ID_EX : nop;
+        th->pipeline_EX_MEM = c->owner[TR_EX_MEM] == t ? c->core->pipeline_EX_MEM : nop;
+        th->pipeline_MEM_WB = c->owner[TR_MEM_WB] == t ? c->core->pipeline_MEM_WB : nop;
+    }
+}
+
+/**
+ * @brief Order in which threads are offered the issue slot and the fetch port
+ *
+ * Round-robin starts after the thread that issued last. ICOUNT puts threads with
+ * fewer instructions in flight (fetch buffer and shared latches) first, and keeps
+ * the round-robin order between equals.
+ */
+static void smt_order(const SmtCore* c, int order[]) {
+    int n = c->nthreads;
+    for (int i = 0; i < n; ++i) order[i] = (c->last + 1 + i) % n;
+    if (c->policy != SMT_ICOUNT) return;
+
+    int count[SMT_MAX_THREADS];
+    for (int t = 0; t < n; ++t) count[t] = c->thread[t]->pipeline_IF_ID.inst.valid;
+    for (int s = TR_ID_EX; s <= TR_MEM_WB; ++s)
+        if (c->owner[s] >= 0) count[c->owner[s]]++;
+    for (int i = 1; i < n; ++i)
+        for (int j = i; j > 0 && count[order[j]] < count[order[j - 1]]; --j) {
+            int tmp = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = tmp;
+        }
+}
+
+static bool smt_done(const SmtCore* c) {
+    for (int t = 0; t < c->nthreads; ++t) {
+        const CPU* th = c->thread[t];
+        if (th->PC < th->inst_count || th->pipeline_IF_ID.inst.valid) return false;
+    }
+    return pipeline_is_empty(c->core);
+}
+
+/**
+ * @brief Prepare loaded thread CPUs to share one pipeline under cfg
+ */
+void smt_start(SmtCore* c, CPU** threads, int nthreads, const SimConfig* cfg, int policy) {
+    cpu_reset(c->core);
+    c->core->cfg = *cfg;
+    sim_start(c->core);
+    c->nthreads = nthreads;
+    c->policy = policy;
+    c->last = nthreads - 1;
+    c->covered = 0;
+    for (int s = 0; s < 4; ++s) c->owner[s] = -1;
+    memset(c->ts, 0, sizeof(c->ts));
+    for (int t = 0; t < nthreads; ++t) {
+        c->thread[t] = threads[t];
+        threads[t]->cfg = *cfg;
+        sim_start(threads[t]);     // primes each fetch buffer with the thread's first instruction
+    }
+}
+
+/**
+ * @brief Simulate one clock cycle of the shared pipeline
+ * @return false if every thread had already drained
+ */
+bool smt_step(SmtCore* c) {
+    if (smt_done(c)) return false;
+    CPU* core = c->core;
+    smt_sync_views(c);
+
+    // ---- Phase 1: compute ----
+    int wt = c->owner[TR_MEM_WB], mt = c->owner[TR_EX_MEM], et = c->owner[TR_ID_EX];
+    bool wb_hold = wb_stage_busy(core);
+    if (wt >= 0 && !wb_hold) wb_stage(c->thread[wt]);
+
+    bool mem_hold = mem_stage_busy(core, mt < 0 ? core : c->thread[mt], mt < 0 ? 0 : mt) || wb_hold;
+    MemResult mem_res;
+    mem_res.next = make_nop_latch();
+    mem_res.mispredict = false;
+    mem_res.fault = FAULT_NONE;
+    if (!mem_hold && mt >= 0) {
+        mem_res = memory_stage(c->thread[mt], core->pipeline_EX_MEM);
+        core->pipeline_EX_MEM = c->thread[mt]->pipeline_EX_MEM = mem_res.next;
+    }
+
+    ExecResult ex_res = execute_stage(et >= 0 ? c->thread[et] : core, core->pipeline_ID_EX);
+    StallCause ex_busy = ex_stage_busy(core, &ex_res);
+    bool ex_hold = ex_busy != STALL_NONE;
+
+    // A faulting access flushes the younger instructions of its own thread only.
+    bool fault = !mem_hold && mem_res.fault != FAULT_NONE;
+    if (fault) {
+        CPU* th = c->thread[mt];
+        int squashed = slot_insts(&th->pipeline_IF_ID);
+        if (et == mt) {
+            squashed += slot_insts(&core->pipeline_ID_EX);
+            ex_res.next = make_nop_latch();
+            ex_busy = STALL_NONE;
+            ex_hold = false;
+        }
+        exception_take(th, &mem_res, squashed);
+        th->pipeline_IF_ID = make_nop_latch();
+    }
+
+    // Offer the issue slot in policy order; a thread with a hazard passes it on.
+    int order[SMT_MAX_THREADS];
+    smt_order(c, order);
+    int issuer = -1;
+    DecodeResult dec_res = { 0 };
+    bool hazard[SMT_MAX_THREADS] = { false }, waited[SMT_MAX_THREADS] = { false };
+    StallCause hazard_cause[SMT_MAX_THREADS] = { STALL_NONE };
+    StallCause cause = STALL_NONE;
+    for (int i = 0; i < c->nthreads; ++i) {
+        int t = order[i];
+        CPU* th = c->thread[t];
+        if (!th->pipeline_IF_ID.inst.valid) continue;
+        DecodeResult d = decode_stage(th, th->pipeline_IF_ID, th->pipeline_ID_EX);
+        if (d.stall) {
+            hazard[t] = true;
+            hazard_cause[t] = d.cause;
+            if (cause == STALL_NONE) cause = d.cause;
+        } else if (issuer < 0) {
+            issuer = t;
+            dec_res = d;
+        } else {
+            waited[t] = true;
+        }
+    }
+    if (issuer >= 0) cause = STALL_NONE;
+
+    bool replay = !mem_hold && !ex_hold && mem_res.mispredict && ex_res.used_prediction;
+    if (wb_hold) cause = STALL_RF_WRITE;
+    else if (mem_hold) cause = STALL_MEM_BUSY;
+    else if (fault) cause = STALL_EXCEPTION;
+    else if (replay) cause = STALL_REPLAY;
+    else if (ex_hold) cause = ex_busy;
+
+    // ---- Phase 2: latch update ----
+    if (wb_hold) {
+        // Nothing moves until MEM/WB has its write ports.
+    } else if (mem_hold) {
+        core->pipeline_MEM_WB = make_nop_latch();
+        c->owner[TR_MEM_WB] = -1;
+        core->wb_started = false;
+    } else if (ex_hold) {
+        core->pipeline_MEM_WB = mem_res.next;
+        c->owner[TR_MEM_WB] = mt;
+        core->wb_started = false;
+        core->pipeline_EX_MEM = make_nop_latch();
+        c->owner[TR_EX_MEM] = -1;
+        core->mem_started = false;
+    } else {
+        core->pipeline_MEM_WB = mem_res.next;
+        c->owner[TR_MEM_WB] = mt;
+        core->wb_started = false;
+        core->mem_started = false;
+        if (replay) {
+            // Squash the consumer and the rest of its thread; other threads carry on.
+            CPU* v = c->thread[et];
+            v->PC = core->pipeline_ID_EX.pre >= 0 ? core->pipeline_ID_EX.pre : core->pipeline_ID_EX.inst.idx;
+            v->pipeline_IF_ID = make_nop_latch();
+            v->stats.lvp_replays++;
+            core->pipeline_EX_MEM = make_nop_latch();
+            c->owner[TR_EX_MEM] = -1;
+            if (issuer == et) issuer = -1;
+        } else {
+            core->pipeline_EX_MEM = ex_res.next;
+            c->owner[TR_EX_MEM] = ex_res.next.inst.valid ? et : -1;
+            if (ex_res.next.inst.valid) {
+                c->thread[et]->stats.operand_src[ex_res.next.src_rs1]++;
+                c->thread[et]->stats.operand_src[ex_res.next.src_rs2]++;
+            }
+        }
+
+        core->pipeline_ID_EX = issuer >= 0 ? dec_res.next : make_nop_latch();
+        c->owner[TR_ID_EX] = issuer;
+        core->ex_started = false;
+        if (issuer >= 0) {
+            CPU* th = c->thread[issuer];
+            if (dec_res.fold != FOLD_NONE) {
+                count_fold(th, &dec_res);
+                pc_advance(th);
+            }
+            th->pipeline_IF_ID = make_nop_latch();
+            if (dec_res.redirect) exception_return(th);
+            c->ts[issuer].issued++;
+            c->last = issuer;
+        }
+
+        // One fetch per cycle, into the first empty buffer in policy order.
+        for (int i = 0; i < c->nthreads; ++i) {
+            int t = order[i];
+            CPU* th = c->thread[t];
+            // A thread that was just redirected (replay, exception, RFE) fetches next cycle.
+            if (th->pipeline_IF_ID.inst.valid || th->PC >= th->inst_count || (replay && t == et) ||
+                (fault && t == mt) || (t == issuer && dec_res.redirect))
+                continue;
+            fetch_stage(th, &th->pipeline_IF_ID.inst);
+            pc_advance(th);
+            c->ts[t].fetched++;
+            break;
+        }
+
+        bool any_hazard = false;
+        for (int t = 0; t < c->nthreads; ++t) {
+            if (hazard[t]) {
+                c->thread[t]->stats.stall[hazard_cause[t]]++;
+                c->ts[t].hazard++;
+                any_hazard = true;
+            }
+            if (waited[t]) c->ts[t].waited++;
+        }
+        if (issuer >= 0 && any_hazard) c->covered++;
+    }
+
+    if (cause != STALL_NONE)
+        core->stats.stall[cause]++;
+    core->stats.cycles++;
+    for (int t = 0; t < c->nthreads; ++t) c->thread[t]->stats.cycles = core->stats.cycles;
+    return true;
+}
+
+/**
+ * @brief Run all threads until every one of them has drained
+ * @return Total cycles simulated
+ */
+long long smt_run(SmtCore* c) {
+    while (smt_step(c)) {
+    }
+    for (int t = 0; t < c->nthreads; ++t) exception_close(c->thread[t], c->core->stats.cycles);
+    return c->core->stats.cycles;
+}
+
+/**
+ * @brief Run 1..SMT_MAX_THREADS programs as threads of one pipeline and report throughput
+ *
+ * Each program is also run alone, and the report compares SMT with running them back to
+ * back. Golden .expect state is checked per thread.
+ * @return 0 if every thread matched its golden state, 1 otherwise
+ */
+int run_smt(const SimConfig* cfg, int policy, char** files, int nfiles) {
+    if (nfiles < 1 || nfiles > SMT_MAX_THREADS) {
+        fprintf(stderr, "--smt runs 1 to %d programs.\n", SMT_MAX_THREADS);
+        return 1;
+    }
+    CPU* threads[SMT_MAX_THREADS];
+    Golden* golden = malloc(sizeof(Golden) * nfiles);
+    CPU* alone = cpu_new();
+    SmtCore* c = malloc(sizeof(SmtCore));
+    c->core = cpu_new();
+    long long alone_cycles = 0;
+    int loaded = 0, failed = 0;
+
+    for (; loaded < nfiles; ++loaded) {
+        threads[loaded] = cpu_new();
+        cpu_reset(threads[loaded]);
+        threads[loaded]->cfg = *cfg;
+        if (program_load_image(threads[loaded], files[loaded], &golden[loaded]) != 0) {
+            fprintf(stderr, "Could not open %s.\n", files[loaded]);
+            failed = 1;
+            loaded++;
+            goto out;
+        }
+        cpu_copy(alone, threads[loaded]);
+        sim_start(alone);
+        alone_cycles += sim_run(alone);
+    }
+
+    smt_start(c, threads, nfiles, cfg, policy);
+    long long cycles = smt_run(c);
+
+    printf("SMT: %d thread(s), fetch=%s, config ", nfiles, SMT_POLICY_NAMES[policy]);
+    config_print(stdout, cfg);
+    printf("\n%-6s %-18s %6s %6s %8s %8s %8s  %s\n",
+           "thread", "program", "insts", "IPC", "issued", "hazard", "waited", "golden");
+    long long retired = 0;
+    for (int t = 0; t < nfiles; ++t) {
+        const CPU* th = threads[t];
+        int bad = golden_check(th, &golden[t], NULL);
+        retired += th->stats.retired;
+        printf("%-6d %-18s %6lld %6.3f %8lld %8lld %8lld  %s\n", t, path_basename(files[t]),
+               th->stats.retired, cycles ? (double)th->stats.retired / cycles : 0.0,
+               c->ts[t].issued, c->ts[t].hazard, c->ts[t].waited,
+               golden[t].count == 0 ? "none" : bad ? "FAIL" : "ok");
+        if (bad) {
+            golden_check(th, &golden[t], stdout);
+            failed = 1;
+        }
+    }
+
+    const SimStats* st = &c->core->stats;
+    printf("Aggregate   : %lld instructions in %lld cycles, IPC %.3f\n",
+           retired, cycles, cycles ? (double)retired / cycles : 0.0);
+    printf("Idle issue  :");
+    for (int s = STALL_NONE + 1; s < STALL_COUNT; ++s)
+        printf(" %s=%lld", STALL_NAMES[s], st->stall[s]);
+    printf("\n");
+    if (cfg->cache_bytes) {
+        long long n = st->cache_hits + st->cache_misses;
+        printf("D-cache     : hits=%lld misses=%lld miss_rate=%.3f (shared)\n",
+               st->cache_hits, st->cache_misses, n ? (double)st->cache_misses / n : 0.0);
+    }
+    printf("Hidden      : %lld cycle(s) another thread issued while one was held by a hazard\n",
+           c->covered);
+    printf("Alone       : %lld cycles back to back (IPC %.3f); SMT speedup %.3fx\n",
+           alone_cycles, alone_cycles ? (double)retired / alone_cycles : 0.0,
+           cycles ? (double)alone_cycles / cycles : 0.0);
+
+out:
+    for (int t = 0; t < loaded; ++t) cpu_free(threads[t]);
+    cpu_free(c->core);
+    free(c);
+    cpu_free(alone);
+    free(golden);
+    return failed;
+}
+
+// ---------- Throughput regression tracking ----------
+// Results log: one tab-separated line per kernel per run, appended so the file keeps
+// the history. A baseline file uses the same format; its latest entry per kernel
+// (with a matching configuration) is what a new run is compared against.
+#define PERF_MAX_SAMPLES 64
+#define PERF_LINE_LEN 4096
+
+typedef struct {
+    char kernel[DSE_PATH_LEN];
+    long long cycles;
+    double cpi;
+    double mcps[PERF_MAX_SAMPLES];   // host simulated-Mcycles/s, one per sample
+    int nsamples;
+} PerfRecord;
+
+static void mean_var(const double* x, int n, double* mean, double* var) {
+    double m = 0, v = 0;
+    for (int i = 0; i < n; ++i) m += x[i];
+    m /= n;
+    for (int i = 0; i < n; ++i) v += (x[i] - m) * (x[i] - m);
+    *mean = m;
+    *var = n > 1 ? v / (n - 1) : 0.0;
+}
+
+// Continued fraction for the regularised incomplete beta function (Lentz's method).
+static double beta_cf(double a, double b, double x) {
+    const double tiny = 1e-300;
+    double c = 1.0, d = 1.0 - (a + b) * x / (a + 1.0);
+    if (fabs(d) < tiny) d = tiny;
+    d = 1.0 / d;
+    double h = d;
+    for (int m = 1; m <= 200; ++m) {
+        double aa = m * (b - m) * x / ((a + 2*m - 1) * (a + 2*m));
+        d = 1.0 + aa * d; if (fabs(d) < tiny) d = tiny;
+        c = 1.0 + aa / c; if (fabs(c) < tiny) c = tiny;
+        d = 1.0 / d;
+        h *= d * c;
+        aa = -(a + m) * (a + b + m) * x / ((a + 2*m) * (a + 2*m + 1));
+        d = 1.0 + aa * d; if (fabs(d) < tiny) d = tiny;
+        c = 1.0 + aa / c; if (fabs(c) < tiny) c = tiny;
+        d = 1.0 / d;
+        double del = d * c;
+        h *= del;
+        if (fabs(del - 1.0) < 1e-12) break;
+    }
+    return h;
+}
+
+static double incomplete_beta(double a, double b, double x) {
+    if (x <= 0) return 0;
+    if (x >= 1) return 1;
+    double front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) + a * log(x) + b * log(1 - x));
+    if (x < (a + 1) / (a + b + 2)) return front * beta_cf(a, b, x) / a;
+    return 1.0 - front * beta_cf(b, a, 1 - x) / b;
+}
+
+/**
+ * @brief One-sided Welch t-test that sample a has a lower mean than sample b
+ * @return p-value (small = a is significantly slower)
+ */
+double welch_p_lower(const double* a, int na, const double* b, int nb) {
+    double ma, va, mb, vb;
+    mean_var(a, na, &ma, &va);
+    mean_var(b, nb, &mb, &vb);
+    double se2 = va / na + vb / nb;
+    if (se2 <= 0) return ma < mb ? 0.0 : 1.0;
+    double t = (ma - mb) / sqrt(se2);
+    double df = se2 * se2 / ((va / na) * (va / na) / (na - 1) + (vb / nb) * (vb / nb) / (nb - 1));
+    double tail = 0.5 * incomplete_beta(df / 2, 0.5, df / (df + t * t));  // P(T > |t|)
+    return t < 0 ? tail : 1.0 - tail;
+}
+
+/**
+ * @brief Short revision id of the working tree (PIPESIM_REV overrides)
+ */
+void source_revision(char* buf, size_t size) {
+    const char* env = getenv("PIPESIM_REV");
+    snprintf(buf, size, "%s", env ? env : "unknown");
+    if (env) return;
+    FILE* p = popen("git rev-parse --short HEAD 2>/dev/null", "r");
+    if (!p) return;
+    if (fgets(buf, (int)size, p)) buf[strcspn(buf, "\r\n")] = '\0';
+    if (buf[0] == '\0') snprintf(buf, size, "unknown");
+    pclose(p);
+}
+
+/**
+ * @brief Find the latest baseline record for kernel under the same configuration
+ * @return true if found
+ */
+static bool perf_find_baseline(const char* path, const char* config, const char* kernel, PerfRecord* out) {
+    FILE* f = fopen(path, "r");
+    if (!f) return false;
+    static const char* const delim = "\t\n";
+    char* line = malloc(PERF_LINE_LEN);
+    bool found = false;
+    while (fgets(line, PERF_LINE_LEN, f)) {
+        if (line[0] == '#') continue;
+        char* save;
+        strtok_r(line, delim, &save);              // time
+        strtok_r(NULL, delim, &save);              // revision
+        char* cfg = strtok_r(NULL, delim, &save);
+        char* kern = strtok_r(NULL, delim, &save);
+        char* cycles = strtok_r(NULL, delim, &save);
+        char* cpi = strtok_r(NULL, delim, &save);
+        char* samples = strtok_r(NULL, delim, &save);
+        if (!samples || strcmp(cfg, config) != 0 || strcmp(kern, kernel) != 0) continue;
+
+        PerfRecord r;
+        snprintf(r.kernel, sizeof(r.kernel), "%s", kern);
+        r.cycles = atoll(cycles);
+        r.cpi = atof(cpi);
+        r.nsamples = 0;
+        for (char* tok = strtok_r(samples, ",", &save); tok && r.nsamples < PERF_MAX_SAMPLES;
+             tok = strtok_r(NULL, ",", &save))
+            r.mcps[r.nsamples++] = atof(tok);
+        if (r.nsamples >= 2) {
+            *out = r;
+            found = true;
+        }
+    }
+    free(line);
+    fclose(f);
+    return found;
+}
+
+/**
+ * @brief Measure simulator throughput per kernel, log it and compare with a baseline
+ * @param threshold_pct Slowdown (percent of baseline mean) that counts as a regression
+ * @return 0 if no kernel regressed significantly, 1 otherwise
+ */
+int run_perf(const SimConfig* cfg, char** files, int nfiles, int repeat, int samples,
+             const char* log_path, const char* baseline_path, double threshold_pct) {
+    char config[512], rev[64];
+    config_format(config, sizeof(config), cfg);
+    source_revision(rev, sizeof(rev));
+    if (samples < 2) samples = 2;
+    if (samples > PERF_MAX_SAMPLES) samples = PERF_MAX_SAMPLES;
+
+    FILE* log = fopen(log_path, "a");
+    if (!log) {
+        fprintf(stderr, "Could not open %s.\n", log_path);
+        return 1;
+    }
+    if (ftell(log) == 0)
+        fprintf(log, "# time\trevision\tconfig\tkernel\tcycles\tcpi\tMcycles/s samples\n");
+
+    CPU* image = cpu_new();
+    CPU* cpu = cpu_new();
+    long now = (long)time(NULL);
+    int regressions = 0;
+
+    printf("Revision %s, %d samples x %d runs per kernel, threshold %.1f%%\n", rev, samples, repeat, threshold_pct);
+    printf("%-18s %7s %6s %10s %10s %8s %8s  %s\n",
+           "kernel", "cycles", "CPI", "base Mc/s", "now Mc/s", "change", "p", "verdict");
+
+    for (int k = 0; k < nfiles; ++k) {
+        cpu_reset(image);
+        image->cfg = *cfg;
+        if (program_load(image, files[k]) != 0) {
+            printf("%-18s could not open\n", path_basename(files[k]));
+            regressions++;
+            continue;
+        }
+
+        PerfRecord now_rec;
+        snprintf(now_rec.kernel, sizeof(now_rec.kernel), "%s", path_basename(files[k]));
+        bench_time(cpu, image, repeat, false);   // warm-up
+        for (int i = 0; i < samples; ++i) {
+            double elapsed = bench_time(cpu, image, repeat, false);
+            now_rec.mcps[i] = elapsed > 0 ? cpu->stats.cycles * (double)repeat / elapsed / 1e6 : 0.0;
+        }
+        now_rec.nsamples = samples;
+        now_rec.cycles = cpu->stats.cycles;
+        now_rec.cpi = cpu->stats.retired ? (double)cpu->stats.cycles / cpu->stats.retired : 0.0;
+
+        fprintf(log, "%ld\t%s\t%s\t%s\t%lld\t%.6f\t", now, rev, config, now_rec.kernel, now_rec.cycles, now_rec.cpi);
+        for (int i = 0; i < samples; ++i) fprintf(log, "%s%.4f", i ? "," : "", now_rec.mcps[i]);
+        fprintf(log, "\n");
+
+        double m_now, v_now;
+        mean_var(now_rec.mcps, samples, &m_now, &v_now);
+        PerfRecord base;
+        if (!baseline_path || !perf_find_baseline(baseline_path, config, now_rec.kernel, &base)) {
+            printf("%-18s %7lld %6.3f %10s %10.2f %8s %8s  %s\n",
+                   now_rec.kernel, now_rec.cycles, now_rec.cpi, "-", m_now, "-", "-", "no baseline");
+            continue;
+        }
+
+        double m_base, v_base;
+        mean_var(base.mcps, base.nsamples, &m_base, &v_base);
+        double change = m_base > 0 ? 100.0 * (m_now - m_base) / m_base : 0.0;
+        double p = welch_p_lower(now_rec.mcps, samples, base.mcps, base.nsamples);
+        bool regressed = -change > threshold_pct && p < 0.05;
+        regressions += regressed;
+        printf("%-18s %7lld %6.3f %10.2f %10.2f %+7.1f%% %8.4f  %s%s\n",
+               now_rec.kernel, now_rec.cycles, now_rec.cpi, m_base, m_now, change, p,
+               regressed ? "REGRESSED" : "ok",
+               base.cycles != now_rec.cycles ? " (simulated cycles changed)" : "");
+    }
+
+    fclose(log);
+    cpu_free(cpu);
+    cpu_free(image);
+    printf("Results appended to %s\n", log_path);
+    return regressions ? 1 : 0;
+}
+
+// ---------- Random program generator ----------
+#define GEN_MAX_LIVE 256   // values a register-pressure program may keep live
+#define GEN_GUARD_BYTES 64 // guard region placed right after the data words (fault_pct)
+#define GEN_HANDLER_LEN 6
+
+typedef struct {
+    int length;       // instructions per program
+    int hazard_pct;   // chance (0-100) that an operand reuses one of the last two destinations
+    int mem_words;    // loads and stores target words [0, mem_words)
+    int live;         // values kept live at once, spilling past num_regs (0 = random register use)
+    int fault_pct;    // chance (0-100) that a LOAD/STORE faults; adds a guard region and a handler
+} GenParams;
+
+static int rng_range(uint64_t* rng, int lo, int hi) {
+    return lo + (int)(rng_next(rng) % (uint64_t)(hi - lo + 1));
+}
+
+/**
+ * @brief Append one instruction to a program being generated, tracking its effect
+ * @return false once the program is full
+ */
+static bool gen_emit(CPU* cpu, int* R, int* mem, char* text) {
+    if (cpu->inst_count >= MAX_INST) return false;
+    Instruction ins = parse_line(text, cpu->source[cpu->inst_count]);
+    assert(ins.valid);
+    interp_step(R, mem, &ins, cpu);
+    ins.idx = cpu->inst_count;
+    cpu->program[cpu->inst_count++] = ins;
+    return true;
+}
+
+/**
+ * @brief Register-pressure program: arithmetic on gp->live values, spilled past num_regs
+ *
+ * gp->length arithmetic instructions are generated, and which values each one combines
+ * depends only on the seed and gp->live, so the same computation can be generated for
+ * different register counts; spill code comes on top (up to MAX_INST in total). Values that do not
+ * fit in registers live in the words after the data area. An operand that is not in a
+ * register is reloaded (LOAD) into the least recently used register. If that register
+ * holds a value changed since it was last stored, the value is spilled (STORE) first.
+ * @return Spill and reload instructions generated
+ */
+static int gen_pressure_program(CPU* cpu, uint64_t seed, const GenParams* gp, int* R, int* mem) {
+    uint64_t rng = seed;
+    int nregs = cpu->cfg.num_regs;
+    int reg_of[MEM_SIZE_WORDS], value_in[MAX_REGS];
+    long long last_use[MAX_REGS] = { 0 };
+    bool dirty[MEM_SIZE_WORDS] = { false };
+    long long tick = 0;
+    int spills = 0, last_dest = -1;
+    char text[LINE_LEN];
+
+    for (int r = 0; r < nregs; ++r) value_in[r] = -1;
+    for (int v = 0; v < gp->live; ++v) {
+        int value = rng_range(&rng, -100, 100);
+        reg_of[v] = v < nregs ? v : -1;
+        if (v < nregs) {
+            value_in[v] = v;
+            cpu->R[v] = R[v] = value;
+        } else {
+            cpu->memory[gp->mem_words + v] = mem[gp->mem_words + v] = value;
+        }
+    }
+
+    for (int n = 0; n < gp->length; ++n) {
+        static const char* const alu[] = { "ADD", "SUB", "MUL" };
+        const char* op = alu[rng_range(&rng, 0, 2)];
+        int v[3];   // sources, destination
+        v[0] = last_dest >= 0 && rng_range(&rng, 0, 99) < gp->hazard_pct ? last_dest : rng_range(&rng, 0, gp->live - 1);
+        v[1] = rng_range(&rng, 0, gp->live - 1);
+        v[2] = rng_range(&rng, 0, gp->live - 1);
+
+        // Give each value a register; sources are reloaded, the destination is just claimed
+        // (it may take a source's register, since the sources are read first).
+        int reg[3];
+        for (int k = 0; k < 3; ++k) {
+            if (reg_of[v[k]] >= 0) {
+                reg[k] = reg_of[v[k]];
+                last_use[reg[k]] = ++tick;
+                continue;
+            }
+            int victim = -1;
+            for (int r = 0; r < nregs; ++r)
+                if (!(k == 1 && r == reg[0]) && (victim < 0 || last_use[r] < last_use[victim])) victim = r;
+            int old = value_in[victim];
+            if (old >= 0) {
+                if (dirty[old]) {
+                    int offset = (int)((unsigned)((gp->mem_words + old) * WORD_SIZE_BYTES) - (unsigned)R[victim]);
+                    snprintf(text, sizeof(text), "STORE R%d, %d(R%d)", victim, offset, victim);
+                    if (!gen_emit(cpu, R, mem, text)) return spills;
+                    spills++;
+                    dirty[old] = false;
+                }
+                reg_of[old] = -1;
+            }
+            if (k < 2) {
+                int offset = (int)((unsigned)((gp->mem_words + v[k]) * WORD_SIZE_BYTES) - (unsigned)R[victim]);
+                snprintf(text, sizeof(text), "LOAD R%d, %d(R%d)", victim, offset, victim);
+                if (!gen_emit(cpu, R, mem, text)) return spills;
+                spills++;
+            }
+            reg[k] = reg_of[v[k]] = victim;
+            value_in[victim] = v[k];
+            last_use[victim] = ++tick;
+        }
+
+        snprintf(text, sizeof(text), "%s R%d, R%d, R%d", op, reg[2], reg[0], reg[1]);
+        if (!gen_emit(cpu, R, mem, text)) return spills;
+        dirty[v[2]] = true;
+        last_dest = v[2];
+    }
+    return spills;
+}
+
+/**
+ * @brief Guard region and exception handler for a program with faulting accesses
+ *
+ * The handler counts exceptions in the word after the guard region and returns. It
+ * uses registers of the main program, so it also perturbs the state around each fault.
+ * @param handler, text Receive the handler's instructions and their source lines
+ * @return Handler length, or 0 if the image has no room for it
+ */
+static int gen_handler(CPU* cpu, const GenParams* gp, uint64_t* rng, Instruction* handler, SourceLine* text) {
+    int lo = gp->mem_words * WORD_SIZE_BYTES;
+    int counter = lo + GEN_GUARD_BYTES;
+    int nregs = cpu->cfg.num_regs;
+    if (nregs < 3 || counter >= MEM_BYTES) return 0;
+    cpu->guard[0].lo = lo;
+    cpu->guard[0].hi = lo + GEN_GUARD_BYTES;
+    cpu->nguards = 1;
+
+    int a = rng_range(rng, 0, nregs - 1);
+    int b = (a + rng_range(rng, 1, nregs - 1)) % nregs;
+    int c = a;
+    while (c == a || c == b) c = rng_range(rng, 0, nregs - 1);
+    snprintf(text[0], LINE_LEN, "MOV R%d, %d", a, counter);
+    snprintf(text[1], LINE_LEN, "LOAD R%d, 0(R%d)", b, a);
+    snprintf(text[2], LINE_LEN, "MOV R%d, 1", c);
+    snprintf(text[3], LINE_LEN, "ADD R%d, R%d, R%d", b, b, c);
+    snprintf(text[4], LINE_LEN, "STORE R%d, 0(R%d)", b, a);
+    snprintf(text[5], LINE_LEN, "RFE");
+    for (int i = 0; i < GEN_HANDLER_LEN; ++i) {
+        handler[i] = parse_line(text[i], text[i]);
+        assert(handler[i].valid);
+    }
+    return GEN_HANDLER_LEN;
+}
+
+/**
+ * @brief Fill a reset CPU with a random valid program and initial image
+ * Addresses are chosen by tracking the architectural state while generating,
+ * so every LOAD/STORE is in range and word aligned, except the ones fault_pct
+ * sends to the guard region or past the end of memory. Registers are drawn from
+ * cpu->cfg.num_regs.
+ * @return Spill and reload instructions (register-pressure mode), otherwise 0
+ */
+int gen_random_program(CPU* cpu, uint64_t seed, const GenParams* gp) {
+    uint64_t rng = seed;
+    // Faults draw from their own stream, so fault_pct=0 leaves every program unchanged.
+    uint64_t xrng = seed ^ 0x94D049BB133111EBull;
+    Instruction handler[GEN_HANDLER_LEN];
+    SourceLine handler_text[GEN_HANDLER_LEN];
+    int R[MAX_REGS] = { 0 };
+    int* mem = calloc(MEM_SIZE_WORDS, sizeof(int));
+    int recent[2] = { REG_UNUSED, REG_UNUSED };
+    int nregs = cpu->cfg.num_regs;
+
+    cpu->inst_count = 0;
+    if (gp->live > 0) {
+        int spills = gen_pressure_program(cpu, seed, gp, R, mem);
+        free(mem);
+        return spills;
+    }
+    int nhandler = gp->fault_pct > 0 ? gen_handler(cpu, gp, &xrng, handler, handler_text) : 0;
+
+    for (int r = 0; r < nregs; ++r) cpu->R[r] = R[r] = rng_range(&rng, -100, 100);
+    for (int w = 0; w < gp->mem_words; ++w) cpu->memory[w] = mem[w] = rng_range(&rng, -1000, 1000);
+
+    const Instruction* prev = NULL;
+    bool faulted = false; // prev faulted: the handler may have changed its base register
+    while (cpu->inst_count < gp->length && cpu->inst_count < MAX_INST - nhandler) {
+        int pick = rng_range(&rng, 0, 99);
+        int src[2];
+        for (int k = 0; k < 2; ++k) {
+            int recent_reg = recent[rng_range(&rng, 0, 1)];
+            src[k] = (recent_reg != REG_UNUSED && rng_range(&rng, 0, 99) < gp->hazard_pct)
+                   ? recent_reg : rng_range(&rng, 0, nregs - 1);
+        }
+        int rd = rng_range(&rng, 0, nregs - 1);
+        char text[LINE_LEN];
+
+        if (prev && prev->op == OP_STORE && !faulted && rng_range(&rng, 0, 99) < gp->hazard_pct) {
+            // Reload what was just stored: same base and offset (STORE→LOAD hazard)
+            snprintf(text, sizeof(text), "LOAD R%d, %d(R%d)", rd, prev->imm, prev->rs2);
+        } else if (pick < 15) {
+            int imm = rng_range(&rng, 0, 3) == 0 ? 0 : rng_range(&rng, -1000, 1000);
+            snprintf(text, sizeof(text), "MOV R%d, %d", rd, imm);
+        } else if (pick < 60) {
+            static const char* const alu[] = { "ADD", "SUB", "MUL" };
+            snprintf(text, sizeof(text), "%s R%d, R%d, R%d", alu[rng_range(&rng, 0, 2)], rd, src[0], src[1]);
+        } else {
+            int base = src[0];
+            int target = rng_range(&rng, 0, gp->mem_words - 1) * WORD_SIZE_BYTES;
+            if (nhandler && rng_range(&xrng, 0, 99) < gp->fault_pct)
+                target = rng_range(&xrng, 0, 3)
+                       ? cpu->guard[0].lo + rng_range(&xrng, 0, GEN_GUARD_BYTES / WORD_SIZE_BYTES - 1) * WORD_SIZE_BYTES
+                       : MEM_BYTES + rng_range(&xrng, 0, 15) * WORD_SIZE_BYTES;
+            int offset = (int)((unsigned)target - (unsigned)R[base]);
+            if (pick < 80)
+                snprintf(text, sizeof(text), "LOAD R%d, %d(R%d)", rd, offset, base);
+            else
+                snprintf(text, sizeof(text), "STORE R%d, %d(R%d)", src[1], offset, base);
+        }
+
+        Instruction ins = parse_line(text, cpu->source[cpu->inst_count]);
+        assert(ins.valid);
+        faulted = !interp_step(R, mem, &ins, cpu);
+        if (faulted)
+            for (int h = 0; h < nhandler - 1; ++h) interp_step(R, mem, &handler[h], cpu);
+        ins.idx = cpu->inst_count;
+        cpu->program[cpu->inst_count] = ins;
+        prev = &cpu->program[cpu->inst_count++];
+        if (ins.rd != REG_UNUSED) {
+            recent[1] = recent[0];
+            recent[0] = ins.rd;
+        }
+    }
+    if (nhandler) {
+        cpu->handler = cpu->inst_count;
+        for (int h = 0; h < nhandler; ++h) {
+            handler[h].idx = cpu->inst_count;
+            memcpy(cpu->source[cpu->inst_count], handler_text[h], sizeof(SourceLine));
+            cpu->program[cpu->inst_count++] = handler[h];
+        }
+    }
+    free(mem);
+    return 0;
+}
+
+/**
+ * @brief Write a CPU image as a program file (.reg/.data/.guard, instructions and
+ *        handler, optional .expect)
+ * @param final_R, final_mem Expected final state to record (NULL to omit)
+ */
+void program_write_image(FILE* out, const CPU* cpu, const int* final_R, const int* final_mem) {
+    for (int g = 0; g < cpu->nguards; ++g)
+        fprintf(out, ".guard %d, %d\n", cpu->guard[g].lo, cpu->guard[g].hi - cpu->guard[g].lo);
+    for (int r = 0; r < cpu->cfg.num_regs; ++r)
+        if (cpu->R[r]) fprintf(out, ".reg R%d, %d\n", r, cpu->R[r]);
+    for (int w = 0; w < MEM_SIZE_WORDS; ++w)
+        if (cpu->memory[w]) fprintf(out, ".data %d, %d\n", w * WORD_SIZE_BYTES, cpu->memory[w]);
+    fprintf(out, "\n");
+    for (int i = 0; i < cpu->inst_count; ++i) {
+        if (i == cpu->handler) fprintf(out, ".handler\n");
+        fprintf(out, "%s\n", cpu->source[i]);
+    }
+    if (!final_R) return;
+    fprintf(out, "\n");
+    for (int r = 0; r < cpu->cfg.num_regs; ++r) fprintf(out, ".expect R%d, %d\n", r, final_R[r]);
+    for (int w = 0; w < MEM_SIZE_WORDS; ++w)
+        if (final_mem[w] || cpu->memory[w]) fprintf(out, ".expect_mem %d, %d\n", w * WORD_SIZE_BYTES, final_mem[w]);
+}
+
+// ---------- Differential fuzzing ----------
+typedef struct {
+    GenParams gen;
+    SimConfig base;
+    bool vary_config;          // draw timing parameters per program
+    uint64_t seed;
+    long long programs;
+    atomic_llong next;         // next program index to claim
+    atomic_llong done;
+    atomic_llong instructions;
+    atomic_bool failed;
+    pthread_mutex_t report_lock;
+    RunLog* log;
+} FuzzWork;
+
+#define FUZZ_CHUNK 64
+
+/**
+ * @brief Random timing parameters; architectural results must not depend on them
+ */
+void fuzz_vary_config(SimConfig* c, uint64_t* rng) {
+    static const int cache_sizes[] = { 0, 16, 64, 256 };
+    c->forwarding = rng_range(rng, FWD_NONE, FWD_FULL);
+    c->mul_latency = rng_range(rng, 1, 4);
+    c->mem_latency = rng_range(rng, 0, 3);
+    c->cache_line_bytes = 16;
+    c->cache_assoc = rng_range(rng, 0, 1) ? 1 : 2;
+    c->cache_bytes = cache_sizes[rng_range(rng, 0, 3)];
+    c->fusion = rng_range(rng, 0, FUSE_ALL);
+    c->move_elim = rng_range(rng, 0, 1);
+    c->lvp = rng_range(rng, LVP_OFF, LVP_STRIDE);
+    c->lvp_entries = 1 << rng_range(rng, 0, 6);
+    c->vm = rng_range(rng, 0, 1);
+    c->page_bytes = 16 << rng_range(rng, 0, 3);
+    c->huge_pages = rng_range(rng, 0, 1);
+    c->tlb_entries = 1 << rng_range(rng, 0, 3);
+    c->tlb2_entries = rng_range(rng, 0, 1) ? 0 : 32;
+    c->walk_latency = rng_range(rng, 0, 3);
+    c->num_regs = rng_range(rng, 0, 1) ? 16 : MAX_REGS;
+    c->rf_read_ports = rng_range(rng, 0, 2);
+    c->rf_write_ports = rng_range(rng, 0, 2);
+    if (config_validate(c)) c->cache_bytes = 0;
+}
+
+static void runlog_fuzz(RunLog* log, long long index, uint64_t seed, const GenParams* gp, const CPU* done) {
+    if (!log) return;
+    char config[512];
+    config_format(config, sizeof(config), &done->cfg);
+    pthread_mutex_lock(&log->lock);
+    fprintf(log->f, "fuzz\t%lld\t%llu\t%d\t%d\t%d\t%d\t%s\t%lld\t%016llx\n", index, (unsigned long long)seed,
+            gp->length, gp->hazard_pct, gp->mem_words, gp->fault_pct, config, done->stats.cycles,
+            (unsigned long long)cpu_state_digest(done));
+    pthread_mutex_unlock(&log->lock);
+}
+
+/**
+ * @param timed Packed timing model run that disagrees with the pipeline's timing (NULL = none)
+ */
+static void fuzz_report(FuzzWork* w, long long index, uint64_t seed, const CPU* image,
+                        const CPU* cpu, const int* R, const int* mem, const CPU* timed) {
+    pthread_mutex_lock(&w->report_lock);
+    if (!atomic_exchange(&w->failed, true)) {
+        // Which worker gets here first depends on scheduling, so log the winner.
+        runlog_fuzz(w->log, index, seed, &w->gen, cpu);
+        char path[64];
+        snprintf(path, sizeof(path), "fuzz_fail_%llu.txt", (unsigned long long)seed);
+        printf("MISMATCH in program #%lld (seed %llu) under ", index, (unsigned long long)seed);
+        config_print(stdout, &cpu->cfg);
+        printf("\n");
+        for (int r = 0; r < cpu->cfg.num_regs; ++r)
+            if (cpu->R[r] != R[r]) printf("  R%d: pipeline %d, reference %d\n", r, cpu->R[r], R[r]);
+        for (int m = 0; m < MEM_SIZE_WORDS; ++m)
+            if (cpu->memory[m] != mem[m]) printf("  Memory[%d]: pipeline %d, reference %d\n", m, cpu->memory[m], mem[m]);
+        if (timed) {
+            printf("  cycles: pipeline %lld, timing model %lld\n", cpu->stats.cycles, timed->stats.cycles);
+            for (int c = STALL_NONE + 1; c < STALL_COUNT; ++c)
+                if (cpu->stats.stall[c] != timed->stats.stall[c])
+                    printf("  %s stalls: pipeline %lld, timing model %lld\n", STALL_NAMES[c],
+                           cpu->stats.stall[c], timed->stats.stall[c]);
+        }
+        FILE* f = fopen(path, "w");
+        if (f) {
+            fprintf(f, "# fuzz failure: seed %llu, ", (unsigned long long)seed);
+            config_print(f, &cpu->cfg);
+            fprintf(f, "\n");
+            program_write_image(f, image, R, mem);
+            fclose(f);
+            printf("  reproducer written to %s\n", path);
+        }
+    }
+    pthread_mutex_unlock(&w->report_lock);
+}
+
+static void* fuzz_worker(void* arg) {
+    FuzzWork* w = arg;
+    CPU* image = cpu_new();
+    CPU* cpu = cpu_new();
+    CPU* timed = cpu_new();
+    int R[MAX_REGS];
+    int* mem = malloc(sizeof(int) * MEM_SIZE_WORDS);
+
+    while (!atomic_load(&w->failed)) {
+        long long first = atomic_fetch_add(&w->next, FUZZ_CHUNK);
+        if (first >= w->programs) break;
+        long long last = first + FUZZ_CHUNK < w->programs ? first + FUZZ_CHUNK : w->programs;
+        long long insts = 0;
+        long long i = first;
+        for (; i < last && !atomic_load(&w->failed); ++i) {
+            uint64_t seed = w->seed + (uint64_t)i * 0x9E3779B97F4A7C15ull;
+            uint64_t rng = seed ^ 0xD1B54A32D192ED03ull;
+            cpu_reset(image);
+            image->cfg = w->base;
+            if (w->vary_config) fuzz_vary_config(&image->cfg, &rng);
+            gen_random_program(image, seed, &w->gen);
+
+            vm_write_page_table(&image->cfg, image->memory);
+            memcpy(R, image->R, sizeof(R));
+            memcpy(mem, image->memory, sizeof(int) * MEM_SIZE_WORDS);
+            long long completed = interp_run(R, mem, image);
+
+            cpu_copy(cpu, image);
+            sim_start(cpu);
+            sim_run(cpu);
+            insts += image->inst_count;
+
+            // Where the packed timing model applies, it must count the same cycles.
+            bool timing_ok = true;
+            if (timing_supported(image)) {
+                cpu_copy(timed, image);
+                if (timing_run(timed))
+                    timing_ok = timed->stats.cycles == cpu->stats.cycles &&
+                                memcmp(timed->stats.stall, cpu->stats.stall, sizeof(cpu->stats.stall)) == 0;
+            }
+
+            if (memcmp(cpu->R, R, sizeof(R)) != 0 ||
+                memcmp(cpu->memory, mem, sizeof(int) * MEM_SIZE_WORDS) != 0 ||
+                cpu->stats.retired != completed || !timing_ok)
+                fuzz_report(w, i, seed, image, cpu, R, mem, timing_ok ? NULL : timed);
+        }
+        if (i < last && w->log) {
+            // How far each stopped chunk got depends on scheduling, so log it.
+            char note[96];
+            snprintf(note, sizeof(note), "fuzz chunk %lld-%lld stopped after %lld program(s)", first, last - 1, i - first);
+            runlog_note(w->log, note);
+        }
+        atomic_fetch_add(&w->done, i - first);
+        atomic_fetch_add(&w->instructions, insts);
+    }
+    free(mem);
+    cpu_free(timed);
+    cpu_free(cpu);
+    cpu_free(image);
+    return NULL;
+}
+
+/**
+ * @brief Run random programs through the pipeline and the reference model on all cores
+ * @return 0 if every final state matched, 1 on the first mismatch
+ */
+int run_fuzz(const SimConfig* base, long long programs, uint64_t seed, const GenParams* gp,
+             bool vary_config, int threads, RunLog* log) {
+    FuzzWork* w = calloc(1, sizeof(FuzzWork));
+    w->log = log;
+    w->gen = *gp;
+    w->base = *base;
+    w->vary_config = vary_config;
+    w->seed = seed;
+    w->programs = programs;
+    pthread_mutex_init(&w->report_lock, NULL);
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+
+    printf("Fuzzing %lld programs (length %d, hazard %d%%, %d memory words) on %d thread(s), seed %llu%s\n",
+           programs, gp->length, gp->hazard_pct, gp->mem_words, threads, (unsigned long long)seed,
+           vary_config ? ", random timing parameters" : "");
+    double t0 = host_seconds();
+    pthread_t* tids = malloc(sizeof(pthread_t) * threads);
+    for (int t = 0; t < threads; ++t) pthread_create(&tids[t], NULL, fuzz_worker, w);
+    for (int t = 0; t < threads; ++t) pthread_join(tids[t], NULL);
+    free(tids);
+    double elapsed = host_seconds() - t0;
+
+    long long done = atomic_load(&w->done);
+    printf("%lld programs, %lld instructions in %.2f s: %.0f programs/s (%.1fM per hour)\n",
+           done, (long long)atomic_load(&w->instructions), elapsed,
+           elapsed > 0 ? done / elapsed : 0.0, elapsed > 0 ? done / elapsed * 3600 / 1e6 : 0.0);
+    bool failed = atomic_load(&w->failed);
+    if (!failed) printf("All final states match the reference model\n");
+    char note[96];
+    snprintf(note, sizeof(note), "fuzz finished %lld of %lld programs", done, programs);
+    runlog_note(log, note);
+    pthread_mutex_destroy(&w->report_lock);
+    free(w);
+    return failed ? 1 : 0;
+}
+
+// ---------- Block compression ----------
+// A small LZ4-style compressor for the simulator's own files. A block is a series of
+// sequences: a token (literal count in the high nibble, match length - 4 in the low
+// one, 15 meaning "more length bytes follow"), the literals, then a 16-bit offset back
+// into the output. The last sequence has literals only. Blocks are independent, so a
+// reader can start at any block.
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 13
+#define LZ_MFLIMIT 12                  // no match starts in the last 12 bytes
+#define LZ_LAST_LITERALS 5             // ... or covers the last 5
+#define LZ_MAX_OFFSET 65535
+
+/** @brief Worst-case compressed size of n bytes */
+static size_t lz_bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+static uint32_t lz_read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint8_t* lz_put_length(uint8_t* op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/** @brief Emit nlit literals followed by a match (mlen 0: literals only) */
+static uint8_t* lz_sequence(uint8_t* op, const uint8_t* lit, size_t nlit, size_t offset, size_t mlen) {
+    uint8_t* token = op++;
+    *token = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15) op = lz_put_length(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen) {
+        size_t ml = mlen - LZ_MIN_MATCH;
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        *token |= (uint8_t)(ml < 15 ? ml : 15);
+        if (ml >= 15) op = lz_put_length(op, ml - 15);
+    }
+    return op;
+}
+
+/**
+ * @brief Compress one block
+ * @param dst At least lz_bound(n) bytes
+ * @return Compressed size
+ */
+size_t lz_compress(const uint8_t* src, size_t n, uint8_t* dst) {
+    int32_t table[1 << LZ_HASH_BITS];
+    for (int i = 0; i < (1 << LZ_HASH_BITS); ++i) table[i] = -1;
+    uint8_t* op = dst;
+    size_t anchor = 0, ip = 0;
+    while (n > LZ_MFLIMIT && ip < n - LZ_MFLIMIT) {
+        uint32_t seq = lz_read32(src + ip);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int32_t ref = table[h];
+        table[h] = (int32_t)ip;
+        if (ref < 0 || ip - (size_t)ref > LZ_MAX_OFFSET || lz_read32(src + ref) != seq) {
+            ip++;
+            continue;
+        }
+        size_t mlen = LZ_MIN_MATCH;
+        while (ip + mlen < n - LZ_LAST_LITERALS && src[ref + mlen] == src[ip + mlen]) mlen++;
+        op = lz_sequence(op, src + anchor, ip - anchor, ip - (size_t)ref, mlen);
+        ip += mlen;
+        anchor = ip;
+    }
+    op = lz_sequence(op, src + anchor, n - anchor, 0, 0);
+    return (size_t)(op - dst);
+}
+
+/**
+ * @brief Decompress one block
+ * @return Decompressed size, or -1 if the block is corrupt or larger than cap
+ */
+long lz_decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap) {
+    const uint8_t* ip = src;
+    const uint8_t* end = src + n;
+    size_t op = 0;
+    while (ip < end) {
+        unsigned token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15) {
+            unsigned b;
+            do {
+                if (ip >= end) return -1;
+                b = *ip++;
+                nlit += b;
+            } while (b == 255);
+        }
+        if ((size_t)(end - ip) < nlit || cap - op < nlit) return -1;
+        memcpy(dst + op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == end) break;
+        if (end - ip < 2) return -1;
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            unsigned b;
+            do {
+                if (ip >= end) return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || cap - op < mlen) return -1;
+        if (offset >= mlen) {
+            memcpy(dst + op, dst + op - offset, mlen);
+            op += mlen;
+        } else {
+            for (size_t i = 0; i < mlen; ++i, ++op) dst[op] = dst[op - offset];
+        }
+    }
+    return (long)op;
+}
+
+// A compressed byte stream: blocks of up to ZFILE_BLOCK input bytes, each stored as
+// [input size][stored size][data]. A block that does not shrink is stored as is
+// (stored size == input size). With z false a ZFile is plain stdio.
+#define ZFILE_BLOCK (1 << 16)
+
+typedef struct {
+    FILE* f;
+    bool z;
+    uint8_t* raw;                      // current block (ZFILE_BLOCK bytes)
+    size_t len, pos;                   // bytes in raw; read position
+    uint8_t* zbuf;                     // lz_bound(ZFILE_BLOCK) bytes
+    bool error;                        // a write failed (either mode); zf_finish reports it
+} ZFile;
+
+void zf_init(ZFile* z, FILE* f, bool compressed) {
+    memset(z, 0, sizeof(*z));
+    z->f = f;
+    z->z = compressed;
+    if (compressed) {
+        z->raw = malloc(ZFILE_BLOCK);
+        z->zbuf = malloc(lz_bound(ZFILE_BLOCK));
+        z->error = !z->raw || !z->zbuf;
+    }
+}
+
+static void zf_flush_block(ZFile* z) {
+    if (z->len == 0 || z->error) return;
+    size_t clen = lz_compress(z->raw, z->len, z->zbuf);
+    const uint8_t* data = clen < z->len ? z->zbuf : z->raw;
+    uint32_t hdr[2] = { (uint32_t)z->len, (uint32_t)(clen < z->len ? clen : z->len) };
+    if (fwrite(hdr, sizeof(hdr), 1, z->f) != 1 || fwrite(data, 1, hdr[1], z->f) != hdr[1])
+        z->error = true;
+    z->len = 0;
+}
+
+/** @return false on a write error */
+bool zf_write(ZFile* z, const void* data, size_t size) {
+    if (!z->z) {
+        if (!z->error && fwrite(data, 1, size, z->f) != size) z->error = true;
+        return !z->error;
+    }
+    const uint8_t* p = data;
+    while (size > 0 && !z->error) {
+        size_t n = ZFILE_BLOCK - z->len < size ? ZFILE_BLOCK - z->len : size;
+        memcpy(z->raw + z->len, p, n);
+        z->len += n;
+        p += n;
+        size -= n;
+        if (z->len == ZFILE_BLOCK) zf_flush_block(z);
+    }
+    return !z->error;
+}
+
+/** @return Bytes read; short at the end of the stream or on a corrupt block */
+size_t zf_read(ZFile* z, void* data, size_t size) {
+    if (!z->z) return fread(data, 1, size, z->f);
+    uint8_t* p = data;
+    size_t done = 0;
+    while (done < size && !z->error) {
+        if (z->pos == z->len) {
+            uint32_t hdr[2];
+            if (fread(hdr, sizeof(hdr), 1, z->f) != 1) break;
+            bool ok = hdr[0] <= ZFILE_BLOCK && hdr[1] <= hdr[0] && fread(z->zbuf, 1, hdr[1], z->f) == hdr[1];
+            if (ok && hdr[1] == hdr[0]) memcpy(z->raw, z->zbuf, hdr[0]);
+            else if (ok) ok = lz_decompress(z->zbuf, hdr[1], z->raw, ZFILE_BLOCK) == (long)hdr[0];
+            if (!ok) {
+                z->error = true;
+                break;
+            }
+            z->len = hdr[0];
+            z->pos = 0;
+        }
+        size_t n = z->len - z->pos < size - done ? z->len - z->pos : size - done;
+        memcpy(p + done, z->raw + z->pos, n);
+        z->pos += n;
+        done += n;
+    }
+    return done;
+}
+
+/** @brief Release a reader's buffers (the FILE stays open) */
+void zf_free(ZFile* z) {
+    free(z->raw);
+    free(z->zbuf);
+    z->raw = z->zbuf = NULL;
+}
+
+/**
+ * @brief Write out a writer's last block and release the buffers (the FILE stays open)
+ * @return false if any write failed
+ */
+bool zf_finish(ZFile* z) {
+    if (z->z) zf_flush_block(z);
+    zf_free(z);
+    return !z->error;
+}
+
+// ---------- Trace files ----------
+// Binary trace: a header, the program's instruction table, then one TraceRecord per
+// cycle. Records are written in host byte order; the header carries the record size
+// and register count so a mismatched reader refuses the file instead of misreading it.
+//
+// A compressed trace (TRACE_MAGIC_Z) stores the records in blocks of up to
+// TRACE_BLOCK_RECORDS. A block is delta-encoded field by field: each 32-bit word of a
+// record minus the same word of the previous record, stored word-major so that the
+// cycle increments, unchanged registers and repeated PCs form long runs. The first
+// record of a block is stored against zero, so blocks decode on their own. An index of
+// (file offset, first cycle, records) per block and a trailer pointing at it follow the
+// last block; a reader seeks to any cycle through the index.
+#define TRACE_MAGIC "PSTRACE1"
+#define TRACE_MAGIC_Z "PSTRACEZ"
+#define TRACE_INDEX_MAGIC "PSTINDEX"
+#define TRACE_VERSION 2
+#define TRACE_BLOCK_RECORDS 1024
+#define TRACE_REC_WORDS (sizeof(TraceRecord) / sizeof(uint32_t))
+_Static_assert(sizeof(TraceRecord) % sizeof(uint32_t) == 0, "trace records are delta-encoded as 32-bit words");
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t num_regs;
+    uint32_t inst_count;
+} TraceFileHeader;
+
+typedef struct {
+    int32_t op, rd, rs1, rs2, imm;
+    char text[LINE_LEN];
+} TraceInst;
+
+typedef struct {
+    int64_t offset;                    // of the block's [records][stored size] header
+    int32_t first_cycle;
+    uint32_t records;
+} TraceBlockEntry;
+
+typedef struct {
+    int64_t index_offset;
+    int64_t blocks;
+    char magic[8];
+} TraceTrailer;
+
+/**
+ * @brief Write the trace header and instruction table for the loaded program
+ * @param compressed Mark the records that follow as compressed blocks
+ * @return 0 on success, -1 on a write error
+ */
+int trace_write_header(FILE* f, const CPU* cpu, bool compressed) {
+    TraceFileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, compressed ? TRACE_MAGIC_Z : TRACE_MAGIC, sizeof(h.magic));
+    h.version = TRACE_VERSION;
+    h.record_size = sizeof(TraceRecord);
+    h.num_regs = (uint32_t)cpu->cfg.num_regs;
+    h.inst_count = (uint32_t)cpu->inst_count;
+    if (fwrite(&h, sizeof(h), 1, f) != 1) return -1;
+    for (int i = 0; i < cpu->inst_count; ++i) {
+        const Instruction* in = &cpu->program[i];
+        TraceInst ti;
+        memset(&ti, 0, sizeof(ti));
+        ti.op = in->op;
+        ti.rd = in->rd;
+        ti.rs1 = in->rs1;
+        ti.rs2 = in->rs2;
+        ti.imm = in->imm;
+        memcpy(ti.text, cpu->source[i], sizeof(ti.text));
+        if (fwrite(&ti, sizeof(ti), 1, f) != 1) return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read a trace header and instruction table
+ * @param prog, source Receive the instruction table and source lines (MAX_INST entries)
+ * @param num_regs Receives the traced machine's architectural register count
+ * @param compressed Receives whether the records are in compressed blocks
+ * @return Instruction count, or -1 if the file is not a compatible trace
+ */
+int trace_read_header(FILE* f, Instruction* prog, SourceLine* source, int* num_regs, bool* compressed) {
+    TraceFileHeader h;
+    if (fread(&h, sizeof(h), 1, f) != 1) return -1;
+    *compressed = memcmp(h.magic, TRACE_MAGIC_Z, sizeof(h.magic)) == 0;
+    if ((!*compressed && memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0) || h.version != TRACE_VERSION ||
+        h.record_size != sizeof(TraceRecord) || h.num_regs > MAX_REGS || h.inst_count > MAX_INST)
+        return -1;
+    *num_regs = (int)h.num_regs;
+    for (uint32_t i = 0; i < h.inst_count; ++i) {
+        TraceInst ti;
+        if (fread(&ti, sizeof(ti), 1, f) != 1) return -1;
+        prog[i] = make_nop();
+        prog[i].op = (OpCode)ti.op;
+        prog[i].rd = ti.rd;
+        prog[i].rs1 = ti.rs1;
+        prog[i].rs2 = ti.rs2;
+        prog[i].imm = ti.imm;
+        prog[i].valid = 1;
+        prog[i].idx = (int)i;
+        memcpy(source[i], ti.text, sizeof(ti.text));
+        source[i][LINE_LEN - 1] = '\0';
+    }
+    return (int)h.inst_count;
+}
+
+static bool trace_is_binary(FILE* f) {
+    char magic[8];
+    bool bin = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+               (memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0 || memcmp(magic, TRACE_MAGIC_Z, sizeof(magic)) == 0);
+    rewind(f);
+    return bin;
+}
+
+/** @brief Delta-encode n records into word-major order */
+static void trace_block_encode(const uint32_t* words, uint32_t n, uint32_t* out) {
+    for (size_t w = 0; w < TRACE_REC_WORDS; ++w) {
+        uint32_t prev = 0;
+        for (uint32_t r = 0; r < n; ++r) {
+            uint32_t v = words[r * TRACE_REC_WORDS + w];
+            out[w * n + r] = v - prev;
+            prev = v;
+        }
+    }
+}
+
+static void trace_block_decode(const uint32_t* in, uint32_t n, uint32_t* words) {
+    for (size_t w = 0; w < TRACE_REC_WORDS; ++w) {
+        uint32_t v = 0;
+        for (uint32_t r = 0; r < n; ++r) {
+            v += in[w * n + r];
+            words[r * TRACE_REC_WORDS + w] = v;
+        }
+    }
+}
+
+#define TRACE_BLOCK_WORDS (TRACE_BLOCK_RECORDS * TRACE_REC_WORDS)
+
+// Record sink behind --trace-out: plain records, or compressed blocks plus an index
+typedef struct {
+    FILE* f;
+    bool compressed;
+    bool error;
+    uint32_t n;                        // records in the current block
+    uint32_t* words;                   // current block, record-major
+    uint32_t* delta;                   // its encoding, word-major
+    uint8_t* zbuf;
+    TraceBlockEntry* index;
+    size_t blocks, cap;
+} TraceWriter;
+
+/** @return 0 on success, -1 if out of memory */
+int trace_writer_open(TraceWriter* w, FILE* f, bool compressed) {
+    memset(w, 0, sizeof(*w));
+    w->f = f;
+    w->compressed = compressed;
+    if (!compressed) return 0;
+    w->words = malloc(sizeof(uint32_t) * TRACE_BLOCK_WORDS);
+    w->delta = malloc(sizeof(uint32_t) * TRACE_BLOCK_WORDS);
+    w->zbuf = malloc(lz_bound(sizeof(uint32_t) * TRACE_BLOCK_WORDS));
+    return w->words && w->delta && w->zbuf ? 0 : -1;
+}
+
+static void trace_writer_block(TraceWriter* w) {
+    if (w->n == 0 || w->error) return;
+    if (w->blocks == w->cap) {
+        w->cap = w->cap ? 2 * w->cap : 64;
+        w->index = realloc(w->index, sizeof(TraceBlockEntry) * w->cap);
+    }
+    TraceBlockEntry* e = &w->index[w->blocks++];
+    e->offset = ftello(w->f);
+    memcpy(&e->first_cycle, (const char*)w->words + offsetof(TraceRecord, cycle), sizeof(e->first_cycle));
+    e->records = w->n;
+    size_t raw = sizeof(uint32_t) * TRACE_REC_WORDS * w->n;
+    trace_block_encode(w->words, w->n, w->delta);
+    size_t clen = lz_compress((const uint8_t*)w->delta, raw, w->zbuf);
+    const void* data = clen < raw ? (const void*)w->zbuf : (const void*)w->delta;
+    uint32_t hdr[2] = { w->n, (uint32_t)(clen < raw ? clen : raw) };
+    if (fwrite(hdr, sizeof(hdr), 1, w->f) != 1 || fwrite(data, 1, hdr[1], w->f) != hdr[1]) w->error = true;
+    w->n = 0;
+}
+
+void trace_writer_put(TraceWriter* w, const TraceRecord* rec) {
+    if (!w->compressed) {
+        if (fwrite(rec, sizeof(*rec), 1, w->f) != 1) w->error = true;
+        return;
+    }
+    memcpy(w->words + (size_t)w->n * TRACE_REC_WORDS, rec, sizeof(*rec));
+    if (++w->n == TRACE_BLOCK_RECORDS) trace_writer_block(w);
+}
+
+/**
+ * @brief Finish the trace (last block, index and trailer) and close the file
+ * @return 0 on success, -1 if any write failed
+ */
+int trace_writer_close(TraceWriter* w) {
+    if (w->compressed) {
+        trace_writer_block(w);
+        TraceTrailer t;
+        memset(&t, 0, sizeof(t));
+        t.index_offset = ftello(w->f);
+        t.blocks = (int64_t)w->blocks;
+        memcpy(t.magic, TRACE_INDEX_MAGIC, sizeof(t.magic));
+        if ((w->blocks && fwrite(w->index, sizeof(TraceBlockEntry), w->blocks, w->f) != w->blocks) ||
+            fwrite(&t, sizeof(t), 1, w->f) != 1)
+            w->error = true;
+    }
+    free(w->words);
+    free(w->delta);
+    free(w->zbuf);
+    free(w->index);
+    if (fclose(w->f) != 0) w->error = true;
+    return w->error ? -1 : 0;
+}
+
+static void trace_write_hook(void* ctx, const CPU* cpu, const TraceRecord* rec) {
+    (void)cpu;
+    trace_writer_put(ctx, rec);
+}
+
+// Record source for every binary trace reader; hides the plain/compressed difference
+typedef struct {
+    FILE* f;
+    bool compressed;
+    bool error;                        // corrupt or truncated file
+    bool truncated;                    // partial final record, or no block index (rebuilt by scanning)
+    off_t data_start;                  // first record (plain) or block (compressed)
+    off_t data_end;                    // plain: end of the last whole record
+    TraceBlockEntry* index;
+    int64_t blocks, next_block;
+    TraceRecord* block;                // decoded current block
+    uint32_t n, pos;
+    uint32_t* words;
+    uint32_t* delta;
+    uint8_t* zbuf;
+} TraceReader;
+
+void trace_reader_close(TraceReader* r) {
+    free(r->index);
+    free(r->block);
+    free(r->words);
+    free(r->delta);
+    free(r->zbuf);
+}
+
+static bool trace_reader_block(TraceReader* r) {
+    if (r->next_block >= r->blocks) return false;
+    const TraceBlockEntry* e = &r->index[r->next_block++];
+    uint32_t hdr[2];
+    size_t raw = 0;
+    bool ok = fseeko(r->f, (off_t)e->offset, SEEK_SET) == 0 && fread(hdr, sizeof(hdr), 1, r->f) == 1 &&
+              hdr[0] == e->records && hdr[0] >= 1 && hdr[0] <= TRACE_BLOCK_RECORDS;
+    if (ok) {
+        raw = sizeof(uint32_t) * TRACE_REC_WORDS * hdr[0];
+        ok = hdr[1] <= raw && fread(r->zbuf, 1, hdr[1], r->f) == hdr[1];
+    }
+    if (ok && hdr[1] == raw) memcpy(r->delta, r->zbuf, raw);
+    else if (ok) ok = lz_decompress(r->zbuf, hdr[1], (uint8_t*)r->delta, raw) == (long)raw;
+    if (!ok) {
+        r->error = true;
+        return false;
+    }
+    trace_block_decode(r->delta, hdr[0], r->words);
+    memcpy(r->block, r->words, raw);
+    r->n = hdr[0];
+    r->pos = 0;
+    return true;
+}
+
+/**
+ * @brief Rebuild the block index of a compressed trace whose index was never written
+ * Each block starts with its record count and stored size, so the blocks are walked in
+ * file order up to the first one that is cut off, does not decode or goes back in time.
+ * @return false if out of memory
+ */
+static bool trace_reader_scan(TraceReader* r) {
+    free(r->index);
+    r->index = NULL;
+    r->blocks = 0;
+    r->truncated = true;
+    int64_t cap = 0;
+    int last_cycle = 0;
+    off_t at = r->data_start;
+    for (;;) {
+        uint32_t hdr[2];
+        if (fseeko(r->f, at, SEEK_SET) != 0 || fread(hdr, sizeof(hdr), 1, r->f) != 1) break;
+        if (r->blocks == cap) {
+            cap = cap ? 2 * cap : 64;
+            TraceBlockEntry* grown = realloc(r->index, sizeof(TraceBlockEntry) * (size_t)cap);
+            if (!grown) return false;
+            r->index = grown;
+        }
+        TraceBlockEntry* e = &r->index[r->blocks];
+        e->offset = (int64_t)at;
+        e->records = hdr[0];
+        r->next_block = r->blocks++;
+        if (!trace_reader_block(r) || r->block[0].cycle <= last_cycle) {
+            r->blocks--;
+            break;
+        }
+        e->first_cycle = r->block[0].cycle;
+        last_cycle = r->block[r->n - 1].cycle;
+        at += (off_t)sizeof(hdr) + hdr[1];
+    }
+    r->error = false;
+    r->next_block = 0;
+    r->n = r->pos = 0;
+    return true;
+}
+
+/**
+ * @brief Read the header and, for a compressed trace, the block index
+ * A compressed trace without a readable index (its writer never finished) has the index
+ * rebuilt from the blocks and is marked truncated.
+ * @return Instruction count (prog and num_regs filled in), or -1 if not a compatible trace
+ */
+int trace_reader_open(TraceReader* r, FILE* f, Instruction* prog, SourceLine* source, int* num_regs) {
+    memset(r, 0, sizeof(*r));
+    r->f = f;
+    int inst_count = trace_read_header(f, prog, source, num_regs, &r->compressed);
+    if (inst_count < 0 || !r->compressed) {
+        r->data_start = ftello(f);
+        if (inst_count < 0 || fseeko(f, 0, SEEK_END) != 0) return inst_count;
+        off_t payload = ftello(f) - r->data_start;
+        r->truncated = payload % (off_t)sizeof(TraceRecord) != 0;
+        r->data_end = r->data_start + payload - payload % (off_t)sizeof(TraceRecord);
+        return fseeko(f, r->data_start, SEEK_SET) == 0 ? inst_count : -1;
+    }
+    r->data_start = ftello(f);
+    r->block = malloc(sizeof(TraceRecord) * TRACE_BLOCK_RECORDS);
+    r->words = malloc(sizeof(uint32_t) * TRACE_BLOCK_WORDS);
+    r->delta = malloc(sizeof(uint32_t) * TRACE_BLOCK_WORDS);
+    r->zbuf = malloc(lz_bound(sizeof(uint32_t) * TRACE_BLOCK_WORDS));
+    bool ok = r->block && r->words && r->delta && r->zbuf;
+    TraceTrailer t;
+    bool indexed = ok && fseeko(f, -(off_t)sizeof(t), SEEK_END) == 0 && fread(&t, sizeof(t), 1, f) == 1 &&
+                   memcmp(t.magic, TRACE_INDEX_MAGIC, sizeof(t.magic)) == 0 && t.blocks >= 0 &&
+                   t.index_offset >= r->data_start &&
+                   t.blocks <= (INT64_MAX - t.index_offset) / (int64_t)sizeof(TraceBlockEntry);
+    if (indexed) {
+        r->blocks = t.blocks;
+        r->index = malloc(sizeof(TraceBlockEntry) * (size_t)(t.blocks ? t.blocks : 1));
+        indexed = r->index && fseeko(f, (off_t)t.index_offset, SEEK_SET) == 0 &&
+                  fread(r->index, sizeof(TraceBlockEntry), (size_t)t.blocks, f) == (size_t)t.blocks;
+    }
+    if (ok && !indexed) ok = trace_reader_scan(r);
+    if (!ok || fseeko(f, r->data_start, SEEK_SET) != 0) {
+        trace_reader_close(r);
+        memset(r, 0, sizeof(*r));
+        return -1;
+    }
+    return inst_count;
+}
+
+/** @brief 1-based number of the first record a truncated trace lost */
+static long long trace_reader_cut(const TraceReader* r) {
+    if (!r->compressed) return (long long)((r->data_end - r->data_start) / (off_t)sizeof(TraceRecord)) + 1;
+    long long kept = 0;
+    for (int64_t b = 0; b < r->blocks; ++b) kept += r->index[b].records;
+    return kept + 1;
+}
+
+/**
+ * @brief Read up to n records in cycle order
+ * @return Records read; fewer than n at the end of the trace or on an error (r->error)
+ */
+
+size_t trace_reader_read(TraceReader* r, TraceRecord* out, size_t n) {
+    if (!r->compressed) {
+        size_t got = fread(out, sizeof(TraceRecord), n, r->f);
+        if (got < n && (ferror(r->f) || r->truncated)) r->error = true;
+        return got;
+    }
+    size_t done = 0;
+    while (done < n && !r->error) {
+        if (r->pos == r->n && !trace_reader_block(r)) {
+            if (r->truncated) r->error = true;
+            break;
+        }
+        size_t k = r->n - r->pos < n - done ? r->n - r->pos : n - done;
+        memcpy(out + done, r->block + r->pos, sizeof(TraceRecord) * k);
+        r->pos += (uint32_t)k;
+        done += k;
+    }
+    return done;
+}
+
+/**
+ * @brief Position the reader at the first record of the given cycle or later
+ * A plain trace holds one record per cycle from cycle 1, so its records are addressed
+ * directly; a compressed one goes through the block index.
+ * @return false if the trace has no such cycle
+ */
+bool trace_reader_seek(TraceReader* r, int cycle) {
+    if (cycle < 1) cycle = 1;
+    if (!r->compressed) {
+        off_t at = r->data_start + (off_t)(cycle - 1) * (off_t)sizeof(TraceRecord);
+        TraceRecord probe;
+        return fseeko(r->f, at, SEEK_SET) == 0 && fread(&probe, sizeof(probe), 1, r->f) == 1 &&
+               fseeko(r->f, at, SEEK_SET) == 0;
+    }
+    int64_t lo = 0, hi = r->blocks;
+    while (hi - lo > 1) {
+        int64_t mid = (lo + hi) / 2;
+        if (r->index[mid].first_cycle <= cycle) lo = mid;
+        else hi = mid;
+    }
+    r->next_block = lo;
+    r->n = r->pos = 0;
+    if (!trace_reader_block(r)) return false;
+    while (r->block[r->pos].cycle < cycle)
+        if (++r->pos == r->n && !trace_reader_block(r)) return false;
+    return true;
+}
+
+/**
+ * @brief Read the trace's final record, leaving the reader past the end
+ * @return false if the trace is empty or unreadable
+ */
+bool trace_reader_last(TraceReader* r, TraceRecord* out) {
+    if (!r->compressed)
+        return r->data_end - (off_t)sizeof(*out) >= r->data_start &&
+               fseeko(r->f, r->data_end - (off_t)sizeof(*out), SEEK_SET) == 0 && fread(out, sizeof(*out), 1, r->f) == 1;
+    r->next_block = r->blocks - 1;
+    if (r->next_block < 0 || !trace_reader_block(r)) return false;
+    *out = r->block[r->n - 1];
+    r->pos = r->n;
+    return true;
+}
+
+// ---------- Trace conversion ----------
+// Every binary record carries the whole cycle, so the text of any record can be produced
+// on its own. The converter reads a batch of records, gives each worker a contiguous
+// slice to format into its own buffer, and writes the buffers in slice order.
+#define CONVERT_CHUNK 4096             // records per worker per batch
+
+typedef struct {
+    const TraceText* fmt;              // shared, read-only instruction tables
+    int num_regs;
+    const TraceRecord* recs;
+    size_t count;
+    char* out;                         // count * TRACE_CYCLE_MAX bytes
+    size_t len;
+} ConvertSlice;
+
+static void* convert_worker(void* arg) {
+    ConvertSlice* s = arg;
+    char* p = s->out;
+    for (size_t i = 0; i < s->count; ++i) p = format_cycle_state(p, s->fmt, s->num_regs, &s->recs[i]);
+    s->len = (size_t)(p - s->out);
+    return NULL;
+}
+
+/** @brief Check that a record only refers to instructions and names the formatter has */
+static bool trace_record_valid(const TraceRecord* rec, int inst_count) {
+    for (int s = 0; s < 4; ++s)
+        if (rec->idx[s] >= inst_count || rec->pre[s] >= inst_count || rec->post[s] >= inst_count ||
+            (rec->idx[s] < 0 && (rec->pre[s] >= 0 || rec->post[s] >= 0)))
+            return false;
+    if (rec->reason >= NUM_STALL_REASONS || rec->src_rs1 > SRC_PRED || rec->src_rs2 > SRC_PRED)
+        return false;
+    if (rec->mem_type == MEM_EV_FAULT &&
+        (rec->mem_value < 0 || rec->mem_value >= (int)(sizeof(FAULT_NAMES) / sizeof(FAULT_NAMES[0]))))
+        return false;
+    return true;
+}
+
+/**
+ * @brief Print a binary trace as the text a traced run prints, formatting on all cores
+ * @param filter Cycles to print; the reader seeks to the start of its window
+ * @param threads Worker threads (0 = all cores)
+ * @return 0 on success, 1 if the trace cannot be read or the output cannot be written
+ */
+int run_convert(const char* path, const TraceFilter* filter, int threads) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Could not open %s.\n", path);
+        return 1;
+    }
+    Instruction* prog = malloc(sizeof(Instruction) * MAX_INST);
+    SourceLine* source = malloc(sizeof(SourceLine) * MAX_INST);
+    int num_regs = 0;
+    TraceReader rd;
+    int inst_count = trace_reader_open(&rd, f, prog, source, &num_regs);
+    if (inst_count < 0) {
+        fprintf(stderr, "%s is not a compatible binary trace.\n", path);
+        fclose(f);
+        free(prog);
+        free(source);
+        return 1;
+    }
+    if (rd.compressed && rd.truncated)
+        fprintf(stderr, "%s: truncated or missing block index; recovered %lld block(s) by scanning.\n", path,
+                (long long)rd.blocks);
+    if (filter->cycle_from > 1 && !trace_reader_seek(&rd, filter->cycle_from)) {
+        fprintf(stderr, "%s has no cycle %d.\n", path, filter->cycle_from);
+        trace_reader_close(&rd);
+        fclose(f);
+        free(prog);
+        free(source);
+        return 1;
+    }
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+
+    TraceText fmt = { 0 };
+    size_t batch = (size_t)threads * CONVERT_CHUNK;
+    TraceRecord* recs = malloc(sizeof(TraceRecord) * batch);
+    ConvertSlice* slices = calloc((size_t)threads, sizeof(ConvertSlice));
+    pthread_t* tids = malloc(sizeof(pthread_t) * threads);
+    bool ok = recs && slices && tids && trace_text_open(&fmt, NULL, prog, source, inst_count) == 0;
+    if (ok) trace_text_filter(&fmt, filter);
+    for (int t = 0; ok && t < threads; ++t) {
+        slices[t].fmt = &fmt;
+        slices[t].num_regs = num_regs;
+        slices[t].out = malloc((size_t)CONVERT_CHUNK * TRACE_CYCLE_MAX);
+        ok = slices[t].out != NULL;
+    }
+    if (!ok) fprintf(stderr, "Out of memory converting %s.\n", path);
+
+    int fd = fileno(stdout);
+    fflush(stdout);
+    TraceRecord last;
+    long long records = 0;
+    bool past_window = false;
+    size_t n;
+    while (ok && !past_window && (n = trace_reader_read(&rd, recs, batch)) > 0) {
+        last = recs[n - 1];
+        records += (long long)n;
+        // Drop the records the filter rejects; the rest keep their order
+        size_t kept = 0;
+        for (size_t i = 0; i < n && ok; ++i) {
+            if (!trace_record_valid(&recs[i], inst_count)) {
+                fprintf(stderr, "%s: record %lld is corrupt.\n", path, records - (long long)(n - i) + 1);
+                ok = false;
+            } else if (recs[i].cycle > filter->cycle_to) {
+                past_window = true;
+                break;
+            } else if (recs[i].cycle >= filter->cycle_from && trace_text_match(&fmt, &recs[i])) {
+                recs[kept++] = recs[i];
+            }
+        }
+        if (!ok) break;
+        int used = 0;
+        for (size_t first = 0; first < kept; first += CONVERT_CHUNK, ++used) {
+            slices[used].recs = recs + first;
+            slices[used].count = kept - first < CONVERT_CHUNK ? kept - first : CONVERT_CHUNK;
+        }
+        // A short batch is formatted on this thread instead of waking the workers
+        if (used == 1) {
+            convert_worker(&slices[0]);
+        } else if (used > 1) {
+            for (int t = 0; t < used; ++t) pthread_create(&tids[t], NULL, convert_worker, &slices[t]);
+            for (int t = 0; t < used; ++t) pthread_join(tids[t], NULL);
+        }
+        for (int t = 0; t < used && ok; ++t)
+            if (!write_all(fd, slices[t].out, slices[t].len)) {
+                fprintf(stderr, "Could not write the converted trace.\n");
+                ok = false;
+            }
+    }
+    // The last record holds the registers after the final write-back
+    if (ok && past_window && (rd.truncated || !trace_reader_last(&rd, &last))) rd.error = true;
+    if (ok && rd.error) {
+        if (rd.truncated) fprintf(stderr, "%s is truncated at record %lld.\n", path, trace_reader_cut(&rd));
+        else fprintf(stderr, "Could not read %s.\n", path);
+        ok = false;
+    }
+    if (ok && records > 0) print_final_regs(stdout, last.regs, num_regs, last.cycle);
+
+    if (slices)
+        for (int t = 0; t < threads; ++t) free(slices[t].out);
+    if (fmt.buf) trace_text_close(&fmt);
+    free(tids);
+    free(slices);
+    free(recs);
+    free(prog);
+    free(source);
+    trace_reader_close(&rd);
+    fclose(f);
+    return ok ? 0 : 1;
+}
+
+// ---------- Memory address traces ----------
+// The data accesses of a run as fixed-size binary records, for cache studies outside
+// the simulator: an AddrTraceHeader, then one AddrRecord per MEM stage access in cycle
+// order, in host byte order. Records are gathered in a buffer of ADDR_TRACE_BUF and
+// written a buffer at a time. A compressed file holds the same bytes after the header
+// as a ZFile stream.
+#define ADDR_TRACE_MAGIC "PSADDR01"
+#define ADDR_TRACE_BUF 8192
+
+typedef struct {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t compressed;
+} AddrTraceHeader;
+
+typedef struct {
+    uint32_t cycle;
+    int32_t addr;                      // effective byte address (before translation)
+    int16_t idx;                       // program index of the LOAD/STORE
+    uint8_t type;                      // MemEventType: 1 store, 2 load, 3 fault
+    uint8_t pad;
+} AddrRecord;
+_Static_assert(sizeof(AddrRecord) == 12, "address trace records are 12 bytes");
+
+typedef struct {
+    FILE* f;
+    ZFile z;
+    AddrRecord* buf;
+    size_t n;
+    long long records;
+} AddrTrace;
+
+/**
+ * @brief Create an address trace file
+ * @return 0 on success, -1 if the file cannot be written
+ */
+int addr_trace_open(AddrTrace* t, const char* path, bool compressed) {
+    memset(t, 0, sizeof(*t));
+    t->f = fopen(path, "wb");
+    t->buf = malloc(sizeof(AddrRecord) * ADDR_TRACE_BUF);
+    AddrTraceHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, ADDR_TRACE_MAGIC, sizeof(h.magic));
+    h.record_size = sizeof(AddrRecord);
+    h.compressed = compressed;
+    if (!t->f || !t->buf || fwrite(&h, sizeof(h), 1, t->f) != 1) {
+        if (t->f) fclose(t->f);
+        free(t->buf);
+        return -1;
+    }
+    zf_init(&t->z, t->f, compressed);
+    return 0;
+}
+
+static void addr_trace_hook(void* ctx, int type, int addr, int idx, long long cycle) {
+    AddrTrace* t = ctx;
+    AddrRecord* r = &t->buf[t->n++];
+    r->cycle = (uint32_t)cycle;
+    r->addr = addr;
+    r->idx = (int16_t)idx;
+    r->type = (uint8_t)type;
+    r->pad = 0;
+    if (t->n == ADDR_TRACE_BUF) {
+        zf_write(&t->z, t->buf, sizeof(AddrRecord) * t->n);
+        t->records += (long long)t->n;
+        t->n = 0;
+    }
+}
+
+/**
+ * @brief Write the buffered records and close the file
+ * @return Records written, or -1 if a write failed
+ */
+long long addr_trace_close(AddrTrace* t) {
+    bool ok = zf_write(&t->z, t->buf, sizeof(AddrRecord) * t->n);
+    t->records += (long long)t->n;
+    ok = zf_finish(&t->z) && ok;
+    ok = fclose(t->f) == 0 && ok;
+    free(t->buf);
+    return ok ? t->records : -1;
+}
+
+// Several access observers on one run
+#define MAX_ACCESS_HOOKS 4
+
+typedef struct {
+    AccessHook hook[MAX_ACCESS_HOOKS];
+    void* ctx[MAX_ACCESS_HOOKS];
+    int n;
+} AccessFanout;
+
+static void access_fanout_hook(void* ctx, int type, int addr, int idx, long long cycle) {
+    AccessFanout* f = ctx;
+    for (int i = 0; i < f->n; ++i) f->hook[i](f->ctx[i], type, addr, idx, cycle);
+}
+
+static void access_fanout_add(AccessFanout* f, AccessHook hook, void* ctx) {
+    assert(f->n < MAX_ACCESS_HOOKS);
+    f->hook[f->n] = hook;
+    f->ctx[f->n++] = ctx;
+}
+
+// ---------- Stack distance analysis ----------
+// One pass over the LOAD/STORE stream gives the miss count of every fully associative
+// LRU cache (Mattson et al.): an access hits a cache of C lines exactly when fewer than
+// C distinct lines were touched since the previous access to its line. Each line's
+// latest access time is marked in a Fenwick tree, so that count is two prefix sums,
+// O(log n) per access. Times are renumbered when the tree fills, which keeps it at a
+// few times the number of lines however long the run is.
+//
+// Set-associative caches are estimated from the same histogram by assuming lines map
+// to sets at random: an access at distance d misses an S-set, A-way cache when at
+// least A of the d lines in between fall into its set, P(Binomial(d, 1/S) >= A).
+#define SD_LINES (MEM_BYTES / WORD_SIZE_BYTES)   // most lines memory can hold
+#define SD_TIMES (4 * SD_LINES)                  // Fenwick tree size before renumbering
+#define SD_MAX_WAYS 8
+
+typedef struct {
+    int line_bytes;
+    long long accesses, cold;
+    int distinct;
+    int now;                           // time of the latest access (1-based)
+    int last[SD_LINES];                // latest access time per line (0 = never)
+    int owner[SD_TIMES + 1];           // line whose latest access is at a time (-1 = none)
+    int tree[SD_TIMES + 1];            // Fenwick tree over the marked times
+    long long hist[SD_LINES];          // accesses per stack distance
+} StackDist;
+
+static void sd_add(StackDist* sd, int t, int v) {
+    for (; t <= SD_TIMES; t += t & -t) sd->tree[t] += v;
+}
+
+static int sd_prefix(const StackDist* sd, int t) {
+    int sum = 0;
+    for (; t > 0; t -= t & -t) sum += sd->tree[t];
+    return sum;
+}
+
+/** @param line_bytes Line size (a power of two multiple of the word size) */
+StackDist* sd_new(int line_bytes) {
+    StackDist* sd = calloc(1, sizeof(StackDist));
+    sd->line_bytes = line_bytes;
+    for (int t = 0; t <= SD_TIMES; ++t) sd->owner[t] = -1;
+    return sd;
+}
+
+/** @brief Renumber the marked times 1..distinct, keeping their order */
+static void sd_compact(StackDist* sd) {
+    int t2 = 0;
+    for (int t = 1; t <= sd->now; ++t) {
+        int line = sd->owner[t];
+        sd->owner[t] = -1;
+        if (line < 0) continue;
+        sd->owner[++t2] = line;
+        sd->last[line] = t2;
+    }
+    // Linear-time Fenwick build over the t2 marked times
+    memset(sd->tree, 0, sizeof(sd->tree));
+    for (int t = 1; t <= SD_TIMES; ++t) {
+        sd->tree[t] += t <= t2;
+        int up = t + (t & -t);
+        if (up <= SD_TIMES) sd->tree[up] += sd->tree[t];
+    }
+    sd->now = t2;
+}
+
+static void sd_access(StackDist* sd, int addr) {
+    if (sd->now == SD_TIMES) sd_compact(sd);
+    int line = addr / sd->line_bytes;
+    int t = ++sd->now;
+    sd->accesses++;
+    int prev = sd->last[line];
+    if (prev == 0) {
+        sd->cold++;
+        sd->distinct++;
+    } else {
+        sd->hist[sd_prefix(sd, t - 1) - sd_prefix(sd, prev)]++;
+        sd_add(sd, prev, -1);
+        sd->owner[prev] = -1;
+    }
+    sd_add(sd, t, 1);
+    sd->owner[t] = line;
+    sd->last[line] = t;
+}
+
+static void sd_hook(void* ctx, int type, int addr, int idx, long long cycle) {
+    (void)idx;
+    (void)cycle;
+    if (type == MEM_EV_LOAD || type == MEM_EV_STORE) sd_access(ctx, addr);
+}
+
+/** @brief Misses of a fully associative LRU cache of the given number of lines */
+static long long sd_misses(const StackDist* sd, int lines) {
+    long long m = sd->cold;
+    for (int d = lines; d < sd->distinct; ++d) m += sd->hist[d];
+    return m;
+}
+
+/** @brief Estimated misses of an LRU cache of the given lines and ways (random set mapping) */
+static double sd_misses_assoc(const StackDist* sd, int lines, int ways) {
+    int sets = lines / ways;
+    if (sets == 1) return (double)sd_misses(sd, ways);
+    double p = 1.0 / sets, q = 1.0 - p;
+    double m = (double)sd->cold;
+    for (int d = ways; d < sd->distinct; ++d) {
+        if (!sd->hist[d]) continue;
+        // P(fewer than `ways` of the d lines share the set) = sum of the first pmf terms
+        double pmf = pow(q, d), hit = 0.0;
+        for (int k = 0; k < ways; ++k) {
+            hit += pmf;
+            pmf *= (double)(d - k) / (k + 1) * p / q;
+        }
+        m += (double)sd->hist[d] * (1.0 - hit);
+    }
+    return m;
+}
+
+/**
+ * @brief Size the curves are reported up to
+ * Past the footprint the fully associative curve is flat, but the set-associative
+ * estimates keep falling until conflicts are negligible (under half a miss plus 0.1%
+ * of the accesses); direct-mapped falls last.
+ */
+static int sd_curve_end(const StackDist* sd) {
+    int lines = 1;
+    while (lines < SD_LINES &&
+           (lines < sd->distinct || sd_misses_assoc(sd, lines, 1) - (double)sd->cold > 0.5 + 0.001 * (double)sd->accesses))
+        lines *= 2;
+    return lines;
+}
+
+/**
+ * @brief Print the miss-ratio curve at power-of-two sizes; write every size to csv
+ * @param csv Full curve destination (NULL: none)
+ */
+void sd_report(FILE* out, FILE* csv, const StackDist* sd) {
+    double n = sd->accesses ? (double)sd->accesses : 1.0;
+    fprintf(out, "\n=============== STACK DISTANCES ===============\n");
+    fprintf(out, "%lld data accesses, %d-byte lines, %d distinct lines (%d bytes)\n",
+            sd->accesses, sd->line_bytes, sd->distinct, sd->distinct * sd->line_bytes);
+    fprintf(out, "%8s %8s  %18s %9s %9s %9s %9s\n", "lines", "bytes", "fully assoc", "direct", "2-way",
+            "4-way", "8-way");
+    int end = sd_curve_end(sd);
+    for (int lines = 1; lines <= end; lines *= 2) {
+        long long fa = sd_misses(sd, lines);
+        fprintf(out, "%8d %8d  %10lld (%.3f)", lines, lines * sd->line_bytes, fa, fa / n);
+        for (int ways = 1; ways <= SD_MAX_WAYS; ways *= 2) {
+            if (lines % ways == 0) fprintf(out, " %9.3f", sd_misses_assoc(sd, lines, ways) / n);
+            else fprintf(out, " %9s", "-");
+        }
+        fprintf(out, "\n");
+    }
+    if (!csv) return;
+    fprintf(csv, "lines,bytes,misses,miss_ratio,direct,2way,4way,8way\n");
+    for (int lines = 1; lines <= end; ++lines) {
+        long long fa = sd_misses(sd, lines);
+        fprintf(csv, "%d,%d,%lld,%.6f", lines, lines * sd->line_bytes, fa, fa / n);
+        for (int ways = 1; ways <= SD_MAX_WAYS; ways *= 2) {
+            if (lines % ways == 0) fprintf(csv, ",%.6f", sd_misses_assoc(sd, lines, ways) / n);
+            else fprintf(csv, ",");
+        }
+        fprintf(csv, "\n");
+    }
+}
+
+// ---------- Footprint profiling ----------
+// Which memory a run touches, and when, from the LOAD/STORE stream:
+//  - the mean working set (Denning) of lines and pages for windows of T cycles, at
+//    T = 1, 2, 4, ...: a reference at cycle r stays in the working set until the next
+//    reference to its line or T cycles later, so the mean is the sum of
+//    min(gap to next reference, T) over all references divided by the run length;
+//  - a time series of distinct lines and pages per fixed window of cycles (csv);
+//  - the most accessed words, each instruction's footprint, and the highest address.
+#define FP_SPANS 24                    // working-set windows up to 2^23 cycles
+#define FP_HOT 10
+#define FP_WORD_SETS (MEM_SIZE_WORDS / 64)
+
+typedef struct {
+    int line_bytes, page_bytes;
+    long long window;                  // cycles per time series row
+    FILE* csv;                         // time series destination (NULL = none)
+    long long accesses;
+    int max_addr;                      // highest byte touched (-1 = none)
+    long long loads[MEM_SIZE_WORDS], stores[MEM_SIZE_WORDS];
+    long long last_line[SD_LINES], last_page[SD_LINES];   // latest reference cycle (0 = never)
+    long long ws_lines[FP_SPANS], ws_pages[FP_SPANS];     // sums of min(gap, T)
+    long long row;                     // current time series row
+    long long row_accesses;
+    int row_lines, row_pages;
+    long long line_row[SD_LINES], page_row[SD_LINES];     // row + 1 of the latest reference
+    long long inst_accesses[MAX_INST];
+    uint64_t touched[MAX_INST][FP_WORD_SETS];             // words each instruction accessed
+} Footprint;
+
+/**
+ * @param window Cycles per time series row
+ * @param csv Time series destination (NULL: none)
+ */
+Footprint* fp_new(const SimConfig* cfg, long long window, FILE* csv) {
+    Footprint* fp = calloc(1, sizeof(Footprint));
+    fp->line_bytes = cfg->cache_line_bytes;
+    fp->page_bytes = cfg->page_bytes;
+    fp->window = window > 0 ? window : 1;
+    fp->csv = csv;
+    fp->max_addr = -1;
+    if (csv) fprintf(csv, "window,first_cycle,accesses,lines,pages\n");
+    return fp;
+}
+
+static void fp_span_add(long long* ws, long long gap) {
+    for (int k = 0; k < FP_SPANS; ++k) ws[k] += gap < (1LL << k) ? gap : (1LL << k);
+}
+
+/** @brief Emit time series rows up to (not including) row */
+static void fp_rows_until(Footprint* fp, long long row) {
+    for (; fp->row < row; ++fp->row) {
+        if (fp->csv)
+            fprintf(fp->csv, "%lld,%lld,%lld,%d,%d\n", fp->row, fp->row * fp->window + 1, fp->row_accesses,
+                    fp->row_lines, fp->row_pages);
+        fp->row_accesses = 0;
+        fp->row_lines = fp->row_pages = 0;
+    }
+}
+
+static void fp_access(Footprint* fp, bool store, int addr, int idx, long long cycle) {
+    int word = addr / WORD_SIZE_BYTES;
+    int line = addr / fp->line_bytes;
+    int page = addr / fp->page_bytes;
+    fp->accesses++;
+    if (addr > fp->max_addr) fp->max_addr = addr;
+    if (store) fp->stores[word]++;
+    else fp->loads[word]++;
+    if (idx >= 0 && idx < MAX_INST) {
+        fp->inst_accesses[idx]++;
+        fp->touched[idx][word / 64] |= 1ULL << (word % 64);
+    }
+
+    if (fp->last_line[line]) fp_span_add(fp->ws_lines, cycle - fp->last_line[line]);
+    if (fp->last_page[page]) fp_span_add(fp->ws_pages, cycle - fp->last_page[page]);
+    fp->last_line[line] = fp->last_page[page] = cycle;
+
+    fp_rows_until(fp, (cycle - 1) / fp->window);
+    fp->row_accesses++;
+    if (fp->line_row[line] != fp->row + 1) {
+        fp->line_row[line] = fp->row + 1;
+        fp->row_lines++;
+    }
+    if (fp->page_row[page] != fp->row + 1) {
+        fp->page_row[page] = fp->row + 1;
+        fp->row_pages++;
+    }
+}
+
+static void fp_hook(void* ctx, int type, int addr, int idx, long long cycle) {
+    if (type == MEM_EV_LOAD || type == MEM_EV_STORE) fp_access(ctx, type == MEM_EV_STORE, addr, idx, cycle);
+}
+
+/** @brief Distinct lines (unit bytes wide) among a set of words */
+static int fp_units(const uint64_t* words, int unit_bytes) {
+    int n = 0, last = -1;
+    for (int w = 0; w < MEM_SIZE_WORDS; ++w)
+        if ((words[w / 64] >> (w % 64) & 1) && w * WORD_SIZE_BYTES / unit_bytes != last) {
+            last = w * WORD_SIZE_BYTES / unit_bytes;
+            n++;
+        }
+    return n;
+}
+
+/**
+ * @brief Finish the time series and print the footprint report
+ * @param cpu The profiled run (its cycle count and program)
+ */
+void fp_report(FILE* out, Footprint* fp, const CPU* cpu) {
+    long long cycles = cpu->stats.cycles > 0 ? cpu->stats.cycles : 1;
+    // References still live at the end count until the last cycle
+    long long ws_lines[FP_SPANS], ws_pages[FP_SPANS];
+    memcpy(ws_lines, fp->ws_lines, sizeof(ws_lines));
+    memcpy(ws_pages, fp->ws_pages, sizeof(ws_pages));
+    uint64_t all[FP_WORD_SETS] = { 0 };
+    for (int i = 0; i < SD_LINES; ++i) {
+        if (fp->last_line[i]) fp_span_add(ws_lines, cycles - fp->last_line[i] + 1);
+        if (fp->last_page[i]) fp_span_add(ws_pages, cycles - fp->last_page[i] + 1);
+    }
+    for (int w = 0; w < MEM_SIZE_WORDS; ++w)
+        if (fp->loads[w] + fp->stores[w]) all[w / 64] |= 1ULL << (w % 64);
+    if (fp->accesses) {
+        fp_rows_until(fp, (cycles - 1) / fp->window);
+        fp_rows_until(fp, fp->row + 1);
+    }
+
+    int words = fp_units(all, WORD_SIZE_BYTES);
+    fprintf(out, "\n=============== FOOTPRINT ===============\n");
+    fprintf(out, "%lld data accesses in %lld cycles touched %d words, %d lines (%d B), %d pages (%d B)\n",
+            fp->accesses, cpu->stats.cycles, words, fp_units(all, fp->line_bytes), fp->line_bytes,
+            fp_units(all, fp->page_bytes), fp->page_bytes);
+    if (fp->max_addr >= 0) {
+        int need = WORD_SIZE_BYTES;
+        while (need <= fp->max_addr) need *= 2;
+        fprintf(out, "Highest address %d: %d of the %d memory bytes would hold every access\n",
+                fp->max_addr, need, MEM_BYTES);
+    }
+
+    fprintf(out, "Mean working set over the last T cycles:\n%10s %10s %10s\n", "T", "lines", "pages");
+    for (int k = 0; k < FP_SPANS; ++k) {
+        fprintf(out, "%10lld %10.2f %10.2f\n", 1LL << k, (double)ws_lines[k] / cycles, (double)ws_pages[k] / cycles);
+        if ((1LL << k) >= cycles) break;
+    }
+
+    fprintf(out, "Hottest words:\n%10s %10s %10s %10s\n", "address", "accesses", "loads", "stores");
+    bool shown[MEM_SIZE_WORDS] = { false };
+    for (int h = 0; h < FP_HOT; ++h) {
+        int best = -1;
+        for (int w = 0; w < MEM_SIZE_WORDS; ++w)
+            if (!shown[w] && fp->loads[w] + fp->stores[w] > 0 &&
+                (best < 0 || fp->loads[w] + fp->stores[w] > fp->loads[best] + fp->stores[best]))
+                best = w;
+        if (best < 0) break;
+        shown[best] = true;
+        fprintf(out, "%10d %10lld %10lld %10lld\n", best * WORD_SIZE_BYTES, fp->loads[best] + fp->stores[best],
+                fp->loads[best], fp->stores[best]);
+    }
+
+    fprintf(out, "Per instruction:\n%5s  %-20s %10s %8s %8s %8s\n", "#", "instruction", "accesses", "words",
+            "lines", "pages");
+    for (int i = 0; i < cpu->inst_count && i < MAX_INST; ++i)
+        if (fp->inst_accesses[i])
+            fprintf(out, "%5d  %-20s %10lld %8d %8d %8d\n", i, cpu->source[i], fp->inst_accesses[i],
+                    fp_units(fp->touched[i], WORD_SIZE_BYTES), fp_units(fp->touched[i], fp->line_bytes),
+                    fp_units(fp->touched[i], fp->page_bytes));
+}
+
+// ---------- Golden trace comparison ----------
+// The live run is checked against a reference trace one cycle at a time, so the
+// reference is never loaded whole and the run stops at the first divergence.
+#define CMP_CONTEXT 6
+
+typedef struct {
+    FILE* ref;
+    bool binary;
+    bool diverged;
+    // text mode: reference lines already matched, kept for context
+    char* line;
+    size_t line_cap;
+    long line_no;
+    char ctx[CMP_CONTEXT][2 * LINE_LEN];
+    long ctx_no[CMP_CONTEXT];
+    int nctx;
+    // binary mode
+    TraceReader reader;
+    Instruction* ref_prog;
+    SourceLine* ref_source;
+    int ref_count;
+    int ref_regs;
+    long long records;
+} TraceCompare;
+
+static void cmp_remember(TraceCompare* c, const char* s, long no) {
+    int slot = c->nctx % CMP_CONTEXT;
+    snprintf(c->ctx[slot], sizeof(c->ctx[slot]), "%s", s);
+    c->ctx_no[slot] = no;
+    c->nctx++;
+}
+
+static void cmp_print_context(const TraceCompare* c) {
+    int first = c->nctx > CMP_CONTEXT ? c->nctx - CMP_CONTEXT : 0;
+    for (int i = first; i < c->nctx; ++i)
+        fprintf(stderr, "  %6ld | %s\n", c->ctx_no[i % CMP_CONTEXT], c->ctx[i % CMP_CONTEXT]);
+}
+
+static char* chomp(char* s) {
+    size_t n = strlen(s);
+    while (n > 0 && (s[n - 1] == '\n' || s[n - 1] == '\r')) s[--n] = '\0';
+    return s;
+}
+
+/**
+ * @brief Compare rendered text against the next reference lines
+ * @param cycle Cycle the text belongs to (0 for the final summary)
+ * @return false at the first differing line (already reported)
+ */
+static bool cmp_text(TraceCompare* c, char* text, long long cycle) {
+    char* save = NULL;
+    // Split on '\n' keeping empty lines, which strtok would drop.
+    for (char* p = text; *p; p = save) {
+        char* nl = strchr(p, '\n');
+        save = nl ? nl + 1 : p + strlen(p);
+        if (nl) *nl = '\0';
+        ssize_t n = getline(&c->line, &c->line_cap, c->ref);
+        c->line_no++;
+        const char* expected = n < 0 ? NULL : chomp(c->line);
+        if (!expected || strcmp(expected, p) != 0) {
+            if (cycle > 0)
+                fprintf(stderr, "Trace diverges at line %ld (cycle %lld):\n", c->line_no, cycle);
+            else
+                fprintf(stderr, "Trace diverges at line %ld (final state):\n", c->line_no);
+            cmp_print_context(c);
+            fprintf(stderr, "- expected: %s\n", expected ? expected : "<end of reference>");
+            fprintf(stderr, "+ actual:   %s\n", p);
+            c->diverged = true;
+            return false;
+        }
+        cmp_remember(c, p, c->line_no);
+    }
+    return true;
+}
+
+typedef struct {
+    const char* name;
+    size_t offset, size;
+} RecordField;
+
+#define REC_FIELD(f) { #f, offsetof(TraceRecord, f), sizeof(((TraceRecord*)0)->f) }
+static const RecordField RECORD_FIELDS[] = {
+    REC_FIELD(cycle), REC_FIELD(pc), REC_FIELD(idx), REC_FIELD(pre), REC_FIELD(post),
+    REC_FIELD(stalled), REC_FIELD(reason), REC_FIELD(src_rs1), REC_FIELD(src_rs2),
+    REC_FIELD(ex_rs1), REC_FIELD(ex_rs2), REC_FIELD(ex_result), REC_FIELD(wb_value),
+    REC_FIELD(wb_pre_value), REC_FIELD(wb_post_value), REC_FIELD(mem_type), REC_FIELD(mem_reg),
+    REC_FIELD(mem_value), REC_FIELD(mem_addr), REC_FIELD(regs),
+};
+#define NUM_RECORD_FIELDS ((int)(sizeof(RECORD_FIELDS) / sizeof(RECORD_FIELDS[0])))
+
+static bool cmp_record(TraceCompare* c, const CPU* cpu, const TraceRecord* rec) {
+    TraceRecord ref;
+    c->records++;
+    if (trace_reader_read(&c->reader, &ref, 1) != 1) {
+        if (c->reader.truncated)
+            fprintf(stderr, "Trace diverges at cycle %d: reference is truncated at record %lld\n",
+                    rec->cycle, trace_reader_cut(&c->reader));
+        else
+            fprintf(stderr, "Trace diverges at cycle %d: reference ends after %lld cycles\n",
+                    rec->cycle, c->records - 1);
+        c->diverged = true;
+        return false;
+    }
+    for (int i = 0; i < NUM_RECORD_FIELDS; ++i) {
+        const RecordField* f = &RECORD_FIELDS[i];
+        if (memcmp((const char*)&ref + f->offset, (const char*)rec + f->offset, f->size) == 0)
+            continue;
+        fprintf(stderr, "Trace diverges at cycle %d (field %s)\n--- expected\n", rec->cycle, f->name);
+        print_cycle_state(stderr, c->ref_prog, c->ref_source, c->ref_count, c->ref_regs, &ref);
+        fprintf(stderr, "+++ actual\n");
+        print_cycle_state(stderr, cpu->program, cpu->source, cpu->inst_count, cpu->cfg.num_regs, rec);
+        c->diverged = true;
+        return false;
+    }
+    return true;
+}
+
+static void compare_hook(void* ctx, const CPU* cpu, const TraceRecord* rec) {
+    TraceCompare* c = ctx;
+    if (c->diverged) return;
+    if (c->binary) {
+        cmp_record(c, cpu, rec);
+        return;
+    }
+    char* buf = NULL;
+    size_t len = 0;
+    FILE* m = open_memstream(&buf, &len);
+    print_cycle_state(m, cpu->program, cpu->source, cpu->inst_count, cpu->cfg.num_regs, rec);
+    fclose(m);
+    cmp_text(c, buf, rec->cycle);
+    free(buf);
+}
+
+/**
+ * @brief Run the loaded program against a reference trace (text or binary)
+ * @return 0 if the traces match, 1 at the first divergence or if REF is unreadable
+ */
+int run_compare(CPU* cpu, const char* ref_path) {
+    TraceCompare c;
+    memset(&c, 0, sizeof(c));
+    c.ref = fopen(ref_path, "rb");
+    if (!c.ref) {
+        fprintf(stderr, "Could not open %s.\n", ref_path);
+        return 1;
+    }
+    c.binary = trace_is_binary(c.ref);
+    if (c.binary) {
+        c.ref_prog = malloc(sizeof(Instruction) * MAX_INST);
+        c.ref_source = malloc(sizeof(SourceLine) * MAX_INST);
+        c.ref_count = trace_reader_open(&c.reader, c.ref, c.ref_prog, c.ref_source, &c.ref_regs);
+        if (c.ref_count < 0) {
+            fprintf(stderr, "%s: incompatible binary trace\n", ref_path);
+            free(c.ref_prog);
+            free(c.ref_source);
+            fclose(c.ref);
+            return 1;
+        }
+    }
+
+    cpu->trace = NULL;
+    cpu->on_cycle = compare_hook;
+    cpu->on_cycle_ctx = &c;
+    sim_start(cpu);
+    while (!c.diverged && sim_step(cpu)) {
+    }
+
+    if (!c.diverged) {
+        if (c.binary) {
+            TraceRecord extra;
+            if (trace_reader_read(&c.reader, &extra, 1) == 1) {
+                fprintf(stderr, "Trace diverges after cycle %lld: reference continues to cycle %d\n",
+                        cpu->stats.cycles, extra.cycle);
+                c.diverged = true;
+            } else if (c.reader.error) {
+                fprintf(stderr, "%s is truncated at record %lld.\n", ref_path, trace_reader_cut(&c.reader));
+                c.diverged = true;
+            }
+        } else {
+            char* buf = NULL;
+            size_t len = 0;
+            FILE* m = open_memstream(&buf, &len);
+            print_final_state(m, cpu);
+            fclose(m);
+            if (cmp_text(&c, buf, 0) && getline(&c.line, &c.line_cap, c.ref) >= 0) {
+                fprintf(stderr, "Trace diverges at line %ld: reference has extra output\n", c.line_no + 1);
+                fprintf(stderr, "- expected: %s\n", chomp(c.line));
+                c.diverged = true;
+            }
+            free(buf);
+        }
+    }
+    if (!c.diverged)
+        printf("Trace matches %s (%lld cycles)\n", ref_path, cpu->stats.cycles);
+
+    cpu->on_cycle = NULL;
+    if (c.binary) trace_reader_close(&c.reader);
+    free(c.line);
+    free(c.ref_prog);
+    free(c.ref_source);
+    fclose(c.ref);
+    return c.diverged ? 1 : 0;
+}
+
+// ---------- Checkpoints ----------
+// Periodic snapshots of the mutable CPU state. The program does not change during a
+// run and is not copied. Memory is split into pages shared between consecutive
+// checkpoints until written, so each checkpoint costs the core state plus the pages
+// that changed since the previous one. The data cache, TLBs and value predictor are
+// copied only when their feature is enabled; otherwise they never leave their
+// sim_start state and there is nothing to restore.
+#define CKPT_PAGE_WORDS 64
+#define CKPT_PAGES (MEM_SIZE_WORDS / CKPT_PAGE_WORDS)
+
+// Optional state a checkpoint holds
+typedef enum { CKPT_DCACHE = 1, CKPT_TLB = 2, CKPT_LVP = 4 } CkptPart;
+
+typedef struct {
+    int refs;
+    int w[CKPT_PAGE_WORDS];
+} MemPage;
+
+typedef struct {
+    long long cycle;
+    int R[MAX_REGS];
+    int PC;
+    StageLatch if_id, id_ex, ex_mem, mem_wb;
+    bool ex_started, mem_started, wb_started;
+    int ex_wait, mem_wait, ex_read_wait, wb_wait;
+    SimStats stats;
+    int fetch_high;
+    int epc;
+    long long exc_start;
+    int parts;                     // CkptPart bits
+    int lvp_entries;
+    DataCache* dcache;             // CKPT_DCACHE
+    Tlb* tlb;                      // CKPT_TLB: L1 and L2
+    LvpEntry* lvp;                 // CKPT_LVP: lvp_entries entries
+    MemPage* page[CKPT_PAGES];
+} Checkpoint;
+
+typedef struct {
+    Checkpoint* cp;
+    int count, cap;
+    long long interval;            // cycles between checkpoints
+    long long pages_shared, pages_copied;
+} CheckpointLog;
+
+void ckpt_log_init(CheckpointLog* log, long long interval) {
+    memset(log, 0, sizeof(*log));
+    log->interval = interval > 0 ? interval : 1;
+}
+
+static void ckpt_free_parts(Checkpoint* c) {
+    free(c->dcache);
+    free(c->tlb);
+    free(c->lvp);
+}
+
+void ckpt_log_free(CheckpointLog* log) {
+    for (int i = 0; i < log->count; ++i) {
+        for (int p = 0; p < CKPT_PAGES; ++p)
+            if (--log->cp[i].page[p]->refs == 0) free(log->cp[i].page[p]);
+        ckpt_free_parts(&log->cp[i]);
+    }
+    free(log->cp);
+    memset(log, 0, sizeof(*log));
+}
+
+/**
+ * @brief Append a snapshot of the CPU (no-op if one already exists for this cycle or later)
+ */
+void ckpt_take(CheckpointLog* log, const CPU* cpu) {
+    const Checkpoint* prev = log->count ? &log->cp[log->count - 1] : NULL;
+    if (prev && prev->cycle >= cpu->stats.cycles) return;
+    if (log->count == log->cap) {
+        log->cap = log->cap ? 2 * log->cap : 64;
+        log->cp = realloc(log->cp, sizeof(Checkpoint) * (size_t)log->cap);
+        prev = log->count ? &log->cp[log->count - 1] : NULL;
+    }
+    Checkpoint* c = &log->cp[log->count++];
+    c->cycle = cpu->stats.cycles;
+    memcpy(c->R, cpu->R, sizeof(c->R));
+    c->PC = cpu->PC;
+    c->if_id = cpu->pipeline_IF_ID;
+    c->id_ex = cpu->pipeline_ID_EX;
+    c->ex_mem = cpu->pipeline_EX_MEM;
+    c->mem_wb = cpu->pipeline_MEM_WB;
+    c->ex_started = cpu->ex_started;
+    c->mem_started = cpu->mem_started;
+    c->ex_wait = cpu->ex_wait;
+    c->mem_wait = cpu->mem_wait;
+    c->ex_read_wait = cpu->ex_read_wait;
+    c->wb_started = cpu->wb_started;
+    c->wb_wait = cpu->wb_wait;
+    c->stats = cpu->stats;
+    c->fetch_high = cpu->fetch_high;
+    c->epc = cpu->epc;
+    c->exc_start = cpu->exc_start;
+    c->parts = 0;
+    c->lvp_entries = 0;
+    c->dcache = NULL;
+    c->tlb = NULL;
+    c->lvp = NULL;
+    if (cpu->cfg.cache_bytes > 0) {
+        c->parts |= CKPT_DCACHE;
+        c->dcache = malloc(sizeof(DataCache));
+        *c->dcache = cpu->dcache;
+    }
+    if (cpu->cfg.vm) {
+        c->parts |= CKPT_TLB;
+        c->tlb = malloc(sizeof(cpu->tlb));
+        memcpy(c->tlb, cpu->tlb, sizeof(cpu->tlb));
+    }
+    if (cpu->cfg.lvp != LVP_OFF) {
+        c->parts |= CKPT_LVP;
+        c->lvp_entries = cpu->cfg.lvp_entries;
+        c->lvp = malloc(sizeof(LvpEntry) * (size_t)c->lvp_entries);
+        memcpy(c->lvp, cpu->lvp, sizeof(LvpEntry) * (size_t)c->lvp_entries);
+    }
+    for (int p = 0; p < CKPT_PAGES; ++p) {
+        const int* words = &cpu->memory[p * CKPT_PAGE_WORDS];
+        if (prev && memcmp(prev->page[p]->w, words, sizeof(prev->page[p]->w)) == 0) {
+            c->page[p] = prev->page[p];
+            c->page[p]->refs++;
+            log->pages_shared++;
+        } else {
+            c->page[p] = malloc(sizeof(MemPage));
+            c->page[p]->refs = 1;
+            memcpy(c->page[p]->w, words, sizeof(c->page[p]->w));
+            log->pages_copied++;
+        }
+    }
+}
+
+void ckpt_restore(const Checkpoint* c, CPU* cpu) {
+    memcpy(cpu->R, c->R, sizeof(c->R));
+    cpu->PC = c->PC;
+    cpu->pipeline_IF_ID = c->if_id;
+    cpu->pipeline_ID_EX = c->id_ex;
+    cpu->pipeline_EX_MEM = c->ex_mem;
+    cpu->pipeline_MEM_WB = c->mem_wb;
+    cpu->ex_started = c->ex_started;
+    cpu->mem_started = c->mem_started;
+    cpu->ex_wait = c->ex_wait;
+    cpu->mem_wait = c->mem_wait;
+    cpu->ex_read_wait = c->ex_read_wait;
+    cpu->wb_started = c->wb_started;
+    cpu->wb_wait = c->wb_wait;
+    cpu->stats = c->stats;
+    if (c->dcache) cpu->dcache = *c->dcache;
+    if (c->tlb) memcpy(cpu->tlb, c->tlb, sizeof(cpu->tlb));
+    if (c->lvp) memcpy(cpu->lvp, c->lvp, sizeof(LvpEntry) * (size_t)c->lvp_entries);
+    cpu->fetch_high = c->fetch_high;
+    cpu->epc = c->epc;
+    cpu->exc_start = c->exc_start;
+    for (int p = 0; p < CKPT_PAGES; ++p)
+        memcpy(&cpu->memory[p * CKPT_PAGE_WORDS], c->page[p]->w, sizeof(c->page[p]->w));
+}
+
+/**
+ * @brief Latest checkpoint at or before a cycle (NULL if none)
+ */
+const Checkpoint* ckpt_find(const CheckpointLog* log, long long cycle) {
+    int lo = 0, hi = log->count - 1, best = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (log->cp[mid].cycle <= cycle) {
+            best = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return best < 0 ? NULL : &log->cp[best];
+}
+
+/**
+ * @brief Simulate one cycle, checkpointing every log->interval cycles
+ */
+bool ckpt_step(CheckpointLog* log, CPU* cpu) {
+    if (!sim_step(cpu)) return false;
+    if (cpu->stats.cycles % log->interval == 0) ckpt_take(log, cpu);
+    return true;
+}
+
+/**
+ * @brief Move the simulation to the end of a cycle, backwards or forwards
+ *
+ * Going back restores the nearest earlier checkpoint and re-simulates, so it costs
+ * at most one checkpoint interval. The target cycle itself is always simulated,
+ * which lets the per-cycle hook observe it.
+ * @return Cycle reached (earlier than target if the program drains first)
+ */
+long long ckpt_goto(CheckpointLog* log, CPU* cpu, long long target) {
+    if (target < 1) target = 1;
+    if (target <= cpu->stats.cycles) {
+        const Checkpoint* c = ckpt_find(log, target - 1);
+        assert(c);
+        ckpt_restore(c, cpu);
+    }
+    while (cpu->stats.cycles < target && ckpt_step(log, cpu)) {
+    }
+    return cpu->stats.cycles;
+}
+
+// ---------- Time-travel debugger ----------
+// Commands read from stdin, one per line:
+//   s|step [N]   rs|rstep [N]   g|goto CYCLE   c|continue   rc|rcontinue
+//   b|break IDX  (stop when instruction IDX is in EX)   d|delete   p|print
+//   m|mem ADDR   (byte address)   i|info   q|quit
+#define DBG_MAX_BREAK 16
+
+typedef struct {
+    TraceRecord last;               // record of the most recently simulated cycle
+    int bp[DBG_MAX_BREAK];
+    int nbp;
+    bool hit;                       // a breakpoint matched the last simulated cycle
+} Debugger;
+
+static void debugger_hook(void* ctx, const CPU* cpu, const TraceRecord* rec) {
+    Debugger* d = ctx;
+    (void)cpu;
+    d->last = *rec;
+    d->hit = false;
+    for (int i = 0; i < d->nbp; ++i)
+        if (rec->idx[TR_ID_EX] == d->bp[i]) d->hit = true;
+}
+
+static void debugger_show(const Debugger* d, const CPU* cpu) {
+    if (cpu->stats.cycles == 0) {
+        printf("At cycle 0 (nothing simulated yet)\n");
+        return;
+    }
+    print_cycle_state(stdout, cpu->program, cpu->source, cpu->inst_count, cpu->cfg.num_regs, &d->last);
+}
+
+/**
+ * @brief Find the latest cycle before the current one at which a breakpoint matches
+ * @return That cycle, or 0 if there is none (the CPU is then back at its starting cycle)
+ */
+static long long debugger_reverse_continue(Debugger* d, CheckpointLog* log, CPU* cpu) {
+    long long from = cpu->stats.cycles;
+    long long end = from - 1;        // last cycle still to scan
+    const Checkpoint* start = ckpt_find(log, end - 1);
+    // Indices, not pointers: nothing is appended while re-simulating old cycles, but
+    // this keeps the loop independent of that.
+    for (int k = start ? (int)(start - log->cp) : -1; k >= 0 && end >= 1; --k) {
+        long long hit = 0;
+        ckpt_restore(&log->cp[k], cpu);
+        while (cpu->stats.cycles < end && ckpt_step(log, cpu))
+            if (d->hit) hit = cpu->stats.cycles;
+        if (hit) return ckpt_goto(log, cpu, hit);
+        end = log->cp[k].cycle;
+    }
+    if (from > 0) ckpt_goto(log, cpu, from);
+    return 0;
+}
+
+/**
+ * @brief Interactive reverse debugging of the loaded program
+ * @return 0
+ */
+int run_debugger(CPU* cpu, long long interval) {
+    CheckpointLog log;
+    Debugger d;
+    memset(&d, 0, sizeof(d));
+    ckpt_log_init(&log, interval);
+    cpu->trace = NULL;
+    cpu->on_cycle = debugger_hook;
+    cpu->on_cycle_ctx = &d;
+    sim_start(cpu);
+    ckpt_take(&log, cpu);
+
+    char line[LINE_LEN];
+    while (fgets(line, sizeof(line), stdin)) {
+        char cmd[16] = "";
+        long long arg = 0;
+        int n = sscanf(line, "%15s %lld", cmd, &arg);
+        if (n < 1) continue;
+        long long now = cpu->stats.cycles;
+        if (strcmp(cmd, "s") == 0 || strcmp(cmd, "step") == 0) {
+            ckpt_goto(&log, cpu, now + (n > 1 ? arg : 1));
+            if (cpu->stats.cycles == now) printf("Program finished at cycle %lld\n", now);
+            else debugger_show(&d, cpu);
+        } else if (strcmp(cmd, "rs") == 0 || strcmp(cmd, "rstep") == 0) {
+            ckpt_goto(&log, cpu, now - (n > 1 ? arg : 1));
+            debugger_show(&d, cpu);
+        } else if ((strcmp(cmd, "g") == 0 || strcmp(cmd, "goto") == 0) && n > 1) {
+            if (ckpt_goto(&log, cpu, arg) < arg)
+                printf("Program finished at cycle %lld\n", cpu->stats.cycles);
+            debugger_show(&d, cpu);
+        } else if (strcmp(cmd, "c") == 0 || strcmp(cmd, "continue") == 0) {
+            d.hit = false;
+            while (ckpt_step(&log, cpu) && !d.hit) {
+            }
+            if (!d.hit) printf("Program finished at cycle %lld\n", cpu->stats.cycles);
+            debugger_show(&d, cpu);
+        } else if (strcmp(cmd, "rc") == 0 || strcmp(cmd, "rcontinue") == 0) {
+            if (debugger_reverse_continue(&d, &log, cpu) == 0)
+                printf("No earlier breakpoint hit\n");
+            debugger_show(&d, cpu);
+        } else if ((strcmp(cmd, "b") == 0 || strcmp(cmd, "break") == 0) && n > 1) {
+            if (d.nbp < DBG_MAX_BREAK && arg >= 0 && arg < cpu->inst_count) {
+                d.bp[d.nbp++] = (int)arg;
+                printf("Breakpoint %d: %s\n", d.nbp, cpu->source[arg]);
+            } else {
+                printf("Cannot set breakpoint at %lld\n", arg);
+            }
+        } else if (strcmp(cmd, "d") == 0 || strcmp(cmd, "delete") == 0) {
+            d.nbp = 0;
+        } else if (strcmp(cmd, "p") == 0 || strcmp(cmd, "print") == 0) {
+            debugger_show(&d, cpu);
+        } else if ((strcmp(cmd, "m") == 0 || strcmp(cmd, "mem") == 0) && n > 1) {
+            long long w = arg / WORD_SIZE_BYTES;
+            if (arg >= 0 && w < MEM_SIZE_WORDS)
+                printf("Memory[%lld] (byte addr=%lld) = %d\n", w, arg, cpu->memory[w]);
+            else
+                printf("Address out of range: %lld\n", arg);
+        } else if (strcmp(cmd, "i") == 0 || strcmp(cmd, "info") == 0) {
+            printf("cycle %lld, %d checkpoints every %lld cycles, memory pages %lld copied / %lld shared\n",
+                   cpu->stats.cycles, log.count, log.interval, log.pages_copied, log.pages_shared);
+        } else if (strcmp(cmd, "q") == 0 || strcmp(cmd, "quit") == 0) {
+            break;
+        } else {
+            printf("Unknown command: %s", line);
+        }
+        fflush(stdout);
+    }
+
+    cpu->on_cycle = NULL;
+    ckpt_log_free(&log);
+    return 0;
+}
+
+// ---------- Incremental re-simulation ----------
+// Checkpoints of the previous run are kept in a file. Each is keyed by the hash of the
+// program prefix fetched before it was taken. The ISA has no branches, so that prefix
+// is program[0..fetch_high): PC itself can move back after a value-prediction replay,
+// but nothing past fetch_high has been looked at. Once a kernel is edited, the latest checkpoint whose prefix is
+// unchanged is still exact, and simulation restarts from it. Anything else the run
+// depends on goes into one environment hash that must match: configuration, initial
+// registers and memory, and the checkpoint layout. A compressed file (CKPT_FILE_MAGIC_Z)
+// has the same contents after the magic, as a ZFile stream.
+#define CKPT_FILE_MAGIC "PSCKPT01"
+#define CKPT_FILE_MAGIC_Z "PSCKPTZ1"
+
+/**
+ * @brief prefix[i] = hash of the first i instructions (prefix has inst_count + 1 entries)
+ */
+void program_prefix_hashes(const CPU* cpu, uint64_t* prefix) {
+    prefix[0] = FNV_OFFSET;
+    for (int i = 0; i < cpu->inst_count; ++i) {
+        const Instruction* in = &cpu->program[i];
+        int f[5] = { in->op, in->rd, in->rs1, in->rs2, in->imm };
+        prefix[i + 1] = fnv1a(prefix[i], f, sizeof(f));
+    }
+}
+
+static uint64_t ckpt_env_hash(const CPU* cpu) {
+    uint32_t layout[3] = { (uint32_t)sizeof(Checkpoint), CKPT_PAGE_WORDS, MEM_SIZE_WORDS };
+    uint64_t h = fnv1a(FNV_OFFSET, layout, sizeof(layout));
+    h = fnv1a(h, &cpu->cfg, sizeof(cpu->cfg));
+    h = fnv1a(h, cpu->R, sizeof(cpu->R));
+    h = fnv1a(h, &cpu->handler, sizeof(cpu->handler));
+    h = fnv1a(h, cpu->guard, sizeof(cpu->guard[0]) * (size_t)cpu->nguards);
+    return fnv1a(h, cpu->memory, sizeof(int) * MEM_SIZE_WORDS);
+}
+
+void ckpt_log_truncate(CheckpointLog* log, int count) {
+    for (int i = count; i < log->count; ++i) {
+        for (int p = 0; p < CKPT_PAGES; ++p)
+            if (--log->cp[i].page[p]->refs == 0) free(log->cp[i].page[p]);
+        ckpt_free_parts(&log->cp[i]);
+    }
+    if (count < log->count) log->count = count;
+}
+
+/**
+ * @brief Save checkpoints with the program prefix hashes they were taken under
+ *
+ * Pages shared between consecutive checkpoints are written once.
+ * @param compressed Write the body as a compressed stream
+ * @return 0 on success
+ */
+int ckpt_save(const char* path, const CheckpointLog* log, uint64_t env, const uint64_t* prefix, int inst_count,
+              bool compressed) {
+    FILE* f = fopen(path, "wb");
+    if (!f) return -1;
+    int32_t npages = 0;
+    for (int i = 0; i < log->count; ++i)
+        for (int p = 0; p < CKPT_PAGES; ++p)
+            if (i == 0 || log->cp[i].page[p] != log->cp[i - 1].page[p]) npages++;
+    int64_t hdr[4] = { (int64_t)env, log->interval, inst_count, log->count };
+    fwrite(compressed ? CKPT_FILE_MAGIC_Z : CKPT_FILE_MAGIC, 1, 8, f);
+    ZFile z;
+    zf_init(&z, f, compressed);
+    zf_write(&z, hdr, sizeof(hdr));
+    zf_write(&z, prefix, sizeof(uint64_t) * ((size_t)inst_count + 1));
+    zf_write(&z, &npages, sizeof(npages));
+    for (int i = 0; i < log->count; ++i)
+        for (int p = 0; p < CKPT_PAGES; ++p)
+            if (i == 0 || log->cp[i].page[p] != log->cp[i - 1].page[p])
+                zf_write(&z, log->cp[i].page[p]->w, sizeof(int) * CKPT_PAGE_WORDS);
+    int32_t next_id = 0;
+    int32_t ids[CKPT_PAGES] = { 0 };
+    for (int i = 0; i < log->count; ++i) {
+        for (int p = 0; p < CKPT_PAGES; ++p)
+            if (i == 0 || log->cp[i].page[p] != log->cp[i - 1].page[p]) ids[p] = next_id++;
+        const Checkpoint* c = &log->cp[i];
+        zf_write(&z, c, offsetof(Checkpoint, dcache));
+        if (c->dcache) zf_write(&z, c->dcache, sizeof(DataCache));
+        if (c->tlb) zf_write(&z, c->tlb, sizeof(Tlb) * 2);
+        if (c->lvp) zf_write(&z, c->lvp, sizeof(LvpEntry) * (size_t)c->lvp_entries);
+        zf_write(&z, ids, sizeof(ids));
+    }
+    bool ok = zf_finish(&z);
+    return fclose(f) == 0 && ok ? 0 : -1;
+}
+
+/**
+ * @brief Read the optional state ckpt_save wrote after a checkpoint's core fields
+ * @return false (and no state allocated) on a short or inconsistent file
+ */
+static bool ckpt_read_parts(ZFile* z, Checkpoint* c) {
+    c->dcache = NULL;
+    c->tlb = NULL;
+    c->lvp = NULL;
+    if ((c->parts & ~(CKPT_DCACHE | CKPT_TLB | CKPT_LVP)) != 0 ||
+        ((c->parts & CKPT_LVP) && (c->lvp_entries < 1 || c->lvp_entries > MAX_INST)))
+        return false;
+    size_t lvp_bytes = sizeof(LvpEntry) * (size_t)c->lvp_entries;
+    bool ok = true;
+    if (c->parts & CKPT_DCACHE)
+        ok = (c->dcache = malloc(sizeof(DataCache))) && zf_read(z, c->dcache, sizeof(DataCache)) == sizeof(DataCache);
+    if (ok && (c->parts & CKPT_TLB))
+        ok = (c->tlb = malloc(sizeof(Tlb) * 2)) && zf_read(z, c->tlb, sizeof(Tlb) * 2) == sizeof(Tlb) * 2;
+    if (ok && (c->parts & CKPT_LVP))
+        ok = (c->lvp = malloc(lvp_bytes)) && zf_read(z, c->lvp, lvp_bytes) == lvp_bytes;
+    if (!ok) {
+        ckpt_free_parts(c);
+        c->dcache = NULL;
+        c->tlb = NULL;
+        c->lvp = NULL;
+    }
+    return ok;
+}
+
+/**
+ * @brief Load checkpoints saved by ckpt_save for the same environment
+ * @param old_prefix Receives the saved program's prefix hashes (MAX_INST + 1 entries)
+ * @return Saved program's instruction count, or -1 if absent or incompatible
+ */
+int ckpt_load(const char* path, CheckpointLog* log, uint64_t env, uint64_t* old_prefix) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return -1;
+    char magic[8];
+    int64_t hdr[4];
+    int32_t npages = 0;
+    int inst_count = -1;
+    MemPage** pool = NULL;
+    bool ok = fread(magic, 1, 8, f) == 8 &&
+              (memcmp(magic, CKPT_FILE_MAGIC, 8) == 0 || memcmp(magic, CKPT_FILE_MAGIC_Z, 8) == 0);
+    ZFile z;
+    zf_init(&z, f, ok && memcmp(magic, CKPT_FILE_MAGIC_Z, 8) == 0);
+    ok = ok && zf_read(&z, hdr, sizeof(hdr)) == sizeof(hdr) && (uint64_t)hdr[0] == env &&
+         hdr[2] >= 0 && hdr[2] <= MAX_INST && hdr[3] >= 0 &&
+         zf_read(&z, old_prefix, sizeof(uint64_t) * ((size_t)hdr[2] + 1)) == sizeof(uint64_t) * ((size_t)hdr[2] + 1) &&
+         zf_read(&z, &npages, sizeof(npages)) == sizeof(npages) && npages >= 0 &&
+         ((int64_t)npages + CKPT_PAGES - 1) / CKPT_PAGES <= hdr[3];
+    if (ok) {
+        pool = calloc((size_t)npages + 1, sizeof(MemPage*));
+        ok = pool != NULL;
+        for (int32_t i = 0; ok && i < npages; ++i) {
+            pool[i] = malloc(sizeof(MemPage));
+            ok = pool[i] && zf_read(&z, pool[i]->w, sizeof(int) * CKPT_PAGE_WORDS) == sizeof(int) * CKPT_PAGE_WORDS;
+            if (ok) pool[i]->refs = 0;
+        }
+    }
+    ckpt_log_init(log, ok ? hdr[1] : 1);
+    for (int64_t i = 0; ok && i < hdr[3]; ++i) {
+        Checkpoint c = { .dcache = NULL };
+        int32_t ids[CKPT_PAGES];
+        ok = zf_read(&z, &c, offsetof(Checkpoint, dcache)) == offsetof(Checkpoint, dcache) &&
+             ckpt_read_parts(&z, &c) && zf_read(&z, ids, sizeof(ids)) == sizeof(ids);
+        for (int p = 0; ok && p < CKPT_PAGES; ++p) {
+            ok = ids[p] >= 0 && ids[p] < npages;
+            if (ok) {
+                c.page[p] = pool[ids[p]];
+                c.page[p]->refs++;
+            }
+        }
+        if (!ok) {
+            ckpt_free_parts(&c);
+            break;
+        }
+        if (log->count == log->cap) {
+            Checkpoint* cp = realloc(log->cp, sizeof(Checkpoint) * (size_t)(log->cap ? 2 * log->cap : 64));
+            if (!cp) {
+                ckpt_free_parts(&c);
+                ok = false;
+                break;
+            }
+            log->cp = cp;
+            log->cap = log->cap ? 2 * log->cap : 64;
+        }
+        log->cp[log->count++] = c;
+    }
+    if (ok) {
+        inst_count = (int)hdr[2];
+        for (int32_t i = 0; i < npages; ++i)
+            if (pool[i]->refs == 0) free(pool[i]);
+    } else {
+        // A file cut short can leave page references no loaded checkpoint holds, so
+        // free every page once through the pool rather than by reference count.
+        for (int32_t i = 0; pool && i < npages; ++i) free(pool[i]);
+        for (int i = 0; i < log->count; ++i) ckpt_free_parts(&log->cp[i]);
+        free(log->cp);
+        memset(log, 0, sizeof(*log));
+    }
+    free(pool);
+    zf_free(&z);
+    fclose(f);
+    return inst_count;
+}
+
+/**
+ * @brief Run the loaded program, resuming from the previous run's checkpoints when possible
+ * @param path Checkpoint file (read if present, then rewritten)
+ * @param compressed Rewrite it compressed
+ * @return 0 on success, 1 if the checkpoint file could not be written
+ */
+int run_incremental(CPU* cpu, const char* path, long long interval, bool compressed) {
+    uint64_t* prefix = malloc(sizeof(uint64_t) * (MAX_INST + 1));
+    uint64_t* old_prefix = malloc(sizeof(uint64_t) * (MAX_INST + 1));
+    uint64_t env = ckpt_env_hash(cpu);
+    program_prefix_hashes(cpu, prefix);
+
+    CheckpointLog log;
+    int old_count = ckpt_load(path, &log, env, old_prefix);
+    int first_change = -1;
+    int resume = -1;
+    if (old_count >= 0) {
+        first_change = 0;
+        while (first_change < old_count && first_change < cpu->inst_count &&
+               old_prefix[first_change + 1] == prefix[first_change + 1])
+            first_change++;
+        // A checkpoint is exact if everything fetched before it is unchanged. One taken
+        // after fetch ran off the old program's end also saw that end, so it is not.
+        for (int i = log.count - 1; i >= 0 && resume < 0; --i) {
+            int seen = log.cp[i].fetch_high;
+            if (seen < old_count && seen <= first_change) resume = i;
+        }
+        ckpt_log_truncate(&log, resume + 1);
+        if (interval != log.interval) {
+            ckpt_log_free(&log);
+            ckpt_log_init(&log, interval);
+            resume = -1;
+        }
+    } else {
+        ckpt_log_init(&log, interval);
+    }
+
+    cpu->trace = NULL;
+    sim_start(cpu);
+    if (resume >= 0) ckpt_restore(&log.cp[resume], cpu);
+    else ckpt_take(&log, cpu);
+    long long from = cpu->stats.cycles;
+    while (ckpt_step(&log, cpu)) {
+    }
+
+    if (old_count < 0)
+        printf("No usable checkpoints in %s; simulated all %lld cycles\n", path, cpu->stats.cycles);
+    else if (first_change == old_count && first_change == cpu->inst_count)
+        printf("Program unchanged; resumed at cycle %lld, simulated %lld of %lld cycles\n",
+               from, cpu->stats.cycles - from, cpu->stats.cycles);
+    else
+        printf("First changed instruction #%d; resumed at cycle %lld, simulated %lld of %lld cycles\n",
+               first_change, from, cpu->stats.cycles - from, cpu->stats.cycles);
+
+    int rc = ckpt_save(path, &log, env, prefix, cpu->inst_count, compressed) == 0 ? 0 : 1;
+    if (rc) fprintf(stderr, "Could not write %s.\n", path);
+    ckpt_log_free(&log);
+    free(old_prefix);
+    free(prefix);
+    return rc;
+}
+
+// ---------- Run logs (replay) ----------
+static int config_parse_list(SimConfig* c, const char* list) {
+    char buf[512];
+    snprintf(buf, sizeof(buf), "%s", list);
+    *c = default_config();
+    for (char* tok = strtok(buf, " "); tok; tok = strtok(NULL, " "))
+        if (config_set(c, tok) != 0) return -1;
+    return config_validate(c) ? -1 : 0;
+}
+
+static char* next_field(char** s) {
+    char* f = *s;
+    if (!f) return NULL;
+    char* tab = strchr(f, '\t');
+    if (tab) {
+        *tab = '\0';
+        *s = tab + 1;
+    } else {
+        *s = NULL;
+    }
+    return f;
+}
+
+/**
+ * @brief Repeat one logged simulation alone and compare it with the recorded result
+ * @return true if the cycles and result digest are identical
+ */
+static bool replay_event(char* line, CPU* cpu, long long event) {
+    char* rest = line;
+    char* kind = next_field(&rest);
+    char* f[9] = { 0 };
+    int nf = 0;
+    while (nf < 9 && (f[nf] = next_field(&rest)) != NULL) nf++;
+
+    long long want_cycles = 0;
+    unsigned long long want_digest = 0;
+    SimConfig cfg;
+    cpu_reset(cpu);
+    if (strcmp(kind, "sim") == 0 && nf == 6) {
+        // job, config, program, image hash, cycles, digest
+        // Load as a sweep does, with every register; a single run that dropped lines
+        // naming registers beyond its num_regs is rebuilt under that num_regs instead.
+        bool ok = config_parse_list(&cfg, f[1]) == 0;
+        cpu->cfg = cfg;
+        cpu->cfg.num_regs = MAX_REGS;
+        ok = ok && program_load(cpu, f[2]) == 0;
+        if (ok && program_max_reg(cpu) >= cfg.num_regs) {
+            cpu_reset(cpu);
+            cpu->cfg = cfg;
+            ok = program_load(cpu, f[2]) == 0;
+        }
+        cpu->cfg = cfg;
+        if (!ok) {
+            printf("event %lld: cannot rebuild sim of %s\n", event, f[2]);
+            return false;
+        }
+        if (strtoull(f[3], NULL, 16) != cpu_image_hash(cpu)) {
+            printf("event %lld: %s changed since it was recorded\n", event, f[2]);
+            return false;
+        }
+        want_cycles = atoll(f[4]);
+        want_digest = strtoull(f[5], NULL, 16);
+        printf("event %lld: sim %s [%s]", event, f[2], f[1]);
+    } else if (strcmp(kind, "fuzz") == 0 && (nf == 8 || nf == 9)) {
+        // index, seed, length, hazard, mem_words, fault_pct (not in older logs), config, cycles, digest
+        int k = nf - 8;
+        GenParams gp = { atoi(f[2]), atoi(f[3]), atoi(f[4]), 0, k ? atoi(f[5]) : 0 };
+        uint64_t seed = strtoull(f[1], NULL, 10);
+        if (config_parse_list(&cfg, f[5 + k]) != 0) {
+            printf("event %lld: bad configuration\n", event);
+            return false;
+        }
+        cpu->cfg = cfg;
+        gen_random_program(cpu, seed, &gp);
+        want_cycles = atoll(f[6 + k]);
+        want_digest = strtoull(f[7 + k], NULL, 16);
+        printf("event %lld: fuzz program #%s (seed %s) [%s]", event, f[0], f[1], f[5 + k]);
+    } else {
+        printf("event %lld: malformed '%s' entry\n", event, kind);
+        return false;
+    }
+
+    int R[MAX_REGS];
+    int* mem = malloc(sizeof(int) * MEM_SIZE_WORDS);
+    vm_write_page_table(&cfg, cpu->memory);
+    memcpy(R, cpu->R, sizeof(R));
+    memcpy(mem, cpu->memory, sizeof(int) * MEM_SIZE_WORDS);
+    interp_run(R, mem, cpu);
+    cpu->cfg = cfg;
+    sim_start(cpu);
+    sim_run(cpu);
+    bool matches_model = memcmp(cpu->R, R, sizeof(R)) == 0 &&
+                         memcmp(cpu->memory, mem, sizeof(int) * MEM_SIZE_WORDS) == 0;
+    free(mem);
+
+    bool same = cpu->stats.cycles == want_cycles && cpu_state_digest(cpu) == want_digest;
+    if (same)
+        printf(": identical (%lld cycles%s)\n", want_cycles, matches_model ? "" : ", reference model mismatch reproduced");
+    else
+        printf(": DIFFERS (%lld cycles, recorded %lld)\n", cpu->stats.cycles, want_cycles);
+    return same;
+}
+
+/**
+ * @brief Re-run the simulations of a run log single-threaded
+ * @param only 1-based event to replay, or 0 for all of them
+ * @return 0 if every replayed event reproduced bit-exactly
+ */
+int run_replay(const char* path, long long only) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Could not open %s.\n", path);
+        return 1;
+    }
+    CPU* cpu = cpu_new();
+    char* line = NULL;
+    size_t cap = 0;
+    long long event = 0, replayed = 0, differ = 0;
+    while (getline(&line, &cap, f) >= 0) {
+        chomp(line);
+        if (line[0] == '#' || line[0] == '\0') continue;
+        if (strncmp(line, "note\t", 5) == 0) {
+            if (!only) printf("note: %s\n", line + 5);
+            continue;
+        }
+        ++event;
+        if (only && event != only) continue;
+        replayed++;
+        if (!replay_event(line, cpu, event)) differ++;
+    }
+    printf("%lld event(s) replayed, %lld differ\n", replayed, differ);
+    if (only && replayed == 0) fprintf(stderr, "%s has no event %lld.\n", path, only);
+    else if (replayed == 0) fprintf(stderr, "No replayable events in %s.\n", path);
+    free(line);
+    cpu_free(cpu);
+    fclose(f);
+    return differ || replayed == 0 ? 1 : 0;
+}
+
+// ---------- main ----------
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [options] [program]     (program defaults to inst.txt)\n"
+            "  --set name=value    override a pipeline parameter (repeatable)\n"
+            "  --quiet             do not print the per-cycle trace\n"
+            "  --stats             print cycle, CPI and stall statistics\n"
+            "  --dse SPEC [prog..] sweep the parameters listed in SPEC in parallel\n"
+            "  --bench prog...     run benchmark kernels and check their golden state\n"
+            "  --repeat N          simulations per kernel for --bench timing\n"
+            "  --fast              with --bench / --dse: packed timing model where the config allows\n"
+            "  --perf LOG prog...  log simulator throughput per kernel to LOG\n"
+            "  --baseline FILE     with --perf: fail on a significant slowdown vs FILE\n"
+            "  --threshold PCT     with --perf: slowdown that counts as a regression (5)\n"
+            "  --samples N         with --perf: timing samples per kernel (10)\n"
+            "  --fuzz N            differential-test N random programs against the reference model\n"
+            "  --gen FILE          write one random program (with its expected state) to FILE\n"
+            "  --seed S            random seed for --fuzz / --gen (1)\n"
+            "  --length N          instructions per random program (48)\n"
+            "  --hazard PCT        chance an operand reuses a recent destination (50)\n"
+            "  --faults PCT        chance a random LOAD/STORE faults (adds a guard region and handler)\n"
+            "  --live N            with --gen: keep N values live, spilling past num_regs\n"
+            "  --threads N         worker threads for --fuzz / --to-text (0 = all cores)\n"
+            "  --fixed-config      with --fuzz: keep the given parameters instead of varying them\n"
+            "  --trace-out FILE    also write the cycle trace to FILE in binary form\n"
+            "  --to-text TRACE     print a binary trace as the text trace, formatting on all cores\n"
+            "  --cycles A:B        trace only cycles A..B (either end may be omitted)\n"
+            "  --pcs A:B           trace only cycles with instructions A..B in the pipeline\n"
+            "  --ops LIST          trace only cycles with these opcodes in the pipeline (names, alu, mem)\n"
+            "  --addrs A:B         trace only cycles with a [MEM] access to byte addresses A..B\n"
+            "  --addr-trace FILE   write every data access (type, address, instruction, cycle) to FILE\n"
+            "  --mrc FILE          LRU miss ratios of every cache size in one run (cache_line lines) to FILE\n"
+            "  --footprint FILE    working sets, hottest words and per-instruction footprints; time series to FILE\n"
+            "  --window N          with --footprint: cycles per time series row (100)\n"
+            "  --compress          with --trace-out / --addr-trace / --incremental: write the file compressed\n"
+            "  --compare REF       check the run against a reference trace (text or binary)\n"
+            "  --debug             step the program forwards and backwards (commands on stdin)\n"
+            "  --checkpoint-every N  with --debug / --incremental: cycles between checkpoints (1000)\n"
+            "  --incremental FILE  resume from the checkpoints of the previous run saved in FILE\n"
+            "  --record LOG        log the simulations of this run (single run, --dse; --fuzz: the failing one)\n"
+            "  --replay LOG        repeat the logged simulations and check they are bit-exact\n"
+            "  --event K           with --replay: repeat only the K-th logged simulation\n"
+            "  --smt POLICY prog.. run 2-4 programs as threads of one pipeline (rr / icount fetch)\n"
+            "parameters:",
+            prog);
+    for (int i = 0; i < NUM_CONFIG_PARAMS; ++i) fprintf(stderr, " %s", CONFIG_PARAMS[i].name);
+    fprintf(stderr, "\n");
+}
+
+/**
+ * @brief Main entry point: load program, run pipeline simulation
+ * @return 0 on success, 1 if program load failed
+ */
+int main(int argc, char** argv) {
+    SimConfig cfg = default_config();
+    bool quiet = false, stats = false, bench = false;
+    int repeat = 1, samples = 10;
+    double threshold = 5.0;
+    const char* dse_spec = NULL;
+    const char* perf_log = NULL;
+    const char* baseline = NULL;
+    const char* gen_path = NULL;
+    long long fuzz = 0;
+    uint64_t seed = 1;
+    int threads = 0;
+    bool fixed_config = false;
+    bool fast = false;
+    const char* trace_out = NULL;
+    const char* to_text = NULL;
+    const char* addr_out = NULL;
+    const char* mrc_out = NULL;
+    const char* footprint_out = NULL;
+    long long fp_window = 100;
+    TraceFilter filter = trace_filter_all();
+    bool compress = false;
+    const char* compare = NULL;
+    bool debug = false;
+    const char* record = NULL;
+    const char* incremental = NULL;
+    const char* replay = NULL;
+    long long replay_event_no = 0;
+    long long ckpt_interval = 1000;
+    int smt_policy = -1;
+    GenParams gp = { 48, 50, 32, 0, 0 };
+    const char* program = "inst.txt";
+    int argi = 1;
+
+    for (; argi < argc; ++argi) {
+        const char* a = argv[argi];
+        if (strcmp(a, "--set") == 0 && argi + 1 < argc) {
+            if (config_set(&cfg, argv[++argi]) != 0) {
+                fprintf(stderr, "Bad parameter '%s'.\n", argv[argi]);
+                return 1;
+            }
+        } else if (strcmp(a, "--quiet") == 0) {
+            quiet = true;
+        } else if (strcmp(a, "--stats") == 0) {
+            stats = true;
+        } else if (strcmp(a, "--dse") == 0 && argi + 1 < argc) {
+            dse_spec = argv[++argi];
+        } else if (strcmp(a, "--bench") == 0) {
+            bench = true;
+        } else if (strcmp(a, "--repeat") == 0 && argi + 1 < argc) {
+            repeat = atoi(argv[++argi]);
+            if (repeat < 1) repeat = 1;
+        } else if (strcmp(a, "--perf") == 0 && argi + 1 < argc) {
+            perf_log = argv[++argi];
+        } else if (strcmp(a, "--baseline") == 0 && argi + 1 < argc) {
+            baseline = argv[++argi];
+        } else if (strcmp(a, "--threshold") == 0 && argi + 1 < argc) {
+            threshold = atof(argv[++argi]);
+        } else if (strcmp(a, "--samples") == 0 && argi + 1 < argc) {
+            samples = atoi(argv[++argi]);
+        } else if (strcmp(a, "--fuzz") == 0 && argi + 1 < argc) {
+            fuzz = atoll(argv[++argi]);
+        } else if (strcmp(a, "--gen") == 0 && argi + 1 < argc) {
+            gen_path = argv[++argi];
+        } else if (strcmp(a, "--seed") == 0 && argi + 1 < argc) {
+            seed = strtoull(argv[++argi], NULL, 0);
+        } else if (strcmp(a, "--length") == 0 && argi + 1 < argc) {
+            gp.length = atoi(argv[++argi]);
+            if (gp.length < 1 || gp.length > MAX_INST) gp.length = 48;
+        } else if (strcmp(a, "--hazard") == 0 && argi + 1 < argc) {
+            gp.hazard_pct = atoi(argv[++argi]);
+        } else if (strcmp(a, "--faults") == 0 && argi + 1 < argc) {
+            gp.fault_pct = atoi(argv[++argi]);
+            if (gp.fault_pct < 0 || gp.fault_pct > 100) gp.fault_pct = 0;
+        } else if (strcmp(a, "--live") == 0 && argi + 1 < argc) {
+            gp.live = atoi(argv[++argi]);
+            if (gp.live < 0 || gp.live > GEN_MAX_LIVE) gp.live = 0;
+        } else if (strcmp(a, "--threads") == 0 && argi + 1 < argc) {
+            threads = atoi(argv[++argi]);
+        } else if (strcmp(a, "--fixed-config") == 0) {
+            fixed_config = true;
+        } else if (strcmp(a, "--fast") == 0) {
+            fast = true;
+        } else if (strcmp(a, "--trace-out") == 0 && argi + 1 < argc) {
+            trace_out = argv[++argi];
+        } else if (strcmp(a, "--to-text") == 0 && argi + 1 < argc) {
+            to_text = argv[++argi];
+        } else if (strcmp(a, "--cycles") == 0 && argi + 1 < argc) {
+            if (parse_range(argv[++argi], &filter.cycle_from, &filter.cycle_to) != 0) {
+                fprintf(stderr, "Bad cycle range '%s'.\n", argv[argi]);
+                return 1;
+            }
+        } else if (strcmp(a, "--pcs") == 0 && argi + 1 < argc) {
+            if (parse_range(argv[++argi], &filter.pc_from, &filter.pc_to) != 0) {
+                fprintf(stderr, "Bad instruction range '%s'.\n", argv[argi]);
+                return 1;
+            }
+        } else if (strcmp(a, "--ops") == 0 && argi + 1 < argc) {
+            if (parse_op_classes(&filter, argv[++argi]) != 0) {
+                fprintf(stderr, "Bad opcode list '%s' (opcode names, alu, mem).\n", argv[argi]);
+                return 1;
+            }
+        } else if (strcmp(a, "--addrs") == 0 && argi + 1 < argc) {
+            filter.by_addr = true;
+            if (parse_range(argv[++argi], &filter.addr_from, &filter.addr_to) != 0) {
+                fprintf(stderr, "Bad address range '%s'.\n", argv[argi]);
+                return 1;
+            }
+        } else if (strcmp(a, "--addr-trace") == 0 && argi + 1 < argc) {
+            addr_out = argv[++argi];
+        } else if (strcmp(a, "--mrc") == 0 && argi + 1 < argc) {
+            mrc_out = argv[++argi];
+        } else if (strcmp(a, "--footprint") == 0 && argi + 1 < argc) {
+            footprint_out = argv[++argi];
+        } else if (strcmp(a, "--window") == 0 && argi + 1 < argc) {
+            fp_window = atoll(argv[++argi]);
+        } else if (strcmp(a, "--compress") == 0) {
+            compress = true;
+        } else if (strcmp(a, "--compare") == 0 && argi + 1 < argc) {
+            compare = argv[++argi];
+        } else if (strcmp(a, "--record") == 0 && argi + 1 < argc) {
+            record = argv[++argi];
+        } else if (strcmp(a, "--replay") == 0 && argi + 1 < argc) {
+            replay = argv[++argi];
+        } else if (strcmp(a, "--event") == 0 && argi + 1 < argc) {
+            replay_event_no = atoll(argv[++argi]);
+        } else if (strcmp(a, "--incremental") == 0 && argi + 1 < argc) {
+            incremental = argv[++argi];
+        } else if (strcmp(a, "--debug") == 0) {
+            debug = true;
+        } else if (strcmp(a, "--checkpoint-every") == 0 && argi + 1 < argc) {
+            ckpt_interval = atoll(argv[++argi]);
+        } else if (strcmp(a, "--smt") == 0 && argi + 1 < argc) {
+            const char* name = argv[++argi];
+            for (int p = SMT_ROUND_ROBIN; p <= SMT_ICOUNT; ++p)
+                if (strcmp(name, SMT_POLICY_NAMES[p]) == 0) smt_policy = p;
+            if (smt_policy < 0) {
+                fprintf(stderr, "Unknown fetch policy '%s' (rr or icount).\n", name);
+                return 1;
+            }
+        } else if (a[0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            break;
+        }
+    }
+    const char* bad = config_validate(&cfg);
+    if (bad) {
+        fprintf(stderr, "Invalid configuration: %s\n", bad);
+        return 1;
+    }
+    // A resumed run only simulates the cycles after its checkpoint, so observers of the
+    // cycles or data accesses would see part of the run and report it as the whole.
+    const char* observer = trace_out ? "--trace-out" : addr_out ? "--addr-trace" : mrc_out ? "--mrc"
+                         : footprint_out ? "--footprint" : NULL;
+    if (incremental && observer) {
+        fprintf(stderr, "%s needs every cycle simulated and cannot be used with --incremental.\n", observer);
+        return 1;
+    }
+    if (replay)
+        return run_replay(replay, replay_event_no);
+    if (to_text)
+        return run_convert(to_text, &filter, threads);
+    RunLog* log = NULL;
+    if (record && !(log = runlog_open(record, argc, argv))) {
+        fprintf(stderr, "Could not write %s.\n", record);
+        return 1;
+    }
+    if (dse_spec) {
+        int rc = run_dse(dse_spec, &cfg, argv + argi, argc - argi, log, fast);
+        runlog_close(log);
+        return rc;
+    }
+    if (fuzz > 0) {
+        int rc = run_fuzz(&cfg, fuzz, seed, &gp, !fixed_config, threads, log);
+        runlog_close(log);
+        return rc;
+    }
+    if (gen_path) {
+        CPU* img = cpu_new();
+        int R[MAX_REGS];
+        int* mem = malloc(sizeof(int) * MEM_SIZE_WORDS);
+        FILE* f = fopen(gen_path, "w");
+        runlog_close(log);
+        if (!f) {
+            fprintf(stderr, "Could not open %s.\n", gen_path);
+            return 1;
+        }
+        cpu_reset(img);
+        img->cfg = cfg;
+        int spills = gen_random_program(img, seed, &gp);
+        memcpy(R, img->R, sizeof(R));
+        memcpy(mem, img->memory, sizeof(int) * MEM_SIZE_WORDS);
+        interp_run(R, mem, img);
+        fprintf(f, "# random program: seed %llu, hazard %d%%\n", (unsigned long long)seed, gp.hazard_pct);
+        if (gp.live > 0)
+            fprintf(f, "# register pressure: %d live values in %d registers, %d spill/reload instructions\n",
+                    gp.live, cfg.num_regs, spills);
+        program_write_image(f, img, R, mem);
+        fclose(f);
+        free(mem);
+        cpu_free(img);
+        return 0;
+    }
+    if (smt_policy >= 0) {
+        runlog_close(log);
+        return run_smt(&cfg, smt_policy, argv + argi, argc - argi);
+    }
+    if (bench || perf_log) {
+        runlog_close(log);
+        if (argi == argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (perf_log)
+            return run_perf(&cfg, argv + argi, argc - argi, repeat, samples, perf_log, baseline, threshold);
+        return run_bench(&cfg, argv + argi, argc - argi, repeat, fast);
+    }
+    if (argi < argc) program = argv[argi];
+
+    CPU* cpu = cpu_new();
+    cpu_reset(cpu);
+    cpu->cfg = cfg;
+
+    if (program_load(cpu, program) != 0) {
+        fprintf(stderr, "Could not open %s. Please create it.\n", program);
+        runlog_close(log);
+        cpu_free(cpu);
+        return 1;
+    }
+
+    if (compare || debug) {
+        runlog_close(log);
+        int rc = compare ? run_compare(cpu, compare) : run_debugger(cpu, ckpt_interval);
+        cpu_free(cpu);
+        return rc;
+    }
+
+    TraceWriter tw;
+    FILE* tf = NULL;
+    if (trace_out) {
+        tf = fopen(trace_out, "wb");
+        if (!tf || trace_write_header(tf, cpu, compress) != 0 || trace_writer_open(&tw, tf, compress) != 0) {
+            fprintf(stderr, "Could not write %s.\n", trace_out);
+            if (tf) fclose(tf);
+            runlog_close(log);
+            cpu_free(cpu);
+            return 1;
+        }
+        cpu->on_cycle = trace_write_hook;
+        cpu->on_cycle_ctx = &tw;
+    }
+    AccessFanout access = { .n = 0 };
+    AddrTrace at;
+    if (addr_out) {
+        if (addr_trace_open(&at, addr_out, compress) != 0) {
+            fprintf(stderr, "Could not write %s.\n", addr_out);
+            if (tf) trace_writer_close(&tw);
+            runlog_close(log);
+            cpu_free(cpu);
+            return 1;
+        }
+        access_fanout_add(&access, addr_trace_hook, &at);
+    }
+    StackDist* sd = NULL;
+    if (mrc_out) {
+        sd = sd_new(cfg.cache_line_bytes);
+        access_fanout_add(&access, sd_hook, sd);
+    }
+    Footprint* fp = NULL;
+    FILE* fp_csv = NULL;
+    if (footprint_out) {
+        fp_csv = fopen(footprint_out, "w");
+        if (!fp_csv) fprintf(stderr, "Could not write %s.\n", footprint_out);
+        fp = fp_new(&cfg, fp_window, fp_csv);
+        access_fanout_add(&access, fp_hook, fp);
+    }
+    if (access.n) {
+        cpu->on_access = access_fanout_hook;
+        cpu->on_access_ctx = &access;
+    }
+
+    uint64_t image_hash = cpu_image_hash(cpu);
+    if (incremental) {
+        // The skipped cycles are not re-simulated, so there is no per-cycle trace.
+        if (run_incremental(cpu, incremental, ckpt_interval, compress) != 0) {
+            runlog_close(log);
+            cpu_free(cpu);
+            return 1;
+        }
+    } else {
+        TraceText text;
+        if (!quiet && trace_text_open(&text, stdout, cpu->program, cpu->source, cpu->inst_count) == 0) {
+            trace_text_filter(&text, &filter);
+            cpu->trace_text = &text;
+        } else
+            cpu->trace = quiet ? NULL : stdout;
+        sim_start(cpu);
+        sim_run(cpu);
+        if (cpu->trace_text) {
+            trace_text_close(&text);
+            cpu->trace_text = NULL;
+        }
+    }
+    if (tf && trace_writer_close(&tw) != 0) fprintf(stderr, "Could not write %s.\n", trace_out);
+    if (addr_out && addr_trace_close(&at) < 0) fprintf(stderr, "Could not write %s.\n", addr_out);
+    runlog_sim(log, 0, program, image_hash, cpu);
+    runlog_close(log);
+
+    // Final summary
+    print_final_state(stdout, cpu);
+    if (stats) print_stats(stdout, cpu);
+    if (sd) {
+        FILE* csv = fopen(mrc_out, "w");
+        if (!csv) fprintf(stderr, "Could not write %s.\n", mrc_out);
+        sd_report(stdout, csv, sd);
+        if (csv) fclose(csv);
+        free(sd);
+    }
+    if (fp) {
+        fp_report(stdout, fp, cpu);
+        if (fp_csv) fclose(fp_csv);
+        free(fp);
+    }
+    if (stats && (cfg.fusion || cfg.move_elim || cfg.lvp)) {
+        // Same program without the study features, to show what they bought
+        CPU* base = cpu_new();
+        cpu_reset(base);
+        base->cfg = config_without_studies(&cfg);
+        if (program_load(base, program) == 0) {
+            sim_start(base);
+            sim_run(base);
+            print_study_savings(stdout, cpu, base);
+        }
+        cpu_free(base);
+    }
 
+    cpu_free(cpu);
     return 0;
 }